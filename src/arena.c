@@ -2,34 +2,127 @@
 #include <stdlib.h>
 #include <assert.h>
 
-Arena arena_init(size_t capacity)
+#define ARENA_ALIGN 8
+
+Arena arena_init(size_t block_size)
 {
     Arena arena;
-    arena.capacity = capacity;
-    arena.ptr = 0;
-    arena.data = malloc(sizeof(*arena.data) * arena.capacity);
+    arena.head = NULL;
+    arena.free = NULL;
+    arena.block_size = block_size;
+    arena.used = 0;
+    arena.high_water = 0;
 
     return arena;
 }
 
+static void free_blocks(ArenaBlock *block)
+{
+    while (block) {
+        ArenaBlock *next = block->next;
+        free(block);
+        block = next;
+    }
+}
+
 void arena_deinit(Arena *arena)
 {
-    free(arena->data);
-    arena->data = NULL;
-    arena->capacity = 0;
-    arena->ptr = 0;
+    free_blocks(arena->head);
+    free_blocks(arena->free);
+    arena->head = NULL;
+    arena->free = NULL;
+    arena->used = 0;
+}
+
+// Takes the first released block big enough, or mallocs a new one.
+static ArenaBlock* new_block(Arena *arena, size_t size)
+{
+    for (ArenaBlock **link = &arena->free; *link; link = &(*link)->next) {
+        ArenaBlock *block = *link;
+        if (block->capacity >= size) {
+            *link = block->next;
+            return block;
+        }
+    }
+
+    size_t capacity = size > arena->block_size ? size : arena->block_size;
+    ArenaBlock *block = malloc(sizeof(ArenaBlock) + capacity);
+    assert(block && "Arena failed to allocate a block");
+    block->capacity = capacity;
+
+    return block;
 }
 
 void* arena_alloc(Arena *arena, size_t size)
 {
-    assert(size + arena->ptr <= arena->capacity && "Arena ran out of space, fix later");
+    size = (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
 
-    if (arena->ptr + size > arena->capacity) {
-        arena->ptr = 0;
+    ArenaBlock *block = arena->head;
+    if (!block || block->used + size > block->capacity) {
+        block = new_block(arena, size);
+        block->used = 0;
+        block->next = arena->head;
+        arena->head = block;
     }
 
-    void *ptr = &arena->data[arena->ptr];
-    arena->ptr += size;
+    void *ptr = &block->data[block->used];
+    block->used += size;
+    arena->used += size;
+    if (arena->used > arena->high_water) arena->high_water = arena->used;
 
     return ptr;
 }
+
+// Grows or shrinks the most recent allocation in place. Returns false, leaving
+// it alone, if ptr isn't the last allocation or its block has no room.
+bool arena_resize(Arena *arena, void *ptr, size_t size, size_t new_size)
+{
+    ArenaBlock *block = arena->head;
+    if (!block || (uint8_t*)ptr < block->data) return false;
+
+    size = (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+    new_size = (new_size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+    size_t offset = (uint8_t*)ptr - block->data;
+    if (offset + size != block->used || offset + new_size > block->capacity) return false;
+
+    block->used = offset + new_size;
+    arena->used = arena->used - size + new_size;
+    if (arena->used > arena->high_water) arena->high_water = arena->used;
+
+    return true;
+}
+
+ArenaMark arena_mark(Arena *arena)
+{
+    return (ArenaMark){
+        .block = arena->head,
+        .block_used = arena->head ? arena->head->used : 0,
+        .used = arena->used,
+    };
+}
+
+// Frees everything allocated after the mark, blocks started since then go to
+// the free list.
+void arena_reset_to_mark(Arena *arena, ArenaMark mark)
+{
+    while (arena->head != mark.block) {
+        ArenaBlock *block = arena->head;
+        assert(block && "Arena mark doesn't belong to this arena");
+        arena->head = block->next;
+        block->next = arena->free;
+        arena->free = block;
+    }
+
+    if (arena->head) arena->head->used = mark.block_used;
+    arena->used = mark.used;
+}
+
+void arena_reset(Arena *arena)
+{
+    arena_reset_to_mark(arena, (ArenaMark){0});
+}
+
+size_t arena_high_water(Arena *arena)
+{
+    return arena->high_water;
+}
@@ -1,14 +1,37 @@
 #pragma once
 
+#include <stdbool.h>
 #include <stdint.h>
 #include <stddef.h>
 
-typedef struct {
-    uint8_t *data;
+// Arena memory lives in linked blocks, a full block is kept and a new one is
+// started, so pointers handed out stay valid until the arena is reset past them.
+typedef struct ArenaBlock {
+    struct ArenaBlock *next;  // The block allocated before this one
     size_t capacity;
-    size_t ptr;
+    size_t used;
+    uint8_t data[];
+} ArenaBlock;
+
+typedef struct {
+    ArenaBlock *head;         // Block currently allocated from
+    ArenaBlock *free;         // Blocks released by a reset, reused before malloc
+    size_t block_size;
+    size_t used;              // Bytes handed out and not reset
+    size_t high_water;        // Largest 'used' seen
 } Arena;
 
-Arena arena_init(size_t capacity);
+typedef struct {
+    ArenaBlock *block;
+    size_t block_used;
+    size_t used;
+} ArenaMark;
+
+Arena arena_init(size_t block_size);
 void arena_deinit(Arena *arena);
-void* arena_alloc(Arena *arena, size_t capacity);
+void* arena_alloc(Arena *arena, size_t size);
+bool arena_resize(Arena *arena, void *ptr, size_t size, size_t new_size);
+ArenaMark arena_mark(Arena *arena);
+void arena_reset_to_mark(Arena *arena, ArenaMark mark);
+void arena_reset(Arena *arena);
+size_t arena_high_water(Arena *arena);
@@ -0,0 +1,489 @@
+#include "batch.h"
+#include "expr.h"
+#include "list.h"
+#include "log.h"
+#include "vars.h"
+#include "parser.h"
+#include "value.h"
+#include "vm.h"
+#include <math.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+  #define BATCH_X86
+  #include <immintrin.h>
+#endif
+
+// Rows are processed in blocks small enough for every stack slot's buffer
+// to stay in L1.
+enum { BLOCK = 256 };
+
+typedef void (*BinaryKernel)(const double *a, const double *b, double *out, size_t n);
+typedef void (*UnaryKernel)(const double *a, double *out, size_t n);
+
+typedef struct {
+    BinaryKernel add, sub, mul, div, eq, neq, less, lesseq, greater, greatereq, logical_or, logical_and;
+    UnaryKernel neg, logical_not;
+} Kernels;
+
+#define SCALAR_BINARY(name, expression)                                                 \
+    static void name##_scalar(const double *a, const double *b, double *out, size_t n)  \
+    {                                                                                   \
+        for (size_t i = 0; i < n; i++) out[i] = (expression);                           \
+    }
+
+SCALAR_BINARY(add,       a[i] + b[i])
+SCALAR_BINARY(sub,       a[i] - b[i])
+SCALAR_BINARY(mul,       a[i] * b[i])
+SCALAR_BINARY(div,       a[i] / b[i])
+SCALAR_BINARY(eq,        a[i] == b[i])
+SCALAR_BINARY(neq,       a[i] != b[i])
+SCALAR_BINARY(less,      a[i] < b[i])
+SCALAR_BINARY(lesseq,    a[i] <= b[i])
+SCALAR_BINARY(greater,   a[i] > b[i])
+SCALAR_BINARY(greatereq, a[i] >= b[i])
+SCALAR_BINARY(or,        a[i] != 0 || b[i] != 0)
+SCALAR_BINARY(and,       a[i] != 0 && b[i] != 0)
+
+static void neg_scalar(const double *a, double *out, size_t n)
+{
+    for (size_t i = 0; i < n; i++) out[i] = a[i] * -1;
+}
+
+static void not_scalar(const double *a, double *out, size_t n)
+{
+    for (size_t i = 0; i < n; i++) out[i] = a[i] == 0;
+}
+
+static const Kernels scalar_kernels = {
+    add_scalar, sub_scalar, mul_scalar, div_scalar, eq_scalar, neq_scalar,
+    less_scalar, lesseq_scalar, greater_scalar, greatereq_scalar, or_scalar, and_scalar,
+    neg_scalar, not_scalar,
+};
+
+#ifdef BATCH_X86
+
+// Bools are stored as exactly 0.0 or 1.0, so comparison masks are narrowed
+// with 'ones' and && / || / ! become bitwise operations on those patterns.
+#define SIMD_BINARY(name, isa, type, width, load, store, set1, expression)              \
+    __attribute__((target(#isa)))                                                       \
+    static void name##_##isa(const double *a, const double *b, double *out, size_t n)   \
+    {                                                                                   \
+        const type ones = set1(1.0);                                                    \
+        (void)ones;                                                                     \
+        size_t i = 0;                                                                   \
+        for (; i + width <= n; i += width) {                                            \
+            type x = load(a + i);                                                       \
+            type y = load(b + i);                                                       \
+            store(out + i, expression);                                                 \
+        }                                                                               \
+        name##_scalar(a + i, b + i, out + i, n - i);                                    \
+    }
+
+#define SSE2_BINARY(name, expression) \
+    SIMD_BINARY(name, sse2, __m128d, 2, _mm_loadu_pd, _mm_storeu_pd, _mm_set1_pd, expression)
+
+SSE2_BINARY(add,       _mm_add_pd(x, y))
+SSE2_BINARY(sub,       _mm_sub_pd(x, y))
+SSE2_BINARY(mul,       _mm_mul_pd(x, y))
+SSE2_BINARY(div,       _mm_div_pd(x, y))
+SSE2_BINARY(eq,        _mm_and_pd(_mm_cmpeq_pd(x, y), ones))
+SSE2_BINARY(neq,       _mm_and_pd(_mm_cmpneq_pd(x, y), ones))
+SSE2_BINARY(less,      _mm_and_pd(_mm_cmplt_pd(x, y), ones))
+SSE2_BINARY(lesseq,    _mm_and_pd(_mm_cmple_pd(x, y), ones))
+SSE2_BINARY(greater,   _mm_and_pd(_mm_cmpgt_pd(x, y), ones))
+SSE2_BINARY(greatereq, _mm_and_pd(_mm_cmpge_pd(x, y), ones))
+SSE2_BINARY(or,        _mm_or_pd(x, y))
+SSE2_BINARY(and,       _mm_and_pd(x, y))
+
+__attribute__((target("sse2")))
+static void neg_sse2(const double *a, double *out, size_t n)
+{
+    const __m128d minus_one = _mm_set1_pd(-1.0);
+    size_t i = 0;
+    for (; i + 2 <= n; i += 2) {
+        _mm_storeu_pd(out + i, _mm_mul_pd(_mm_loadu_pd(a + i), minus_one));
+    }
+    neg_scalar(a + i, out + i, n - i);
+}
+
+__attribute__((target("sse2")))
+static void not_sse2(const double *a, double *out, size_t n)
+{
+    const __m128d ones = _mm_set1_pd(1.0);
+    size_t i = 0;
+    for (; i + 2 <= n; i += 2) {
+        _mm_storeu_pd(out + i, _mm_xor_pd(_mm_loadu_pd(a + i), ones));
+    }
+    not_scalar(a + i, out + i, n - i);
+}
+
+static const Kernels sse2_kernels = {
+    add_sse2, sub_sse2, mul_sse2, div_sse2, eq_sse2, neq_sse2,
+    less_sse2, lesseq_sse2, greater_sse2, greatereq_sse2, or_sse2, and_sse2,
+    neg_sse2, not_sse2,
+};
+
+#define AVX2_BINARY(name, expression) \
+    SIMD_BINARY(name, avx2, __m256d, 4, _mm256_loadu_pd, _mm256_storeu_pd, _mm256_set1_pd, expression)
+
+AVX2_BINARY(add,       _mm256_add_pd(x, y))
+AVX2_BINARY(sub,       _mm256_sub_pd(x, y))
+AVX2_BINARY(mul,       _mm256_mul_pd(x, y))
+AVX2_BINARY(div,       _mm256_div_pd(x, y))
+AVX2_BINARY(eq,        _mm256_and_pd(_mm256_cmp_pd(x, y, _CMP_EQ_OQ), ones))
+AVX2_BINARY(neq,       _mm256_and_pd(_mm256_cmp_pd(x, y, _CMP_NEQ_UQ), ones))
+AVX2_BINARY(less,      _mm256_and_pd(_mm256_cmp_pd(x, y, _CMP_LT_OQ), ones))
+AVX2_BINARY(lesseq,    _mm256_and_pd(_mm256_cmp_pd(x, y, _CMP_LE_OQ), ones))
+AVX2_BINARY(greater,   _mm256_and_pd(_mm256_cmp_pd(x, y, _CMP_GT_OQ), ones))
+AVX2_BINARY(greatereq, _mm256_and_pd(_mm256_cmp_pd(x, y, _CMP_GE_OQ), ones))
+AVX2_BINARY(or,        _mm256_or_pd(x, y))
+AVX2_BINARY(and,       _mm256_and_pd(x, y))
+
+__attribute__((target("avx2")))
+static void neg_avx2(const double *a, double *out, size_t n)
+{
+    const __m256d minus_one = _mm256_set1_pd(-1.0);
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        _mm256_storeu_pd(out + i, _mm256_mul_pd(_mm256_loadu_pd(a + i), minus_one));
+    }
+    neg_scalar(a + i, out + i, n - i);
+}
+
+__attribute__((target("avx2")))
+static void not_avx2(const double *a, double *out, size_t n)
+{
+    const __m256d ones = _mm256_set1_pd(1.0);
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        _mm256_storeu_pd(out + i, _mm256_xor_pd(_mm256_loadu_pd(a + i), ones));
+    }
+    not_scalar(a + i, out + i, n - i);
+}
+
+static const Kernels avx2_kernels = {
+    add_avx2, sub_avx2, mul_avx2, div_avx2, eq_avx2, neq_avx2,
+    less_avx2, lesseq_avx2, greater_avx2, greatereq_avx2, or_avx2, and_avx2,
+    neg_avx2, not_avx2,
+};
+
+#endif // BATCH_X86
+
+BatchIsa batch_best_isa(void)
+{
+#ifdef BATCH_X86
+    if (__builtin_cpu_supports("avx2")) return BATCH_AVX2;
+    if (__builtin_cpu_supports("sse2")) return BATCH_SSE2;
+#endif
+    return BATCH_SCALAR;
+}
+
+const char* batch_isa_name(BatchIsa isa)
+{
+    switch (isa) {
+        case BATCH_AUTO:   return batch_isa_name(batch_best_isa());
+        case BATCH_SCALAR: return "scalar";
+        case BATCH_SSE2:   return "sse2";
+        case BATCH_AVX2:   return "avx2";
+    }
+
+    return NULL;
+}
+
+static const Kernels* get_kernels(BatchIsa isa)
+{
+    if (isa == BATCH_AUTO) isa = batch_best_isa();
+
+#ifdef BATCH_X86
+    if (isa == BATCH_AVX2 && __builtin_cpu_supports("avx2")) return &avx2_kernels;
+    if (isa >= BATCH_SSE2 && __builtin_cpu_supports("sse2")) return &sse2_kernels;
+#endif
+
+    return &scalar_kernels;
+}
+
+static double (*const unary_funcs[MATHFUNC_COUNT])(double) = {
+    [SIN]   = sin,
+    [COS]   = cos,
+    [TAN]   = tan,
+    [ASIN]  = asin,
+    [ACOS]  = acos,
+    [ATAN]  = atan,
+    [SINH]  = sinh,
+    [COSH]  = cosh,
+    [TANH]  = tanh,
+    [ASINH] = asinh,
+    [ACOSH] = acosh,
+    [ATANH] = atanh,
+    [EXP]   = exp,
+    [LOG]   = log,
+    [LOG10] = log10,
+    [LOG2]  = log2,
+    [CEIL]  = ceil,
+    [FLOOR] = floor,
+    [ROUND] = round,
+    [SQRT]  = sqrt,
+};
+
+typedef enum {
+    STEP_COLUMN,
+    STEP_CONST,
+    STEP_NEG,
+    STEP_NOT,
+    STEP_BINARY,
+    STEP_POW,
+    STEP_CALL,
+} StepType;
+
+typedef struct {
+    StepType type;
+    BinaryKernel kernel;
+    MathFunc func;
+    const double *column;
+    double constant;
+} Step;
+
+LIST_DEF(StepList, Step);
+
+typedef enum {
+    SLOT_NUM,
+    SLOT_BOOL,
+} SlotType;
+
+static const Column* find_column(const Column *columns, size_t column_count, String name)
+{
+    for (size_t i = 0; i < column_count; i++) {
+        if (string_compare((String*)&columns[i].name, &name)) return &columns[i];
+    }
+
+    return NULL;
+}
+
+static bool scalar_step(Value value, Step *step, SlotType *type)
+{
+    switch (VALUE_TYPE(value)) {
+        case VALUE_NUM:
+            *step = (Step){.type = STEP_CONST, .constant = (double)AS_NUM(value)};
+            *type = SLOT_NUM;
+            return true;
+        case VALUE_BOOL:
+            *step = (Step){.type = STEP_CONST, .constant = AS_BOOL(value) ? 1.0 : 0.0};
+            *type = SLOT_BOOL;
+            return true;
+        default:
+            return false;
+    }
+}
+
+// Turns the chunk into a list of block operations, type checking it on the
+// way so the kernels never have to. Anything that can't be expressed as a
+// column of numbers or bools (strings, let, import, export, exit) is rejected.
+static bool plan(Parser *parser, Chunk *chunk, const Column *columns, size_t column_count,
+                 const Kernels *kernels, StepList *steps)
+{
+    SlotType *types = malloc(sizeof(SlotType) * (chunk->max_stack + 1));
+    size_t sp = 0;
+    size_t ip = 0;
+    bool ok = true;
+
+    #define FAIL(...) do { log_info(&parser->logging, __VA_ARGS__); ok = false; goto done; } while (0)
+    #define READ_U16() (ip += 2, (size_t)(chunk->code.items[ip - 2] | (chunk->code.items[ip - 1] << 8)))
+
+    while (ip < chunk->code.count) {
+        OpCode op = chunk->code.items[ip++];
+        Step step = {0};
+        SlotType result = SLOT_NUM;
+
+        switch (op) {
+            case OP_CONST:
+                if (!scalar_step(chunk->constants.items[READ_U16()], &step, &result)) {
+                    FAIL("Error: Batch evaluation only supports numbers and bools.");
+                }
+                types[sp++] = result;
+                break;
+            case OP_ANS:
+                if (!scalar_step(parser->ans, &step, &result)) {
+                    FAIL("Error: Batch evaluation only supports numbers and bools.");
+                }
+                types[sp++] = result;
+                break;
+            case OP_LOAD: {
+                String name = chunk->names.items[READ_U16()];
+                const Column *column = find_column(columns, column_count, name);
+                if (column) {
+                    step = (Step){.type = STEP_COLUMN, .column = column->data};
+                }
+                else {
+                    Value *value = vars_get(&parser->vars, name, NULL);
+                    if (!value || !scalar_step(*value, &step, &result)) {
+                        FAIL("Error: No numeric column or variable named '%.*s'.", (int)name.len, name.data);
+                    }
+                }
+                types[sp++] = result;
+                break;
+            }
+            case OP_NEG:
+                if (types[sp - 1] != SLOT_NUM) FAIL("Error: Can't negate a bool column.");
+                step.type = STEP_NEG;
+                break;
+            case OP_NOT:
+                if (types[sp - 1] != SLOT_BOOL) FAIL("Error: Can't apply '!' to a number column.");
+                step.type = STEP_NOT;
+                break;
+            case OP_ADD: case OP_SUB: case OP_MUL: case OP_DIV: case OP_POW:
+            case OP_LESS: case OP_LESSEQ: case OP_GREATER: case OP_GREATEREQ:
+                if (types[sp - 2] != SLOT_NUM || types[sp - 1] != SLOT_NUM) {
+                    FAIL("Error: Operator expects number columns.");
+                }
+                sp--;
+                types[sp - 1] = op >= OP_LESS ? SLOT_BOOL : SLOT_NUM;
+                step.type = STEP_BINARY;
+                switch (op) {
+                    case OP_ADD:       step.kernel = kernels->add;       break;
+                    case OP_SUB:       step.kernel = kernels->sub;       break;
+                    case OP_MUL:       step.kernel = kernels->mul;       break;
+                    case OP_DIV:       step.kernel = kernels->div;       break;
+                    case OP_LESS:      step.kernel = kernels->less;      break;
+                    case OP_LESSEQ:    step.kernel = kernels->lesseq;    break;
+                    case OP_GREATER:   step.kernel = kernels->greater;   break;
+                    case OP_GREATEREQ: step.kernel = kernels->greatereq; break;
+                    default:           step.type = STEP_POW;             break;
+                }
+                break;
+            case OP_EQ:
+            case OP_NEQ:
+                if (types[sp - 2] != types[sp - 1]) FAIL("Error: Can't compare columns of different types.");
+                sp--;
+                types[sp - 1] = SLOT_BOOL;
+                step = (Step){.type = STEP_BINARY, .kernel = op == OP_EQ ? kernels->eq : kernels->neq};
+                break;
+            case OP_OR:
+            case OP_AND:
+                if (types[sp - 2] != SLOT_BOOL || types[sp - 1] != SLOT_BOOL) {
+                    FAIL("Error: Operator expects bool columns.");
+                }
+                sp--;
+                step = (Step){.type = STEP_BINARY, .kernel = op == OP_OR ? kernels->logical_or : kernels->logical_and};
+                break;
+            case OP_CALL: {
+                MathFunc func = chunk->code.items[ip++];
+                int arity = math_func_arity(func);
+                for (int i = 1; i <= arity; i++) {
+                    if (types[sp - i] != SLOT_NUM) FAIL("Error: '%s' expects number columns.", math_func_name(func));
+                }
+                if (arity == 0) {
+                    scalar_step(math_call(func, VAL_NUM(0.0), VAL_NUM(0.0)), &step, &result);
+                    types[sp++] = SLOT_NUM;
+                    break;
+                }
+                sp -= arity - 1;
+                types[sp - 1] = SLOT_NUM;
+                step = (Step){.type = STEP_CALL, .func = func};
+                break;
+            }
+            case OP_RETURN:
+                goto done;
+            default:
+                FAIL("Error: Batch evaluation doesn't support let, drop, import, export or exit.");
+        }
+
+        list_push(steps, step);
+    }
+
+done:
+    #undef FAIL
+    #undef READ_U16
+
+    free(types);
+
+    return ok;
+}
+
+static void fill(double *out, double value, size_t n)
+{
+    for (size_t i = 0; i < n; i++) out[i] = value;
+}
+
+bool batch_eval_isa(Parser *parser, Chunk *chunk, const Column *columns, size_t column_count, size_t rows, double *out, BatchIsa isa)
+{
+    const Kernels *kernels = get_kernels(isa);
+    StepList steps = {0};
+
+    parser->error = false;
+
+    if (chunk->code.count == 0 || !plan(parser, chunk, columns, column_count, kernels, &steps)) {
+        parser->error = true;
+        list_free(&steps);
+        return false;
+    }
+
+    size_t depth = chunk->max_stack > 0 ? chunk->max_stack : 1;
+    double *buffers = malloc(sizeof(double) * BLOCK * depth);
+    const double **stack = malloc(sizeof(double*) * depth);
+
+    for (size_t base = 0; base < rows; base += BLOCK) {
+        size_t n = rows - base < BLOCK ? rows - base : BLOCK;
+        size_t sp = 0;
+
+        for (size_t s = 0; s < steps.count; s++) {
+            Step *step = &steps.items[s];
+            double *slot;
+
+            switch (step->type) {
+                case STEP_COLUMN:
+                    stack[sp++] = step->column + base;
+                    break;
+                case STEP_CONST:
+                    slot = &buffers[sp * BLOCK];
+                    fill(slot, step->constant, n);
+                    stack[sp++] = slot;
+                    break;
+                case STEP_NEG:
+                case STEP_NOT:
+                    slot = &buffers[(sp - 1) * BLOCK];
+                    (step->type == STEP_NEG ? kernels->neg : kernels->logical_not)(stack[sp - 1], slot, n);
+                    stack[sp - 1] = slot;
+                    break;
+                case STEP_BINARY:
+                    slot = &buffers[(sp - 2) * BLOCK];
+                    step->kernel(stack[sp - 2], stack[sp - 1], slot, n);
+                    stack[--sp - 1] = slot;
+                    break;
+                case STEP_POW:
+                    slot = &buffers[(sp - 2) * BLOCK];
+                    for (size_t i = 0; i < n; i++) slot[i] = pow(stack[sp - 2][i], stack[sp - 1][i]);
+                    stack[--sp - 1] = slot;
+                    break;
+                case STEP_CALL:
+                    if (step->func == ATAN2) {
+                        slot = &buffers[(sp - 2) * BLOCK];
+                        for (size_t i = 0; i < n; i++) slot[i] = atan2(stack[sp - 2][i], stack[sp - 1][i]);
+                        stack[--sp - 1] = slot;
+                    }
+                    else {
+                        slot = &buffers[(sp - 1) * BLOCK];
+                        double (*func)(double) = unary_funcs[step->func];
+                        for (size_t i = 0; i < n; i++) slot[i] = func(stack[sp - 1][i]);
+                        stack[sp - 1] = slot;
+                    }
+                    break;
+            }
+        }
+
+        memcpy(out + base, stack[0], sizeof(double) * n);
+    }
+
+    free(stack);
+    free(buffers);
+    list_free(&steps);
+
+    return true;
+}
+
+bool batch_eval(Parser *parser, Chunk *chunk, const Column *columns, size_t column_count, size_t rows, double *out)
+{
+    return batch_eval_isa(parser, chunk, columns, column_count, rows, out, BATCH_AUTO);
+}
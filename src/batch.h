@@ -0,0 +1,25 @@
+#pragma once
+
+#include "parser.h"
+#include "value.h"
+#include "vm.h"
+#include <stdbool.h>
+#include <stddef.h>
+
+// One input column, bound to every '$name' load in the chunk.
+typedef struct {
+    String name;
+    const double *data;
+} Column;
+
+typedef enum {
+    BATCH_AUTO,
+    BATCH_SCALAR,
+    BATCH_SSE2,
+    BATCH_AVX2,
+} BatchIsa;
+
+bool batch_eval(Parser *parser, Chunk *chunk, const Column *columns, size_t column_count, size_t rows, double *out);
+bool batch_eval_isa(Parser *parser, Chunk *chunk, const Column *columns, size_t column_count, size_t rows, double *out, BatchIsa isa);
+BatchIsa batch_best_isa(void);
+const char* batch_isa_name(BatchIsa isa);
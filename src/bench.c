@@ -0,0 +1,570 @@
+#include "bench.h"
+#include "batch.h"
+#include "expr.h"
+#include "lexer.h"
+#include "list.h"
+#include "map.h"
+#include "parser.h"
+#include "pool.h"
+#include "script.h"
+#include "value.h"
+#include "vm.h"
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <time.h>
+
+static double now_seconds(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+}
+
+static bool run_line(Parser *parser, const char *text)
+{
+    TokenBuffer list = {0};
+    Expr expr = expr_new();
+    bool ok = tokenize(text, &list, &parser->logging) && parser_compile(parser, &list, &expr);
+    if (ok) {
+        parser_eval(parser, &expr);
+        ok = !parser->error;
+    }
+    expr_destroy(&expr);
+    token_buffer_free(&list);
+
+    return ok;
+}
+
+static const char* formulas[] = {
+    "$a * 2 + $b / 3 - 1",
+    "sqrt($a * $a + $b * $b)",
+    "($a + 1) * ($b - 2) ^ 2 > 100 && $a != $b",
+    "2 * pi * 3 + sin($a) * cos($b)",
+    "$a + $b + $a * $b - ($a - $b) / 2 + 7 * $a - 3 * $b",
+    "(1 + 2) * 3 - 4 / 5 + 6 * (7 - 8) ^ 2 >= 9 || 10 < 11",
+    "$n * 3 + $m - 7 * ($n - $m) + $n * $m > 1000",
+};
+
+static void bench_evaluators(void)
+{
+    enum { iterations = 200000 };
+
+    Parser parser = parser_create();
+    run_line(&parser, "let a = 3.5");
+    run_line(&parser, "let b = 12");
+    // Integer counters, evaluated without leaving int64.
+    run_line(&parser, "let n = 12345");
+    run_line(&parser, "let m = 678");
+
+    printf("Evaluator (%d evaluations per formula, ns/eval)\n", iterations);
+    printf("%-56s %10s %10s %10s %8s\n", "formula", "reparse", "tree", "vm", "speedup");
+
+    for (size_t f = 0; f < array_len(formulas); f++) {
+        TokenBuffer list = {0};
+        Expr expr = expr_new();
+        Chunk chunk = chunk_new();
+
+        if (!tokenize(formulas[f], &list, &parser.logging) ||
+            !parser_compile(&parser, &list, &expr) ||
+            !chunk_compile(&expr, &chunk)) {
+            printf("%-56s failed to compile\n", formulas[f]);
+            continue;
+        }
+
+        double start = now_seconds();
+        for (int i = 0; i < iterations / 10; i++) {
+            Expr tmp = expr_new();
+            token_buffer_clear(&list);
+            tokenize(formulas[f], &list, &parser.logging);
+            parser_compile(&parser, &list, &tmp);
+            parser_eval(&parser, &tmp);
+            expr_destroy(&tmp);
+        }
+        double reparse = (now_seconds() - start) / (iterations / 10) * 1e9;
+
+        start = now_seconds();
+        for (int i = 0; i < iterations; i++) {
+            parser_eval(&parser, &expr);
+        }
+        double tree = (now_seconds() - start) / iterations * 1e9;
+
+        start = now_seconds();
+        for (int i = 0; i < iterations; i++) {
+            vm_run(&parser, &chunk);
+        }
+        double vm = (now_seconds() - start) / iterations * 1e9;
+
+        printf("%-56s %10.1f %10.1f %10.1f %7.2fx\n", formulas[f], reparse, tree, vm, tree / vm);
+
+        chunk_destroy(&chunk);
+        expr_destroy(&expr);
+        token_buffer_free(&list);
+    }
+
+    parser_destroy(&parser);
+}
+
+static const char* batch_formulas[] = {
+    "$a * 2 + $b / 3 - 1",
+    "($a + 1) * ($b - 2) > 100 && $a != $b",
+    "$a * $a + $b * $b - 2 * $a * $b",
+    "sqrt($a * $a + $b * $b)",
+};
+
+static void bench_batch(void)
+{
+    enum { rows = 1 << 20, row_rows = 1 << 17, repeats = 5 };
+
+    Parser parser = parser_create();
+    double *a = malloc(sizeof(double) * rows);
+    double *b = malloc(sizeof(double) * rows);
+    double *out = malloc(sizeof(double) * rows);
+    double *expected = malloc(sizeof(double) * rows);
+    String name_a = {.data = "a", .len = 1};
+    String name_b = {.data = "b", .len = 1};
+    Column columns[] = {{.name = name_a, .data = a}, {.name = name_b, .data = b}};
+
+    srand(42);
+    for (size_t i = 0; i < rows; i++) {
+        a[i] = (double)(rand() % 2000) / 10.0 - 100.0;
+        b[i] = (double)(rand() % 2000) / 10.0 - 100.0;
+    }
+
+    printf("\nBatch evaluation (%d rows, Mrows/s, best isa: %s)\n", rows, batch_isa_name(BATCH_AUTO));
+    printf("%-44s %10s %10s %10s %10s\n", "formula", "per-row", "scalar", "sse2", "avx2");
+
+    for (size_t f = 0; f < array_len(batch_formulas); f++) {
+        TokenBuffer list = {0};
+        Expr expr = expr_new();
+        Chunk chunk = chunk_new();
+
+        if (!tokenize(batch_formulas[f], &list, &parser.logging) ||
+            !parser_compile(&parser, &list, &expr) ||
+            !chunk_compile(&expr, &chunk)) {
+            printf("%-44s failed to compile\n", batch_formulas[f]);
+            continue;
+        }
+
+        // The scalar path: bind every row's variables and run the VM.
+        double start = now_seconds();
+        for (size_t i = 0; i < row_rows; i++) {
+            declare_var(&parser, name_a, NULL, VAL_NUM(a[i]));
+            declare_var(&parser, name_b, NULL, VAL_NUM(b[i]));
+            Value result = vm_run(&parser, &chunk);
+            expected[i] = VALUE_TYPE(result) == VALUE_BOOL ? AS_BOOL(result) : (double)AS_NUM(result);
+        }
+        double per_row = row_rows / (now_seconds() - start) / 1e6;
+
+        printf("%-44s %10.2f", batch_formulas[f], per_row);
+
+        BatchIsa isas[] = {BATCH_SCALAR, BATCH_SSE2, BATCH_AVX2};
+        for (size_t k = 0; k < array_len(isas); k++) {
+            if (isas[k] > batch_best_isa()) {
+                printf(" %10s", "n/a");
+                continue;
+            }
+
+            double best = 0;
+            for (int r = 0; r < repeats; r++) {
+                start = now_seconds();
+                batch_eval_isa(&parser, &chunk, columns, array_len(columns), rows, out, isas[k]);
+                double rate = rows / (now_seconds() - start) / 1e6;
+                if (rate > best) best = rate;
+            }
+
+            size_t mismatches = 0;
+            for (size_t i = 0; i < row_rows; i++) {
+                // The kernels work in double, the VM in Number.
+                if (fabs(out[i] - expected[i]) > 1e-9 * (1 + fabs(expected[i]))) {
+                    mismatches++;
+                }
+            }
+            printf(" %10.2f", best);
+            if (mismatches) printf(" (%zu mismatches)", mismatches);
+        }
+        printf("\n");
+
+        chunk_destroy(&chunk);
+        expr_destroy(&expr);
+        token_buffer_free(&list);
+    }
+
+    free(expected);
+    free(out);
+    free(b);
+    free(a);
+    parser_destroy(&parser);
+}
+
+static bool same_value(Value one, Value two)
+{
+    if (VALUE_TYPE(one) != VALUE_TYPE(two)) return false;
+    switch (VALUE_TYPE(one)) {
+        case VALUE_NUM: return AS_NUM(one) == AS_NUM(two);
+        case VALUE_STR: return string_compare(&AS_STR(one), &AS_STR(two));
+        case VALUE_BOOL: return AS_BOOL(one) == AS_BOOL(two);
+    }
+
+    return false;
+}
+
+static void bench_pool(void)
+{
+    enum { line_count = 100000, line_len = 96, repeats = 3 };
+
+    char *text = malloc(line_count * line_len);
+    const char **lines = malloc(sizeof(char*) * line_count);
+    PoolResult *expected = malloc(sizeof(PoolResult) * line_count);
+    PoolResult *results = malloc(sizeof(PoolResult) * line_count);
+
+    srand(42);
+    for (size_t i = 0; i < line_count; i++) {
+        char *line = &text[i * line_len];
+        snprintf(line, line_len, "sqrt(%d * %d + %d) * sin(%d) - (%d + 1) ^ 2 / 7 > %d",
+                 rand() % 1000, rand() % 1000, rand() % 100, rand() % 360, rand() % 50, rand() % 500);
+        lines[i] = line;
+    }
+
+    int max_threads = pool_default_threads();
+    printf("\nThread pool (%d independent lines, up to %d threads)\n", line_count, max_threads);
+    printf("%-10s %12s %10s\n", "threads", "Klines/s", "speedup");
+
+    double base = 0;
+    for (int threads = 1; threads <= max_threads; threads++) {
+        Pool *pool = pool_create(threads);
+
+        double best = 0;
+        for (int r = 0; r < repeats; r++) {
+            double start = now_seconds();
+            pool_eval(pool, lines, line_count, results);
+            double rate = line_count / (now_seconds() - start) / 1e3;
+            if (rate > best) best = rate;
+            if (threads == 1 && r == 0) memcpy(expected, results, sizeof(PoolResult) * line_count);
+            else pool_results_free(results, line_count);
+        }
+        pool_destroy(pool);
+
+        size_t mismatches = 0;
+        if (threads > 1) {
+            pool = pool_create(threads);
+            pool_eval(pool, lines, line_count, results);
+            pool_destroy(pool);
+            for (size_t i = 0; i < line_count; i++) {
+                if (results[i].error != expected[i].error || !same_value(results[i].value, expected[i].value)) {
+                    mismatches++;
+                }
+            }
+            pool_results_free(results, line_count);
+        }
+
+        if (threads == 1) base = best;
+        printf("%-10d %12.1f %9.2fx", threads, best, best / base);
+        if (mismatches) printf(" (%zu mismatches)", mismatches);
+        printf("\n");
+    }
+
+    pool_results_free(expected, line_count);
+    free(results);
+    free(expected);
+    free(lines);
+    free(text);
+}
+
+// String concatenation allocates from the parser's scratch arena, which is
+// reset after every evaluation so its blocks are reused. The long chain shows
+// whether '+' copies its left side again for every piece.
+static void bench_strings(void)
+{
+    enum { iterations = 200000, chain_len = 64 };
+    static char chain[chain_len * 5];
+    size_t used = 0;
+    for (int i = 0; i < chain_len; i++) {
+        used += snprintf(&chain[used], sizeof(chain) - used, i == 0 ? "$s" : " + $s");
+    }
+    const char *formulas[] = {
+        "$s + \" and \" + $s + \" and \" + $s + \" again\"",
+        chain,
+    };
+
+    Parser parser = parser_create();
+    run_line(&parser, "let s = \"a string that is long enough to fill the arena quickly\"");
+
+    TokenBuffer list = {0};
+    Expr expr = expr_new();
+    Chunk chunk = chunk_new();
+
+    printf("\nString concatenation (%d evaluations)\n", iterations);
+    for (size_t f = 0; f < array_len(formulas); f++) {
+        token_buffer_clear(&list);
+        if (!tokenize(formulas[f], &list, &parser.logging) ||
+            !parser_compile(&parser, &list, &expr) ||
+            !chunk_compile(&expr, &chunk)) {
+            printf("%.56s failed to compile\n", formulas[f]);
+            continue;
+        }
+
+        arena_reset(&parser.scratch);
+        parser.scratch.high_water = 0;
+        double start = now_seconds();
+        for (int i = 0; i < iterations; i++) {
+            vm_run(&parser, &chunk);
+        }
+        double elapsed = (now_seconds() - start) / iterations * 1e9;
+
+        printf("%-56.56s %10.1f ns/eval, arena high water %zu bytes\n", formulas[f], elapsed, arena_high_water(&parser.scratch));
+    }
+
+    chunk_destroy(&chunk);
+    expr_destroy(&expr);
+    token_buffer_free(&list);
+    parser_destroy(&parser);
+}
+
+// A wide, shallow script: lets over 200 names, each read by the next line.
+static void bench_script(void)
+{
+    enum { line_count = 50000, line_len = 96, repeats = 3 };
+
+    char *text = malloc(line_count * line_len);
+    const char **lines = malloc(sizeof(char*) * line_count);
+    PoolResult *results = malloc(sizeof(PoolResult) * line_count);
+
+    for (size_t i = 0; i < line_count; i++) {
+        char *line = &text[i * line_len];
+        if (i % 2 == 0) snprintf(line, line_len, "let v%zu = sqrt(%zu * 3 + 1) * sin(%zu) ^ 2", i / 2 % 200, i, i);
+        else snprintf(line, line_len, "$v%zu * 2 + cos($v%zu) > 1", i / 2 % 200, i / 2 % 200);
+        lines[i] = line;
+    }
+
+    // Sequential baseline: one parser, line after line.
+    Parser parser = parser_create();
+    TokenBuffer list = {0};
+    Expr expr = expr_new();
+    Chunk chunk = chunk_new();
+    double start = now_seconds();
+    for (size_t i = 0; i < line_count; i++) {
+        token_buffer_clear(&list);
+        if (tokenize(lines[i], &list, &parser.logging) && parser_compile(&parser, &list, &expr)) {
+            if (chunk_compile(&expr, &chunk)) vm_run(&parser, &chunk);
+            else parser_eval(&parser, &expr);
+        }
+    }
+    double sequential = line_count / (now_seconds() - start) / 1e3;
+    chunk_destroy(&chunk);
+    expr_destroy(&expr);
+    token_buffer_free(&list);
+    parser_destroy(&parser);
+
+    int max_threads = pool_default_threads();
+    printf("\nScript runner (%d lines, sequential %.1f Klines/s)\n", line_count, sequential);
+    printf("%-10s %12s %10s\n", "threads", "Klines/s", "speedup");
+
+    for (int threads = 1; threads <= max_threads; threads++) {
+        Pool *pool = pool_create(threads);
+        double best = 0;
+        for (int r = 0; r < repeats; r++) {
+            start = now_seconds();
+            size_t produced = script_run(pool, lines, line_count, results);
+            double rate = line_count / (now_seconds() - start) / 1e3;
+            if (rate > best) best = rate;
+            pool_results_free(results, produced);
+        }
+        pool_destroy(pool);
+
+        printf("%-10d %12.1f %9.2fx\n", threads, best, best / sequential);
+    }
+
+    free(results);
+    free(lines);
+    free(text);
+}
+
+// Lookups of present and missing names in maps of a few sizes, what get_var
+// costs once a formula is compiled.
+static void bench_map(void)
+{
+    enum { lookups = 2000000, key_len = 16 };
+    const size_t sizes[] = {8, 1000, 100000};
+
+    printf("\nMap lookups (%d per size, ns/lookup)\n", lookups);
+    printf("%-10s %10s %10s\n", "keys", "hit", "miss");
+
+    for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+        size_t count = sizes[s];
+        char *text = malloc(count * 2 * key_len);
+        String *keys = malloc(sizeof(String) * count * 2);
+        Map map = map_new();
+
+        // The second half are never inserted and only used for misses.
+        for (size_t i = 0; i < count * 2; i++) {
+            char *key = &text[i * key_len];
+            keys[i] = (String){.data = key, .len = snprintf(key, key_len, "var_%zu", i)};
+            if (i < count) map_set(&map, keys[i], i);
+        }
+
+        long double sum = 0;
+        double start = now_seconds();
+        for (int i = 0; i < lookups; i++) {
+            sum += map_get(&map, keys[(size_t)i * 7919 % count]);
+        }
+        double hit = (now_seconds() - start) / lookups * 1e9;
+
+        size_t found = 0;
+        start = now_seconds();
+        for (int i = 0; i < lookups; i++) {
+            found += map_has(&map, keys[count + (size_t)i * 7919 % count]);
+        }
+        double miss = (now_seconds() - start) / lookups * 1e9;
+
+        printf("%-10zu %10.1f %10.1f", count, hit, miss);
+        if (found || sum < 0) printf(" (%zu false hits)", found);
+        printf("\n");
+
+        map_delete(&map);
+        free(keys);
+        free(text);
+    }
+}
+
+// Tokenizing and compiling a line of number literals, what a data feed of
+// numbers costs before anything is evaluated.
+static void bench_literals(void)
+{
+    enum { literal_count = 256, iterations = 2000, literal_len = 32 };
+    char *text = malloc(literal_count * literal_len);
+    size_t len = 0;
+
+    srand(42);
+    for (int i = 0; i < literal_count; i++) {
+        int whole = rand() % 100000;
+        int fraction = rand() % 10000;
+        switch (i % 3) {
+            case 0:  len += sprintf(&text[len], "%d + ", whole); break;
+            case 1:  len += sprintf(&text[len], "%d.%04d + ", whole, fraction); break;
+            default: len += sprintf(&text[len], "%d.%de%d + ", whole % 10, fraction, rand() % 40 - 20); break;
+        }
+    }
+    sprintf(&text[len], "0");
+
+    Parser parser = parser_create();
+    TokenBuffer list = {0};
+    Expr expr = expr_new();
+
+    double best = 1e30;
+    for (int round = 0; round < 3; round++) {
+        double start = now_seconds();
+        for (int i = 0; i < iterations; i++) {
+            token_buffer_clear(&list);
+            tokenize(text, &list, &parser.logging);
+            parser_compile(&parser, &list, &expr);
+        }
+        double elapsed = (now_seconds() - start) / iterations / (literal_count + 1) * 1e9;
+        if (elapsed < best) best = elapsed;
+    }
+    printf("\nNumber literals (%d per line, tokenize + compile)\n", literal_count + 1);
+    printf("%.1f ns/literal\n", best);
+
+    expr_destroy(&expr);
+    token_buffer_free(&list);
+    parser_destroy(&parser);
+    free(text);
+}
+
+// Lexer throughput on large generated inputs, one mostly short tokens as in
+// typical formulas, one with long names and strings.
+static void bench_lexer(void)
+{
+    enum { text_len = 8 << 20, iterations = 5 };
+    static const char *short_pieces[] = {"$x", "+", "12", "*", "(", "y1", ")", "let", "foo", "==", "3.25", ",", "'ab'", "-"};
+    static const char *long_pieces[] = {"$temperatureSensor", "+", "\"a fairly long string literal with an \\\" escape\"",
+                                        "1234567890123", "*", "someVeryLongFunctionName", "(", "'another string body'", ")"};
+    static const char *names[] = {"short tokens", "long tokens"};
+    char *text = malloc(text_len + 64);
+    TokenBuffer list = {0};
+
+    srand(42);
+    for (int kind = 0; kind < 2; kind++) {
+        const char **pieces = kind == 0 ? short_pieces : long_pieces;
+        int piece_count = kind == 0 ? 14 : 9;
+        size_t len = 0;
+        while (len < text_len) {
+            len += sprintf(&text[len], "%s%s", pieces[rand() % piece_count], rand() % 8 ? " " : "\n    ");
+        }
+        text[len] = '\0';
+
+        double best = 1e30;
+        for (int i = 0; i < iterations; i++) {
+            token_buffer_clear(&list);
+            double start = now_seconds();
+            tokenize(text, &list, NULL);
+            double elapsed = now_seconds() - start;
+            if (elapsed < best) best = elapsed;
+        }
+        printf("\nLexer, %s (%.1f MB, %zu tokens)\n", names[kind], len / 1e6, list.count);
+        printf("%.0f MB/s\n", len / best / 1e6);
+    }
+
+    token_buffer_free(&list);
+    free(text);
+}
+
+// Compiling a multi-megabyte generated expression, from a token list built
+// up front and from tokens pulled as the parser goes.
+static void bench_stream(void)
+{
+    enum { text_len = 4 << 20, iterations = 5 };
+    char *text = malloc(text_len + 64);
+    size_t len = 0;
+
+    srand(42);
+    while (len < text_len) {
+        len += sprintf(&text[len], "%d.%d * $x + ", rand() % 1000, rand() % 100);
+    }
+    sprintf(&text[len], "1");
+
+    Parser parser = parser_create();
+    TokenBuffer list = {0};
+    Expr expr = expr_new();
+    double best_list = 1e30;
+    double best_stream = 1e30;
+
+    for (int i = 0; i < iterations; i++) {
+        double start = now_seconds();
+        token_buffer_clear(&list);
+        tokenize(text, &list, &parser.logging);
+        parser_compile(&parser, &list, &expr);
+        double elapsed = now_seconds() - start;
+        if (elapsed < best_list) best_list = elapsed;
+
+        start = now_seconds();
+        TokenStream tokens = token_stream_new(text, &parser.logging);
+        parser_compile_stream(&parser, &tokens, &expr);
+        elapsed = now_seconds() - start;
+        if (elapsed < best_stream) best_stream = elapsed;
+    }
+    printf("\nCompiling a %.1f MB expression (%zu tokens, MB/s)\n", len / 1e6, list.count);
+    printf("token list %8.0f\n", len / best_list / 1e6);
+    printf("streamed   %8.0f\n", len / best_stream / 1e6);
+
+    expr_destroy(&expr);
+    token_buffer_free(&list);
+    parser_destroy(&parser);
+    free(text);
+}
+
+void bench_run(void)
+{
+    bench_evaluators();
+    bench_batch();
+    bench_strings();
+    bench_map();
+    bench_literals();
+    bench_lexer();
+    bench_stream();
+    bench_pool();
+    bench_script();
+}
@@ -0,0 +1,432 @@
+#include "parser.h"
+#include "arena.h"
+#include "expr.h"
+#include "vars.h"
+#include "log.h"
+#include "value.h"
+#include "number.h"
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdlib.h>
+
+Value do_operation(Parser *parser, Value left, Value right, TokenType oper)
+{
+    if (VALUE_TYPE(left) != VALUE_TYPE(right)) {
+        char buffer1[100];
+        value_to_str(buffer1, sizeof(buffer1), &left);
+        char buffer2[100];
+        value_to_str(buffer2, sizeof(buffer2), &right);
+
+        log_info(&parser->logging, "Error: Value: %s of type: %s has a different type than Value: %s of type: %s",
+                buffer1, value_type_to_str(VALUE_TYPE(left)), buffer2, value_type_to_str(VALUE_TYPE(right)));
+
+        parser->error = true;
+        return VAL_BOOL(false);
+    }
+
+    Value result = VAL_BOOL(false);
+
+    #define invalid_op()\
+        do { \
+            log_info(&parser->logging, "Error: Can't perform this operation: %s on a value of this type: %s",\
+                    operator_str(oper), value_type_to_str(VALUE_TYPE(left)));\
+            parser->error = true;\
+        } while (0)
+
+    switch (oper) {
+        case TOKEN_PLUS:
+            switch (VALUE_TYPE(left)) {
+                case VALUE_BOOL: invalid_op(); break;
+                case VALUE_NUM: result = num_add(left, right); break;
+                case VALUE_STR: result = value_temp_string(&parser->boxes, string_add(&parser->scratch, &AS_STR(left), &AS_STR(right))); break;
+            }
+            break;
+        case TOKEN_MINUS:
+            if (VALUE_TYPE(left) != VALUE_NUM) invalid_op();
+            else result = num_sub(left, right);
+            break;
+        case TOKEN_STAR:
+            if (VALUE_TYPE(left) != VALUE_NUM) invalid_op();
+            else result = num_mul(left, right);
+            break;
+        case TOKEN_SLASH:
+            if (VALUE_TYPE(left) != VALUE_NUM) invalid_op();
+            else result = num_div(left, right);
+            break;
+        case TOKEN_CARET:
+            if (VALUE_TYPE(left) != VALUE_NUM) invalid_op();
+            else result = num_pow(left, right);
+            break;
+        case TOKEN_EQEQ:
+            switch (VALUE_TYPE(left)) {
+                case VALUE_NUM:  result = VAL_BOOL(NUM_CMP(left, ==, right)); break;
+                case VALUE_STR:  result = VAL_BOOL(string_compare(&AS_STR(left), &AS_STR(right))); break;
+                case VALUE_BOOL: result = VAL_BOOL(AS_BOOL(left) == AS_BOOL(right)); break;
+            }
+            break;
+        case TOKEN_NOTEQ:
+            switch (VALUE_TYPE(left)) {
+                case VALUE_NUM:  result = VAL_BOOL(NUM_CMP(left, !=, right)); break;
+                case VALUE_STR:  result = VAL_BOOL(!string_compare(&AS_STR(left), &AS_STR(right))); break;
+                case VALUE_BOOL: result = VAL_BOOL(AS_BOOL(left) != AS_BOOL(right)); break;
+            }
+            break;
+        case TOKEN_LESS:
+            if (VALUE_TYPE(left) != VALUE_NUM) invalid_op();
+            else result = VAL_BOOL(NUM_CMP(left, <, right));
+            break;
+        case TOKEN_LESSEQ:
+            if (VALUE_TYPE(left) != VALUE_NUM) invalid_op();
+            else result = VAL_BOOL(NUM_CMP(left, <=, right));
+            break;
+        case TOKEN_GREATER:
+            if (VALUE_TYPE(left) != VALUE_NUM) invalid_op();
+            else result = VAL_BOOL(NUM_CMP(left, >, right));
+            break;
+        case TOKEN_GREATEREQ:
+            if (VALUE_TYPE(left) != VALUE_NUM) invalid_op();
+            else result = VAL_BOOL(NUM_CMP(left, >=, right));
+            break;
+        case TOKEN_OR:
+            if (VALUE_TYPE(left) != VALUE_BOOL) invalid_op();
+            else result = VAL_BOOL(AS_BOOL(left) || AS_BOOL(right));
+            break;
+        case TOKEN_AND:
+            if (VALUE_TYPE(left) != VALUE_BOOL) invalid_op();
+            else result = VAL_BOOL(AS_BOOL(left) && AS_BOOL(right));
+            break;
+        default: break; // Unreachable
+    }
+
+    #undef invalid_op
+
+    return result;
+}
+
+// '-' takes a number and '!' a bool. Integers have no room for a bool, so the
+// type is checked instead of reading whatever the value holds.
+Value do_unary(Parser *parser, Value operand, TokenType oper)
+{
+    ValueType expected = oper == TOKEN_NOT ? VALUE_BOOL : VALUE_NUM;
+    if (VALUE_TYPE(operand) != expected) {
+        log_info(&parser->logging, "Error: Can't perform this operation: %s on a value of this type: %s",
+                operator_str(oper), value_type_to_str(VALUE_TYPE(operand)));
+        parser->error = true;
+        return VAL_BOOL(false);
+    }
+
+    return oper == TOKEN_NOT ? VAL_BOOL(!AS_BOOL(operand)) : num_neg(operand);
+}
+
+Value math_call(MathFunc func, Value arg1, Value arg2)
+{
+    switch (func) {
+        case SIN:   return VAL_NUM(NUM_FN(sin)(AS_NUM(arg1)));
+        case COS:   return VAL_NUM(NUM_FN(cos)(AS_NUM(arg1)));
+        case TAN:   return VAL_NUM(NUM_FN(tan)(AS_NUM(arg1)));
+        case ASIN:  return VAL_NUM(NUM_FN(asin)(AS_NUM(arg1)));
+        case ACOS:  return VAL_NUM(NUM_FN(acos)(AS_NUM(arg1)));
+        case ATAN:  return VAL_NUM(NUM_FN(atan)(AS_NUM(arg1)));
+        case ATAN2: return VAL_NUM(NUM_FN(atan2)(AS_NUM(arg1), AS_NUM(arg2)));
+        case SINH:  return VAL_NUM(NUM_FN(sinh)(AS_NUM(arg1)));
+        case COSH:  return VAL_NUM(NUM_FN(cosh)(AS_NUM(arg1)));
+        case TANH:  return VAL_NUM(NUM_FN(tanh)(AS_NUM(arg1)));
+        case ASINH: return VAL_NUM(NUM_FN(asinh)(AS_NUM(arg1)));
+        case ACOSH: return VAL_NUM(NUM_FN(acosh)(AS_NUM(arg1)));
+        case ATANH: return VAL_NUM(NUM_FN(atanh)(AS_NUM(arg1)));
+        case EXP:   return VAL_NUM(NUM_FN(exp)(AS_NUM(arg1)));
+        case LOG:   return VAL_NUM(NUM_FN(log)(AS_NUM(arg1)));
+        case LOG10: return VAL_NUM(NUM_FN(log10)(AS_NUM(arg1)));
+        case LOG2:  return VAL_NUM(NUM_FN(log2)(AS_NUM(arg1)));
+        case CEIL:  return IS_INT(arg1) ? arg1 : num_integral(NUM_FN(ceil)(AS_NUM(arg1)));
+        case FLOOR: return IS_INT(arg1) ? arg1 : num_integral(NUM_FN(floor)(AS_NUM(arg1)));
+        case ROUND: return IS_INT(arg1) ? arg1 : num_integral(NUM_FN(round)(AS_NUM(arg1)));
+        case SQRT:  return VAL_NUM(NUM_FN(sqrt)(AS_NUM(arg1)));
+        case PI:    return VAL_NUM(3.14159265358979323846264338327950288419716939937510f);
+        case EULER: return VAL_NUM(2.71828182845904523536028747135266249775724709369995f);
+        default:    return VAL_NUM(0.0f); // unreachable
+    }
+}
+
+bool is_name(FILE *f, String name)
+{
+    if (f == NULL || feof(f)) return false;
+
+    char c = fgetc(f);
+    size_t i = 0;
+
+    while (i < name.len && c != '\0' && !feof(f)) {
+        if (c != name.data[i++]) return false;
+        c = fgetc(f);
+    }
+
+    if (i != name.len || c != '\0') return false;
+
+    return true;
+}
+
+bool export_variable(FILE *f, String variable_name, Value value)
+{
+    if (f == NULL) return false;
+
+    if (fwrite(variable_name.data, sizeof(char), variable_name.len, f) != variable_name.len) return false;
+    if (fputc('\0', f) == EOF) return false;
+
+    // Numbers and bools are written the same way whatever the Value encoding.
+    ValueType type = VALUE_TYPE(value);
+    if (fwrite(&type, sizeof(ValueType), 1, f) != 1) return false;
+    switch (type) {
+        case VALUE_NUM: {
+            long double num = AS_LONG_DOUBLE(value);
+            if (fwrite(&num, sizeof(num), 1, f) != 1) return false;
+            break;
+        }
+        case VALUE_BOOL: {
+            bool bol = AS_BOOL(value);
+            if (fwrite(&bol, sizeof(bol), 1, f) != 1) return false;
+            break;
+        }
+        case VALUE_STR: {
+            // Lengths are stored as size_t, as before strings cached their hash.
+            size_t len = AS_STR(value).len;
+            if (fwrite(&len, sizeof(len), 1, f) != 1) return false;
+            if (fwrite(AS_STR(value).data, sizeof(char), AS_STR(value).len, f) != AS_STR(value).len) return false;
+            break;
+        }
+        default:
+            return false;
+    }
+
+    return true;
+}
+
+bool import_variable(Parser *parser, FILE *f, String variable_name, Value *value)
+{
+    if (f == NULL || feof(f)) return false;
+
+    if (!is_name(f, variable_name)) return false;
+
+    ValueType type;
+    if (fread(&type, sizeof(ValueType), 1, f) != 1) return false;
+    switch (type) {
+        case VALUE_NUM: {
+            long double num;
+            if (fread(&num, sizeof(num), 1, f) != 1) return false;
+            bool whole = num >= -NUM_INT_LIMIT && num < NUM_INT_LIMIT && num == (long double)(int64_t)num;
+            *value = whole ? VAL_INT((int64_t)num) : VAL_NUM(num);
+            break;
+        }
+        case VALUE_BOOL: {
+            bool bol;
+            if (fread(&bol, sizeof(bol), 1, f) != 1) return false;
+            *value = VAL_BOOL(bol);
+            break;
+        }
+        case VALUE_STR: {
+            size_t len;
+            if (fread(&len, sizeof(len), 1, f) != 1 || len > UINT32_MAX) return false;
+            char *buffer = arena_alloc(&parser->scratch, sizeof(char) * (len + 1));
+            if (fread(buffer, sizeof(char), len, f) != len) return false;
+            buffer[len] = '\0';
+            *value = value_temp_string(&parser->boxes, (String){.data = buffer, .len = len});
+            break;
+        }
+        default:
+            return false;
+    }
+
+    return true;
+}
+
+// Computed strings aren't NUL terminated, so paths are copied before fopen.
+FILE* open_path(Parser *parser, Value path, const char *mode)
+{
+    if (VALUE_TYPE(path) != VALUE_STR) {
+        log_info(&parser->logging, "Error: Expected a file path but got a value of type: %s", value_type_to_str(VALUE_TYPE(path)));
+        return NULL;
+    }
+
+    char *buffer = malloc(sizeof(char) * (AS_STR(path).len + 1));
+    memcpy(buffer, AS_STR(path).data, sizeof(char) * AS_STR(path).len);
+    buffer[AS_STR(path).len] = '\0';
+
+    FILE *file = fopen(buffer, mode);
+    if (file == NULL) {
+        log_info(&parser->logging, "Error: Couldn't open file '%s'", buffer);
+    }
+    free(buffer);
+
+    return file;
+}
+
+Value export_var(Parser *parser, String var_name, Value path)
+{
+    Value *value = vars_get(&parser->vars, var_name, NULL);
+    if (!value) {
+        log_info(&parser->logging, "Error: variable '%.*s' doesn't exist.", (int)var_name.len, var_name.data);
+        parser->error = true;
+        return VAL_BOOL(false);
+    }
+
+    FILE *file = open_path(parser, path, "wb");
+    if (file == NULL) {
+        parser->error = true;
+        return VAL_BOOL(false);
+    }
+    if (!export_variable(file, var_name, *value)) {
+        fclose(file);
+        log_info(&parser->logging, "Error: Failed to export variable '%s'", var_name.data);
+        parser->error = true;
+        return VAL_BOOL(false);
+    }
+    fclose(file);
+
+    return VAL_BOOL(true);
+}
+
+Value import_var(Parser *parser, Value name, Value path)
+{
+    if (VALUE_TYPE(name) != VALUE_STR) {
+        log_info(&parser->logging, "Error: Variable name should be a string.");
+        parser->error = true;
+        return VAL_BOOL(false);
+    }
+
+    String var_name = AS_STR(name);
+    FILE *file = open_path(parser, path, "rb");
+    if (file == NULL) {
+        parser->error = true;
+        return VAL_BOOL(false);
+    }
+    Value var = {0};
+    if (!import_variable(parser, file, var_name, &var)) {
+        fclose(file);
+        log_info(&parser->logging, "Failed to import variable '%.*s'", (int)var_name.len, var_name.data);
+        parser->error = true;
+        return VAL_BOOL(false);
+    }
+    fclose(file);
+
+    return var;
+}
+
+Value declare_var(Parser *parser, String name, VarRef *ref, Value result)
+{
+    return *vars_set(&parser->vars, name, ref, value_retain(result));
+}
+
+// Removes a variable, evaluates to whether it existed.
+Value drop_var(Parser *parser, String name)
+{
+    return VAL_BOOL(vars_remove(&parser->vars, name));
+}
+
+Value load_var(Parser *parser, String name, VarRef *ref)
+{
+    Value *value = vars_get(&parser->vars, name, ref);
+    if (!value) {
+        log_info(&parser->logging, "Error: Variable '%.*s' doesn't exist", (int)name.len, name.data);
+        parser->error = true;
+        return (Value){0};
+    }
+
+    return *value;
+}
+
+// Evaluates a node whose operands have been evaluated, left and right are
+// their values.
+static Value eval_node(Parser *parser, Node *node, Value left, Value right)
+{
+    switch (node->type) {
+        case NODE_VALUE:
+            return node->as.value;
+        case NODE_ANS:
+            return parser->ans;
+        case NODE_VAR:
+            return load_var(parser, node->as.name, &node->as.ref);
+        case NODE_UNARY:
+            switch (node->op) {
+                case TOKEN_NOT:
+                case TOKEN_MINUS: return do_unary(parser, left, node->op);
+                default:          return left;
+            }
+        case NODE_BINARY:
+            if (parser->error) return VAL_BOOL(false);
+            return do_operation(parser, left, right, node->op);
+        case NODE_CALL:
+            return math_call(node->func, left, right);
+        case NODE_LET:
+            if (parser->error) return VAL_BOOL(false);
+            return declare_var(parser, node->as.name, &node->as.ref, left);
+        case NODE_EXPORT:
+            if (parser->error) {
+                log_info(&parser->logging, "Error: Couldn't export variable because of parsing error.");
+                return VAL_BOOL(false);
+            }
+            return export_var(parser, node->as.name, left);
+        case NODE_IMPORT:
+            if (parser->error) return VAL_BOOL(false);
+            return import_var(parser, left, right);
+        case NODE_DROP:
+            if (parser->error) return VAL_BOOL(false);
+            return drop_var(parser, node->as.name);
+        case NODE_EXIT:
+            parser->exit = true;
+            parser->error = true;
+            return VAL_BOOL(false);
+    }
+
+    return VAL_BOOL(false); // Unreachable
+}
+
+// ans outlives the evaluation that produced it, so it holds a reference to
+// its string. The old one is released after retaining since the result may be it.
+Value set_ans(Parser *parser, Value result)
+{
+    Value old = parser->ans;
+    parser->ans = value_retain(result);
+    value_release(&old);
+
+    return parser->ans;
+}
+
+// Promotes a successful result to ans and drops the evaluation's temporaries.
+// Values that escape otherwise (declare, export) were already copied out.
+Value finish_eval(Parser *parser, Value result)
+{
+    if (parser->error) result = VAL_BOOL(false);
+    else result = set_ans(parser, result);
+    arena_reset(&parser->scratch);
+    arena_reset(&parser->boxes);
+
+    return result;
+}
+
+Value parser_eval(Parser *parser, Expr *expr)
+{
+    parser->error = false;
+
+    if (expr->root == NO_NODE) {
+        parser->error = true;
+        return VAL_NUM(0.0);
+    }
+
+    // Operands are evaluated left to right, each node's values are on top of
+    // the stack when it's reached. Neither stack grows past the node count.
+    ExprStack *walk = &parser->walk;
+    ValueList *values = &parser->values;
+    list_reserve(values, expr->nodes.count);
+    list_clear(values);
+    expr_walk_start(expr, walk, expr->root);
+
+    for (NodeId id = expr_walk_next(expr, walk); id != NO_NODE; id = expr_walk_next(expr, walk)) {
+        Node *node = &expr->nodes.items[id];
+        Value right = node->right != NO_NODE ? values->items[--values->count] : VAL_NUM(0.0);
+        Value left = node->left != NO_NODE ? values->items[--values->count] : VAL_NUM(0.0);
+        values->items[values->count++] = eval_node(parser, node, left, right);
+    }
+
+    return finish_eval(parser, values->items[0]);
+}
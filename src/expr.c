@@ -0,0 +1,220 @@
+#include "expr.h"
+#include "intern.h"
+#include "value.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static const char* funcs[MATHFUNC_COUNT] = {
+#define X(name, text, arity) text,
+    MATH_FUNCS(X)
+#undef X
+};
+
+static const int arities[MATHFUNC_COUNT] = {
+#define X(name, text, arity) arity,
+    MATH_FUNCS(X)
+#undef X
+};
+
+const char* math_func_name(MathFunc func)
+{
+    return func < MATHFUNC_COUNT ? funcs[func] : NULL;
+}
+
+int math_func_arity(MathFunc func)
+{
+    return arities[func];
+}
+
+const char* operator_str(TokenType type)
+{
+    switch (type) {
+        case TOKEN_PLUS:      return "+";
+        case TOKEN_MINUS:     return "-";
+        case TOKEN_STAR:      return "*";
+        case TOKEN_SLASH:     return "/";
+        case TOKEN_CARET:     return "^";
+        case TOKEN_OR:        return "||";
+        case TOKEN_AND:       return "&&";
+        case TOKEN_EQEQ:      return "==";
+        case TOKEN_NOT:       return "!";
+        case TOKEN_NOTEQ:     return "!=";
+        case TOKEN_LESS:      return "<";
+        case TOKEN_LESSEQ:    return "<=";
+        case TOKEN_GREATER:   return ">";
+        case TOKEN_GREATEREQ: return ">=";
+        default:              return "?";
+    }
+}
+
+Expr expr_new(void)
+{
+    Expr expr;
+    expr.nodes = list_new(NodeList);
+    expr.root = NO_NODE;
+
+    return expr;
+}
+
+// Nodes hold a reference to their string literal or interned name.
+void expr_clear(Expr *expr)
+{
+    for (size_t i = 0; i < expr->nodes.count; i++) {
+        Node *node = &expr->nodes.items[i];
+        switch (node->type) {
+            case NODE_VALUE:
+                value_release(&node->as.value);
+                break;
+            case NODE_VAR:
+            case NODE_LET:
+            case NODE_EXPORT:
+            case NODE_DROP:
+                intern_release(&node->as.name);
+                break;
+            default:
+                break;
+        }
+    }
+    list_clear(&expr->nodes);
+    expr->root = NO_NODE;
+}
+
+void expr_destroy(Expr *expr)
+{
+    expr_clear(expr);
+    list_free(&expr->nodes);
+}
+
+NodeId expr_push(Expr *expr, Node node)
+{
+    list_push(&expr->nodes, node);
+
+    return (NodeId)(expr->nodes.count - 1);
+}
+
+// Trees are walked with a stack of their own rather than by recursion, so a
+// chain of hundreds of thousands of operators can't overflow the C stack.
+// The stack holds at most one frame per node.
+void expr_walk_start(Expr *expr, ExprStack *stack, NodeId root)
+{
+    list_reserve(stack, expr->nodes.count);
+    list_clear(stack);
+    if (root != NO_NODE) list_push(stack, ((ExprFrame){.id = root, .child = 0}));
+}
+
+// The next node in post-order, operands left to right before the node
+// itself. NO_NODE once the tree is done.
+NodeId expr_walk_next(Expr *expr, ExprStack *stack)
+{
+    while (stack->count > 0) {
+        ExprFrame *frame = &stack->items[stack->count - 1];
+        if (frame->child < 2) {
+            Node *node = &expr->nodes.items[frame->id];
+            NodeId child = frame->child++ == 0 ? node->left : node->right;
+            if (child != NO_NODE) list_push(stack, ((ExprFrame){.id = child, .child = 0}));
+            continue;
+        }
+        stack->count--;
+        return frame->id;
+    }
+
+    return NO_NODE;
+}
+
+static void print_value(Node *node, FILE *out)
+{
+    switch (VALUE_TYPE(node->as.value)) {
+        case VALUE_NUM:
+            fprintf(out, "%.21Lg", AS_LONG_DOUBLE(node->as.value));
+            break;
+        case VALUE_STR: {
+            String str = AS_STR(node->as.value);
+            char quote = memchr(str.data, '"', str.len) ? '\'' : '"';
+            fprintf(out, "%c%.*s%c", quote, (int)str.len, str.data, quote);
+            break;
+        }
+        case VALUE_BOOL:
+            fprintf(out, "%s", AS_BOOL(node->as.value) ? "true" : "false");
+            break;
+    }
+}
+
+// Prints what comes before operand 'step' of the node, or the rest of it
+// once its operands are done. Returns the operand to print next, NO_NODE
+// when the node is finished.
+static NodeId print_step(Node *node, int step, FILE *out)
+{
+    switch (node->type) {
+        case NODE_VALUE:
+            print_value(node, out);
+            return NO_NODE;
+        case NODE_ANS:
+            fprintf(out, "ans");
+            return NO_NODE;
+        case NODE_VAR:
+            fprintf(out, "$%.*s", (int)node->as.name.len, node->as.name.data);
+            return NO_NODE;
+        case NODE_UNARY:
+            if (step > 0) return NO_NODE;
+            fprintf(out, "%s", operator_str(node->op));
+            return node->left;
+        case NODE_BINARY:
+            if (step == 0) fprintf(out, "(");
+            else if (step == 1) fprintf(out, " %s ", operator_str(node->op));
+            else fprintf(out, ")");
+            return step == 0 ? node->left : step == 1 ? node->right : NO_NODE;
+        case NODE_CALL:
+            if (step == 0) {
+                fprintf(out, "%s", math_func_name(node->func));
+                if (math_func_arity(node->func) == 0) return NO_NODE;
+                fprintf(out, "(");
+                return node->left;
+            }
+            if (step == 1 && node->right != NO_NODE) {
+                fprintf(out, ", ");
+                return node->right;
+            }
+            fprintf(out, ")");
+            return NO_NODE;
+        case NODE_LET:
+            if (step > 0) return NO_NODE;
+            fprintf(out, "let %.*s = ", (int)node->as.name.len, node->as.name.data);
+            return node->left;
+        case NODE_EXPORT:
+            if (step > 0) {
+                fprintf(out, ")");
+                return NO_NODE;
+            }
+            fprintf(out, "export($%.*s, ", (int)node->as.name.len, node->as.name.data);
+            return node->left;
+        case NODE_IMPORT:
+            if (step == 0) fprintf(out, "import(");
+            else if (step == 1) fprintf(out, ", ");
+            else fprintf(out, ")");
+            return step == 0 ? node->left : step == 1 ? node->right : NO_NODE;
+        case NODE_DROP:
+            fprintf(out, "drop($%.*s)", (int)node->as.name.len, node->as.name.data);
+            return NO_NODE;
+        case NODE_EXIT:
+            fprintf(out, "exit");
+            return NO_NODE;
+    }
+
+    return NO_NODE;
+}
+
+void expr_print(Expr *expr, FILE *out)
+{
+    ExprStack stack = {0};
+    expr_walk_start(expr, &stack, expr->root);
+
+    while (stack.count > 0) {
+        ExprFrame *frame = &stack.items[stack.count - 1];
+        NodeId next = print_step(&expr->nodes.items[frame->id], frame->child++, out);
+        if (next != NO_NODE) list_push(&stack, ((ExprFrame){.id = next, .child = 0}));
+        else stack.count--;
+    }
+    list_free(&stack);
+    fprintf(out, "\n");
+}
@@ -0,0 +1,83 @@
+#pragma once
+
+#include "lexer.h"
+#include "list.h"
+#include "value.h"
+#include "vars.h"
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+typedef enum {
+#define X(name, ...) name,
+    MATH_FUNCS(X)
+#undef X
+    MATHFUNC_COUNT,
+} MathFunc;
+
+// Math builtins come first, in MathFunc order.
+#define BUILTIN_IS_MATH(builtin) ((builtin) > BUILTIN_NONE && (builtin) <= MATHFUNC_COUNT)
+#define BUILTIN_MATH_FUNC(builtin) ((MathFunc)((builtin) - 1))
+
+typedef enum {
+    NODE_VALUE,   // literal number, string or bool
+    NODE_ANS,
+    NODE_VAR,     // $name
+    NODE_UNARY,   // op left
+    NODE_BINARY,  // left op right
+    NODE_CALL,    // func(left[, right])
+    NODE_LET,     // let name = left
+    NODE_EXPORT,  // export($name, left)
+    NODE_IMPORT,  // import(left, right)
+    NODE_DROP,    // drop($name)
+    NODE_EXIT,
+} NodeType;
+
+typedef int32_t NodeId;
+
+#define NO_NODE ((NodeId)-1)
+
+typedef struct {
+    NodeType type;
+    TokenType op;
+    MathFunc func;
+    NodeId left;
+    NodeId right;
+    union {
+        Value value;
+        struct {
+            String name;
+            VarRef ref;     // Slot the name was last found in
+        };
+    } as;
+} Node;
+
+LIST_DEF(NodeList, Node);
+LIST_DEF(ValueList, Value);
+
+// A node on the walk's stack and how many of its operands were pushed.
+typedef struct {
+    NodeId id;
+    uint8_t child;
+} ExprFrame;
+
+LIST_DEF(ExprStack, ExprFrame);
+
+// A compiled expression. Its nodes hold references to their interned
+// variable names and refcounted string literals, so it outlives the text it
+// was compiled from and can be evaluated any number of times.
+typedef struct {
+    NodeList nodes;
+    NodeId root;
+} Expr;
+
+Expr expr_new(void);
+void expr_clear(Expr *expr);
+void expr_destroy(Expr *expr);
+NodeId expr_push(Expr *expr, Node node);
+const char* math_func_name(MathFunc func);
+int math_func_arity(MathFunc func);
+const char* operator_str(TokenType type);
+void expr_print(Expr *expr, FILE *out);
+void expr_walk_start(Expr *expr, ExprStack *stack, NodeId root);
+NodeId expr_walk_next(Expr *expr, ExprStack *stack);
@@ -0,0 +1,82 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+// A wyhash style hash: 8 or 4 bytes are read at a time and folded with
+// 64x64->128 bit multiplies, which spreads every input bit over the result.
+
+#define HASH_SEED 0xa0761d6478bd642full
+#define HASH_P0   0xe7037ed1a0b428dbull
+#define HASH_P1   0x8ebc6af09c88c6e3ull
+
+static inline uint64_t hash_read64(const uint8_t *p)
+{
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint64_t hash_read32(const uint8_t *p)
+{
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline void hash_mum(uint64_t *a, uint64_t *b)
+{
+    __uint128_t r = (__uint128_t)*a * *b;
+    *a = (uint64_t)r;
+    *b = (uint64_t)(r >> 64);
+}
+
+static inline uint64_t hash_mix(uint64_t a, uint64_t b)
+{
+    hash_mum(&a, &b);
+    return a ^ b;
+}
+
+// Never 0, which marks a String whose hash isn't computed yet.
+static inline uint32_t hash_bytes(const void *key, size_t len)
+{
+    const uint8_t *p = key;
+    uint64_t seed = HASH_SEED;
+    uint64_t a, b;
+
+    if (len <= 16) {
+        if (len >= 4) {
+            // Two overlapping 4 byte reads from each end cover up to 16 bytes.
+            size_t middle = (len >> 3) << 2;
+            a = (hash_read32(p) << 32) | hash_read32(p + middle);
+            b = (hash_read32(p + len - 4) << 32) | hash_read32(p + len - 4 - middle);
+        }
+        else if (len > 0) {
+            a = ((uint64_t)p[0] << 16) | ((uint64_t)p[len >> 1] << 8) | p[len - 1];
+            b = 0;
+        }
+        else {
+            a = b = 0;
+        }
+    }
+    else {
+        size_t left = len;
+        while (left > 16) {
+            seed = hash_mix(hash_read64(p) ^ HASH_P1, hash_read64(p + 8) ^ seed);
+            p += 16;
+            left -= 16;
+        }
+        // The last 16 bytes, overlapping the previous block when shorter.
+        a = hash_read64(p + left - 16);
+        b = hash_read64(p + left - 8);
+    }
+
+    a ^= HASH_P1;
+    b ^= seed;
+    hash_mum(&a, &b);
+    uint64_t h = hash_mix(a ^ HASH_P0 ^ len, b ^ HASH_P1);
+    uint32_t folded = (uint32_t)(h ^ (h >> 32));
+
+    return folded ? folded : 1;
+}
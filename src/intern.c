@@ -0,0 +1,117 @@
+#include "intern.h"
+#include "hash.h"
+#include "map.h"
+#include <assert.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Threads parsing at the same time rarely want the same shard's lock.
+#define INTERN_SHARDS 16
+
+typedef struct {
+    pthread_mutex_t lock;
+    Map strings;    // Keys are the interned strings, values are unused
+} InternShard;
+
+// An interned name and the references to it, its text follows.
+typedef struct {
+    uint32_t refs;
+    char data[];
+} InternEntry;
+
+#define INTERN_ENTRY(string) ((InternEntry*)((string).data - offsetof(InternEntry, data)))
+
+static InternShard shards[INTERN_SHARDS];
+static pthread_once_t shards_once = PTHREAD_ONCE_INIT;
+
+static void shards_init(void)
+{
+    for (int i = 0; i < INTERN_SHARDS; i++) {
+        pthread_mutex_init(&shards[i].lock, NULL);
+        shards[i].strings = map_new();
+    }
+}
+
+// The map uses the low bits of the hash, shards the top four.
+static InternShard* shard_of(uint32_t hash)
+{
+    return &shards[hash >> 28];
+}
+
+// hash may be 0 if the caller doesn't know it yet.
+String intern(const char *text, size_t len, uint32_t hash)
+{
+    pthread_once(&shards_once, shards_init);
+
+    String key = {.data = (char*)text, .len = len, .hash = hash ? hash : hash_bytes(text, len)};
+    InternShard *shard = shard_of(key.hash);
+
+    pthread_mutex_lock(&shard->lock);
+    bool inserted;
+    Map_Node *node = map_entry(&shard->strings, key, &inserted);
+    if (inserted) {
+        InternEntry *entry = malloc(sizeof(InternEntry) + len + 1);
+        assert(entry && "Failed to allocate a name");
+        entry->refs = 0;
+        memcpy(entry->data, text, len);
+        entry->data[len] = '\0';
+        node->key.data = entry->data;
+    }
+    INTERN_ENTRY(node->key)->refs++;
+    String interned = node->key;
+    pthread_mutex_unlock(&shard->lock);
+
+    return interned;
+}
+
+String intern_string(String string)
+{
+    return intern(string.data, string.len, string.hash);
+}
+
+// The caller already holds a reference, so the entry can't go away meanwhile.
+String intern_retain(String name)
+{
+    InternShard *shard = shard_of(name.hash);
+
+    pthread_mutex_lock(&shard->lock);
+    INTERN_ENTRY(name)->refs++;
+    pthread_mutex_unlock(&shard->lock);
+
+    return name;
+}
+
+// The last reference removes the name from the table and frees it. Releasing
+// an empty String does nothing.
+void intern_release(String *name)
+{
+    if (!name->data) return;
+
+    InternShard *shard = shard_of(name->hash);
+    InternEntry *entry = INTERN_ENTRY(*name);
+
+    pthread_mutex_lock(&shard->lock);
+    if (--entry->refs == 0) {
+        map_remove(&shard->strings, *name, NULL);
+        free(entry);
+    }
+    pthread_mutex_unlock(&shard->lock);
+
+    *name = (String){0};
+}
+
+// Names in the table, for tests.
+size_t intern_count(void)
+{
+    pthread_once(&shards_once, shards_init);
+
+    size_t count = 0;
+    for (int i = 0; i < INTERN_SHARDS; i++) {
+        pthread_mutex_lock(&shards[i].lock);
+        count += shards[i].strings.count;
+        pthread_mutex_unlock(&shards[i].lock);
+    }
+
+    return count;
+}
@@ -0,0 +1,15 @@
+#pragma once
+
+#include "value.h"
+#include <stddef.h>
+#include <stdint.h>
+
+// Every distinct variable name is stored once and shared by all threads, two
+// interned names are equal exactly when their data pointers are. Names are
+// refcounted: each intern or retain takes a reference that is given back with
+// intern_release, and a name nothing refers to leaves the table.
+String intern(const char *text, size_t len, uint32_t hash);
+String intern_string(String string);
+String intern_retain(String name);
+void intern_release(String *name);
+size_t intern_count(void);
@@ -1,22 +1,95 @@
 #include "lexer.h"
+#include "hash.h"
 #include "log.h"
 #include "string.h"
+#include <pthread.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
+#include <errno.h>
+#include <limits.h>
+#include <unistd.h>
+
+// The reserved words, generated from the tables in lexer.h.
+typedef struct {
+    const char *text;
+    uint8_t len;
+    uint8_t type;       // TOKEN_IDENTIFIER for builtins
+    uint8_t builtin;
+} Word;
+
+static const Word words[] = {
+#define X(name, text) {text, sizeof(text) - 1, TOKEN_##name, BUILTIN_NONE},
+    KEYWORDS(X)
+#undef X
+#define X(name, text, ...) {text, sizeof(text) - 1, TOKEN_IDENTIFIER, BUILTIN_##name},
+    MATH_FUNCS(X)
+    SPECIAL_FUNCS(X)
+#undef X
+};
+
+// A perfect hash of the words. The top bits of an identifier's hash times
+// word_seed index word_slots, which holds the only word that can match, as
+// its index + 1. The seed is searched for once, the first multiplier that
+// gives every word its own slot.
+#define WORD_BITS 8
+
+static uint8_t word_slots[1 << WORD_BITS];
+static uint32_t word_seed;
+static pthread_once_t words_once = PTHREAD_ONCE_INIT;
+
+static uint32_t word_slot(uint32_t hash, uint32_t seed)
+{
+    return (hash * seed) >> (32 - WORD_BITS);
+}
 
-Lexer lexer_new(const char *text)
+static void words_init(void)
 {
+    for (uint32_t seed = 0x9e3779b1u;; seed += 2) {
+        memset(word_slots, 0, sizeof(word_slots));
+        bool perfect = true;
+        for (size_t i = 0; i < array_len(words) && perfect; i++) {
+            uint8_t *slot = &word_slots[word_slot(hash_bytes(words[i].text, words[i].len), seed)];
+            perfect = *slot == 0;
+            *slot = (uint8_t)(i + 1);
+        }
+        if (perfect) {
+            word_seed = seed;
+            return;
+        }
+    }
+}
+
+Lexer lexer_new(const char *text, LoggingInfo *logging)
+{
+    pthread_once(&words_once, words_init);
+
     Lexer lexer = {
         .text = text,
         .current = 0,
         .error = false,
-        .logging = log_create("lexer_log.txt", NULL, 0),
+        .logging = logging,
     };
 
     return lexer;
 }
 
+// Chunked input may rescan a token cut off by the end of the window, the
+// message is only logged once the token is final.
+static void lexer_error(Lexer *lexer, const char *message)
+{
+    lexer->message = message;
+    lexer->error = true;
+}
+
+static void lexer_report(Lexer *lexer)
+{
+    if (lexer->message && lexer->logging) log_info(lexer->logging, "%s", lexer->message);
+    lexer->message = NULL;
+}
+
 static char peek(Lexer *lexer)
 {
     return lexer->text[lexer->current];
@@ -27,286 +100,697 @@ static char consume(Lexer *lexer)
     return lexer->text[lexer->current++];
 }
 
-static bool is_space(char c)
+// Character classes, one table load instead of a chain of comparisons.
+enum {
+    CHAR_SPACE = 1 << 0,
+    CHAR_DIGIT = 1 << 1,
+    CHAR_ALPHA = 1 << 2,
+    CHAR_HEX   = 1 << 3,
+};
+
+static const uint8_t char_class[256] = {
+    [' '] = CHAR_SPACE, ['\t'] = CHAR_SPACE, ['\n'] = CHAR_SPACE, ['\r'] = CHAR_SPACE,
+    ['0' ... '9'] = CHAR_DIGIT | CHAR_HEX,
+    ['a' ... 'f'] = CHAR_ALPHA | CHAR_HEX,
+    ['A' ... 'F'] = CHAR_ALPHA | CHAR_HEX,
+    ['g' ... 'z'] = CHAR_ALPHA,
+    ['G' ... 'Z'] = CHAR_ALPHA,
+};
+
+#define CHAR_IS(c, class) (char_class[(uint8_t)(c)] & (class))
+
+static bool is_digit(char c)
 {
-    return c == ' '  ||
-           c == '\n' ||
-           c == '\t' ||
-           c == '\r';
+    return CHAR_IS(c, CHAR_DIGIT);
 }
 
-static bool is_alpha(char c)
+static bool is_hex_digit(char c)
 {
-    return (c >= 'a' && c <= 'z') ||
-           (c >= 'A' && c <= 'Z');
+    return CHAR_IS(c, CHAR_HEX);
 }
 
-static bool is_digit(char c)
+static int hex_value(char c)
+{
+    if (is_digit(c)) return c - '0';
+
+    return (c | 0x20) - 'a' + 10;
+}
+
+// Operators, by their first character. The second character, if it matches
+// next, makes the two character form.
+typedef struct {
+    uint8_t single;     // TOKEN_NONE if the character can't stand alone
+    char next;
+    uint8_t pair;
+} Operator;
+
+static const Operator operators[256] = {
+    ['+'] = {TOKEN_PLUS},
+    ['-'] = {TOKEN_MINUS},
+    ['*'] = {TOKEN_STAR},
+    ['/'] = {TOKEN_SLASH},
+    ['^'] = {TOKEN_CARET},
+    ['('] = {TOKEN_LEFT_PAREN},
+    [')'] = {TOKEN_RIGHT_PAREN},
+    [','] = {TOKEN_COMMA},
+    ['$'] = {TOKEN_DOLLAR},
+    ['='] = {TOKEN_EQUAL, '=', TOKEN_EQEQ},
+    ['!'] = {TOKEN_NOT, '=', TOKEN_NOTEQ},
+    ['<'] = {TOKEN_LESS, '=', TOKEN_LESSEQ},
+    ['>'] = {TOKEN_GREATER, '=', TOKEN_GREATEREQ},
+    ['&'] = {TOKEN_NONE, '&', TOKEN_AND},
+    ['|'] = {TOKEN_NONE, '|', TOKEN_OR},
+};
+
+// Runs of spaces, digits, identifier characters and string bodies are
+// scanned a block at a time. The loads are aligned so they never cross into
+// a page past the terminating NUL, which stops every run, and the bytes of
+// the first block before the run are shifted out of the mask. Reading the
+// rest of the last block is fine for the hardware but not for ASan.
+#if defined(__AVX2__)
+  #include <immintrin.h>
+  #define SCAN_WIDTH 32
+  typedef __m256i ScanBlock;
+  #define scan_load(p)  _mm256_load_si256((const __m256i*)(p))
+  #define scan_set(c)   _mm256_set1_epi8(c)
+  #define scan_eq(a, b) _mm256_cmpeq_epi8(a, b)
+  #define scan_gt(a, b) _mm256_cmpgt_epi8(a, b)
+  #define scan_or(a, b) _mm256_or_si256(a, b)
+  #define scan_and(a, b) _mm256_and_si256(a, b)
+  #define scan_mask(a)  (uint32_t)_mm256_movemask_epi8(a)
+  #define SCAN_ALL      0xffffffffu
+#elif defined(__SSE2__)
+  #include <emmintrin.h>
+  #define SCAN_WIDTH 16
+  typedef __m128i ScanBlock;
+  #define scan_load(p)  _mm_load_si128((const __m128i*)(p))
+  #define scan_set(c)   _mm_set1_epi8(c)
+  #define scan_eq(a, b) _mm_cmpeq_epi8(a, b)
+  #define scan_gt(a, b) _mm_cmpgt_epi8(a, b)
+  #define scan_or(a, b) _mm_or_si128(a, b)
+  #define scan_and(a, b) _mm_and_si128(a, b)
+  #define scan_mask(a)  (uint32_t)_mm_movemask_epi8(a)
+  #define SCAN_ALL      0xffffu
+#endif
+
+#ifdef SCAN_WIDTH
+
+#if defined(__SANITIZE_ADDRESS__)
+  #define SCAN_FN __attribute__((no_sanitize_address)) static inline
+#else
+  #define SCAN_FN static inline
+#endif
+
+// Bytes in [lo, hi]. The compare is signed, so bytes past 127 never are.
+static inline ScanBlock scan_range(ScanBlock block, char lo, char hi)
+{
+    return scan_and(scan_gt(block, scan_set(lo - 1)), scan_gt(scan_set(hi + 1), block));
+}
+
+static inline uint32_t stop_space(ScanBlock block)
+{
+    ScanBlock space = scan_or(scan_or(scan_eq(block, scan_set(' ')), scan_eq(block, scan_set('\n'))),
+                              scan_or(scan_eq(block, scan_set('\t')), scan_eq(block, scan_set('\r'))));
+
+    return ~scan_mask(space) & SCAN_ALL;
+}
+
+static inline uint32_t stop_digit(ScanBlock block)
+{
+    return ~scan_mask(scan_range(block, '0', '9')) & SCAN_ALL;
+}
+
+static inline uint32_t stop_alnum(ScanBlock block)
+{
+    ScanBlock letter = scan_range(scan_or(block, scan_set(0x20)), 'a', 'z');
+
+    return ~scan_mask(scan_or(letter, scan_range(block, '0', '9'))) & SCAN_ALL;
+}
+
+// Stops at the quote, a backslash or the end.
+static inline uint32_t stop_string(ScanBlock block, char quote)
+{
+    ScanBlock stop = scan_or(scan_eq(block, scan_set(quote)), scan_eq(block, scan_set('\\')));
+
+    return scan_mask(scan_or(stop, scan_eq(block, scan_set('\0'))));
+}
+
+#define SCAN_RUN(p, stop, ...)                                                  \
+    do {                                                                        \
+        uintptr_t offset = (uintptr_t)(p) % SCAN_WIDTH;                         \
+        const char *block = (p) - offset;                                       \
+        uint32_t mask = stop(scan_load(block), ##__VA_ARGS__) >> offset;        \
+        if (mask) return (p) + __builtin_ctz(mask);                             \
+        for (block += SCAN_WIDTH;; block += SCAN_WIDTH) {                       \
+            mask = stop(scan_load(block), ##__VA_ARGS__);                       \
+            if (mask) return block + __builtin_ctz(mask);                       \
+        }                                                                       \
+    } while (0)
+
+SCAN_FN const char* skip_space(const char *p)
+{
+    SCAN_RUN(p, stop_space);
+}
+
+SCAN_FN const char* skip_digits(const char *p)
+{
+    SCAN_RUN(p, stop_digit);
+}
+
+SCAN_FN const char* skip_alnum(const char *p)
+{
+    SCAN_RUN(p, stop_alnum);
+}
+
+SCAN_FN const char* skip_string(const char *p, char quote)
+{
+    SCAN_RUN(p, stop_string, quote);
+}
+
+#else
+
+static inline const char* skip_space(const char *p)
+{
+    while (CHAR_IS(*p, CHAR_SPACE)) p++;
+    return p;
+}
+
+static inline const char* skip_digits(const char *p)
+{
+    while (CHAR_IS(*p, CHAR_DIGIT)) p++;
+    return p;
+}
+
+static inline const char* skip_alnum(const char *p)
 {
-    return c >= '0' && c <= '9';
+    while (CHAR_IS(*p, CHAR_DIGIT | CHAR_ALPHA)) p++;
+    return p;
 }
 
-static bool is_alnum(char c)
+static inline const char* skip_string(const char *p, char quote)
 {
-    return is_alpha(c) || is_digit(c);
+    while (*p != '\0' && *p != quote && *p != '\\') p++;
+    return p;
 }
 
-static void trim_left(Lexer *lexer)
+#endif // SCAN_WIDTH
+
+// Every identifier is hashed for the variable tables anyway, the same hash
+// finds the one reserved word it could be.
+static void scan_identifier(Lexer *lexer, Token *token)
 {
-    while (is_space(peek(lexer))) {
-        consume(lexer);
+    const char *start = token->start;
+    token->type = TOKEN_IDENTIFIER;
+    token->len = skip_alnum(start) - start;
+    token->hash = hash_bytes(start, token->len);
+    lexer->current += token->len;
+
+    uint8_t slot = word_slots[word_slot(token->hash, word_seed)];
+    if (slot) {
+        const Word *word = &words[slot - 1];
+        if (word->len == token->len && memcmp(word->text, start, word->len) == 0) {
+            token->type = word->type;
+            token->builtin = word->builtin;
+        }
     }
 }
 
-static Token match_identifier(Lexer *lexer, const char *text, int len, TokenType type)
+// The body is skipped to the next quote or backslash a block at a time, a
+// backslash and the character after it are skipped together.
+static void parse_string_literal(Lexer *lexer, Token *token)
 {
-    int start = lexer->current;
+    const char quote = lexer->text[lexer->current++];
+    const char *p = &lexer->text[lexer->current];
 
-    Token token = {0};
+    token->type = TOKEN_STRING;
+    token->start = p;
 
-    while (is_alnum(peek(lexer))) {
-        consume(lexer);
+    for (p = skip_string(p, quote); *p == '\\'; p = skip_string(p, quote)) {
+        if (*++p != '\0') p++;
     }
 
-    if (lexer->current - start == len) {
-        if (memcmp(&lexer->text[start], text, len) == 0) {
-            token.type = type;
-        }
+    token->len = p - token->start;
+    lexer->current += token->len;
+
+    if (*p != quote) {
+        lexer_error(lexer, "Error: Mismatching quotes.");
     }
     else {
-        token.type = TOKEN_IDENTIFIER;
+        lexer->current++;
     }
+}
+
+// Powers of ten a double holds exactly.
+static const double exact_pow10[] = {
+    1e0,  1e1,  1e2,  1e3,  1e4,  1e5,  1e6,  1e7,  1e8,  1e9,  1e10, 1e11,
+    1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22,
+};
+
+#define EXACT_POW10    22
+#define EXACT_MANTISSA (1ull << 53)
+#define MAX_DIGITS     19       // Always fit in a uint64_t
 
-    token.start = &lexer->text[start];
-    token.len = lexer->current - start;
+static void scan_hex(Lexer *lexer, Token *token)
+{
+    lexer->current += 2;
+
+    uint64_t value = 0;
+    bool overflow = false;
+    while (is_hex_digit(peek(lexer))) {
+        overflow = overflow || value >> 60;
+        value = value << 4 | hex_value(consume(lexer));
+    }
+    if (overflow) lexer_error(lexer, "Error: Hex literal doesn't fit in 64 bits");
 
-    return token;
+    token->len = &lexer->text[lexer->current] - token->start;
+    if (value <= INT64_MAX) {
+        token->is_int = true;
+        token->integer = (int64_t)value;
+    }
+    else {
+        token->num = (Number)value;
+    }
 }
 
-static void match(Lexer *lexer, Token *token, char expected, TokenType type)
+// Numbers are parsed once here rather than on every evaluation. Decimals have
+// an optional fraction and exponent, '0x' starts a hex integer. Literals with
+// neither a fraction nor an exponent are integers if they fit. Otherwise up
+// to 19 significant digits are collected, and when they and the power of ten
+// are both exact in a double one multiply or divide gives the correctly
+// rounded result (Clinger's fast path). Anything else goes to NUM_PARSE.
+static void scan_number(Lexer *lexer, Token *token)
 {
-    if (peek(lexer) == expected) {
-        consume(lexer);
-        token->len = 2;
-        token->type = type;
+    const char *p = token->start;
+    token->type = TOKEN_NUM;
+
+    if (p[0] == '0' && (p[1] | 0x20) == 'x' && is_hex_digit(p[2])) {
+        scan_hex(lexer, token);
+        return;
+    }
+
+    uint64_t mantissa = 0;
+    int digits = 0;         // Significant digits in the mantissa
+    int dropped = 0;        // Digits past MAX_DIGITS, integer part only
+    int exponent = 0;       // Power of ten the mantissa is scaled by
+    bool truncated = false;
+    bool whole = true;
+
+    for (const char *end = skip_digits(p); p < end; p++) {
+        if (digits < MAX_DIGITS) {
+            mantissa = mantissa * 10 + (*p - '0');
+            digits += mantissa != 0;
+        }
+        else dropped++;
+    }
+    if (*p == '.') {
+        whole = false;
+        for (const char *end = skip_digits(++p); p < end; p++) {
+            if (digits < MAX_DIGITS) {
+                mantissa = mantissa * 10 + (*p - '0');
+                digits += mantissa != 0;
+                exponent--;
+            }
+            else truncated = true;
+        }
+    }
+    truncated = truncated || dropped > 0;
+    exponent += dropped;
+
+    // An 'e' not followed by digits belongs to the next token.
+    if ((*p | 0x20) == 'e') {
+        bool negative = p[1] == '-';
+        const char *digit = p + 1 + (p[1] == '+' || negative);
+        if (is_digit(*digit)) {
+            int power = 0;
+            for (p = digit; is_digit(*p); p++) {
+                if (power < 100000) power = power * 10 + (*p - '0');
+            }
+            exponent += negative ? -power : power;
+            whole = false;
+        }
+    }
+
+    token->len = p - token->start;
+    lexer->current += token->len;
+
+    if (whole && !truncated && mantissa <= INT64_MAX) {
+        token->is_int = true;
+        token->integer = (int64_t)mantissa;
+    }
+    else if (!truncated && mantissa <= EXACT_MANTISSA && exponent >= -EXACT_POW10 && exponent <= EXACT_POW10) {
+        Number num = (Number)mantissa;
+        token->num = exponent < 0 ? num / exact_pow10[-exponent] : num * exact_pow10[exponent];
     }
     else {
-        log_info(&lexer->logging, "Error: Unexpected Token");
-        lexer->error = true;
+        // The token ends where the C parser stops, the text after it is
+        // never part of a number.
+        token->num = NUM_PARSE(token->start, NULL);
     }
 }
 
-static void this_or_that(Lexer *lexer, Token *token, char expected, TokenType first_type, TokenType second_type)
+static const char end_text[] = "END";
+
+// Tokens are written straight into their slot, building one on the stack and
+// copying it costs a store forwarding stall per token.
+static void scan_token(Lexer *lexer, Token *token)
 {
-    if (peek(lexer) == expected) {
-        consume(lexer);
+    lexer->current = skip_space(&lexer->text[lexer->current]) - lexer->text;
+
+    char c = peek(lexer);
+    *token = (Token){.start = &lexer->text[lexer->current]};
+
+    if (is_digit(c)) {
+        scan_number(lexer, token);
+        return;
+    }
+    if (CHAR_IS(c, CHAR_ALPHA)) {
+        scan_identifier(lexer, token);
+        return;
+    }
+    if (c == '\'' || c == '"') {
+        parse_string_literal(lexer, token);
+        return;
+    }
+
+    if (c == '\0') {
+        token->type = TOKEN_END;
+        token->start = end_text;
+        token->len = 3;
+        return;
+    }
+
+    Operator op = operators[(uint8_t)c];
+    if (op.next && token->start[1] == op.next) {
+        token->type = op.pair;
         token->len = 2;
-        token->type = second_type;
     }
-    else {
+    else if (op.single) {
+        token->type = op.single;
         token->len = 1;
-        token->type = first_type;
     }
+    else if (op.next) {
+        lexer_error(lexer, "Error: Unexpected Token");
+        token->len = 1;
+    }
+    else {
+        token->type = TOKEN_ERROR;
+        token->len = strlen(token->start);
+    }
+    lexer->current += token->len;
 }
 
-static Token parse_string_literal(Lexer *lexer)
+static void token_buffer_push(TokenBuffer *buffer, const Token *token)
 {
-    const char quote = consume(lexer);
+    if (buffer->count == buffer->capacity) {
+        buffer->capacity = buffer->capacity ? buffer->capacity * 2 : DEFAULT_LIST_CAP;
+        buffer->types = realloc(buffer->types, buffer->capacity * sizeof(*buffer->types));
+        buffer->offsets = realloc(buffer->offsets, buffer->capacity * sizeof(*buffer->offsets));
+        buffer->lens = realloc(buffer->lens, buffer->capacity * sizeof(*buffer->lens));
+    }
+
+    size_t i = buffer->count++;
+    buffer->types[i] = token->type | (token->is_int ? TOKEN_INT_BIT : 0);
+    // END points at static text, it's rebuilt when replayed.
+    buffer->offsets[i] = token->type == TOKEN_END ? 0 : (uint32_t)(token->start - buffer->text);
+    buffer->lens[i] = (uint32_t)token->len;
+
+    if (!token_has_payload(token->type)) return;
+
+    if (buffer->payload_count == buffer->payload_capacity) {
+        buffer->payload_capacity = buffer->payload_capacity ? buffer->payload_capacity * 2 : DEFAULT_LIST_CAP;
+        buffer->payloads = realloc(buffer->payloads, buffer->payload_capacity * sizeof(*buffer->payloads));
+    }
+
+    TokenPayload *payload = &buffer->payloads[buffer->payload_count++];
+    if (token->type != TOKEN_NUM) {
+        payload->name.hash = token->hash;
+        payload->name.builtin = token->builtin;
+    }
+    else if (token->is_int) payload->integer = token->integer;
+    else payload->num = token->num;
+}
 
-    Token token;
+// Offsets are 32 bits, a text too long for them fails. It can still be
+// streamed.
+bool tokenize(const char *text, TokenBuffer *output, LoggingInfo *logging)
+{
+    if (text == NULL || text[0] == '\0') return false;
 
-    token.start = &lexer->text[lexer->current];
+    Lexer lexer = lexer_new(text, logging);
+    output->text = text;
 
-    while (peek(lexer) != '\0' && peek(lexer) != quote) {
-        if (peek(lexer) == '\\') {
-            consume(lexer);
+    for (;;) {
+        Token token;
+        scan_token(&lexer, &token);
+        if (lexer.error) {
+            lexer_report(&lexer);
+            return false;
         }
-        consume(lexer); 
+        if (lexer.current > UINT32_MAX) return false;
+        token_buffer_push(output, &token);
+        if (token.type == TOKEN_END || token.type == TOKEN_ERROR) return true;
     }
+}
+
+void token_buffer_clear(TokenBuffer *buffer)
+{
+    buffer->count = 0;
+    buffer->payload_count = 0;
+}
+
+void token_buffer_free(TokenBuffer *buffer)
+{
+    free(buffer->types);
+    free(buffer->offsets);
+    free(buffer->lens);
+    free(buffer->payloads);
+    *buffer = (TokenBuffer){0};
+}
+
+// Token i of the list, its payload is the next one.
+static void token_buffer_read(TokenBuffer *list, size_t i, size_t *payload, Token *token)
+{
+    TokenType type = token_type(list->types[i]);
+    *token = (Token){
+        .type = type,
+        .is_int = list->types[i] & TOKEN_INT_BIT,
+        .start = list->text + list->offsets[i],
+        .len = (int)list->lens[i],
+    };
 
-    token.len = &lexer->text[lexer->current] - token.start;
-    token.type = TOKEN_STRING;
+    if (type == TOKEN_END) token->start = end_text;
+    if (!token_has_payload(type)) return;
 
-    if (consume(lexer) != quote) {
-        log_info(&lexer->logging, "Error: Mismatching quotes.");
-        lexer->error = true;
+    TokenPayload *p = &list->payloads[(*payload)++];
+    if (type != TOKEN_NUM) {
+        token->hash = p->name.hash;
+        token->builtin = p->name.builtin;
     }
-    
-    return token;
+    else if (token->is_int) token->integer = p->integer;
+    else token->num = p->num;
 }
 
-static Token scan_token(Lexer *lexer)
+TokenStream token_stream_new(const char *text, LoggingInfo *logging)
 {
-    trim_left(lexer);
+    TokenStream stream = {0};
+    stream.lexer = lexer_new(text ? text : "", logging);
+    // Empty input fails as it does for tokenize.
+    stream.lexer.error = text == NULL || text[0] == '\0';
 
-    char c = peek(lexer);
-    Token token;
+    return stream;
+}
 
-    if (is_digit(c)) {
-        token.type = TOKEN_NUM;
-        token.start = &lexer->text[lexer->current];
-        while (is_digit(peek(lexer))) {
-            consume(lexer);
-        }
-        if (peek(lexer) == '.') {
-            consume(lexer);
-            while (is_digit(peek(lexer))) {
-                consume(lexer);
-            }
+// Input read a chunk at a time into a window. Only the ring's tokens and
+// the one being scanned are kept, so memory is bounded by the longest token
+// rather than the input.
+#define LEXER_CHUNK 4096
+
+// Bytes past the end of a token the lexer may look at to end it, "1e+5"
+// looks two past the 'e'.
+#define LEXER_LOOKAHEAD 3
+
+TokenStream token_stream_source(LexerSource source, LoggingInfo *logging)
+{
+    TokenStream stream = {0};
+    stream.lexer = lexer_new("", logging);
+    stream.lexer.source = source;
+    stream.lexer.cap = LEXER_CHUNK + 1;
+    stream.lexer.window = malloc(stream.lexer.cap);
+    stream.lexer.window[0] = '\0';
+    stream.lexer.text = stream.lexer.window;
+
+    return stream;
+}
+
+TokenStream token_stream_list(TokenBuffer *list)
+{
+    return (TokenStream){.list = list};
+}
+
+void token_stream_free(TokenStream *stream)
+{
+    free(stream->lexer.window);
+    stream->lexer.window = NULL;
+}
+
+// Drops the window's bytes before keep and reads more after the rest. At
+// least as much is read as is kept, so a token that keeps running past the
+// window is rescanned a logarithmic number of times.
+static void lexer_refill(Lexer *lexer, size_t keep)
+{
+    lexer->len -= keep;
+    lexer->current -= keep;
+    memmove(lexer->window, lexer->window + keep, lexer->len);
+
+    size_t want = lexer->len > LEXER_CHUNK ? lexer->len : LEXER_CHUNK;
+    if (lexer->cap - lexer->len - 1 < want) {
+        lexer->cap = lexer->len + want + 1;
+        lexer->window = realloc(lexer->window, lexer->cap);
+    }
+
+    size_t read = lexer->source.read(lexer->source.context, lexer->window + lexer->len, lexer->cap - lexer->len - 1);
+    lexer->done = read == 0;
+    lexer->len += read;
+    lexer->window[lexer->len] = '\0';
+    lexer->text = lexer->window;
+}
+
+// Refills the window keeping the ring's tokens, which are moved with it.
+static void stream_refill(TokenStream *stream, size_t keep)
+{
+    Lexer *lexer = &stream->lexer;
+    uintptr_t window = (uintptr_t)lexer->text;
+    size_t first = stream->count > TOKEN_RING - 1 ? stream->count - (TOKEN_RING - 1) : 0;
+    size_t offsets[TOKEN_RING];
+
+    for (size_t i = first; i < stream->count; i++) {
+        uintptr_t start = (uintptr_t)stream->ring[i % TOKEN_RING].start;
+        // END and failed tokens point at static text.
+        offsets[i % TOKEN_RING] = start >= window && start <= window + lexer->len ? start - window : SIZE_MAX;
+        if (offsets[i % TOKEN_RING] < keep) keep = offsets[i % TOKEN_RING];
+    }
+
+    lexer_refill(lexer, keep);
+
+    for (size_t i = first; i < stream->count; i++) {
+        if (offsets[i % TOKEN_RING] == SIZE_MAX) continue;
+        stream->ring[i % TOKEN_RING].start = lexer->text + offsets[i % TOKEN_RING] - keep;
+    }
+}
+
+// A token is only final once the bytes the lexer may look at past it are
+// input, or the input has ended. Otherwise more is read and it's scanned
+// again. An unknown character is an error whatever follows it.
+static void scan_chunked(TokenStream *stream, Token *token)
+{
+    Lexer *lexer = &stream->lexer;
+
+    for (;;) {
+        lexer->current = skip_space(&lexer->text[lexer->current]) - lexer->text;
+        size_t begin = lexer->current;
+        if (lexer->done || begin + LEXER_LOOKAHEAD <= lexer->len) {
+            scan_token(lexer, token);
+            if (lexer->done || token->type == TOKEN_ERROR || lexer->current + LEXER_LOOKAHEAD <= lexer->len) return;
+
+            lexer->current = begin;
+            lexer->error = false;
+            lexer->message = NULL;
         }
-        token.len = &lexer->text[lexer->current] - token.start;
+        stream_refill(stream, begin);
     }
-    else if (c == '\0') {
-        token.type = TOKEN_END;
-        token.start = "END";
-        token.len = 3;
+}
+
+// Produces the token after the last one, straight into its ring slot.
+void token_stream_fill(TokenStream *stream)
+{
+    Token *token = &stream->ring[stream->count % TOKEN_RING];
+
+    if (stream->list) {
+        size_t last = stream->list->count - 1;
+        token_buffer_read(stream->list, stream->count < last ? stream->count : last, &stream->payload, token);
+    }
+    else if (stream->lexer.error) {
+        *token = (Token){.type = TOKEN_ERROR, .start = "", .len = 0};
     }
     else {
-        switch (c) {
-            case '\'':
-            case '"':
-                token = parse_string_literal(lexer);
-                break;
-            case '+':
-                token.type = TOKEN_PLUS;
-                token.start = &lexer->text[lexer->current];
-                token.len = 1;
-                consume(lexer);
-                break;
-            case '-':
-                token.type = TOKEN_MINUS;
-                token.start = &lexer->text[lexer->current];
-                token.len = 1;
-                consume(lexer);
-                break;
-            case '*':
-                token.type = TOKEN_STAR;
-                token.start = &lexer->text[lexer->current];
-                token.len = 1;
-                consume(lexer);
-                break;
-            case '/':
-                token.type = TOKEN_SLASH;
-                token.start = &lexer->text[lexer->current];
-                token.len = 1;
-                consume(lexer);
-                break;
-            case '^':
-                token.type = TOKEN_CARET;
-                token.start = &lexer->text[lexer->current];
-                token.len = 1;
-                consume(lexer);
-                break;
-            case '(':
-                token.type = TOKEN_LEFT_PAREN;
-                token.start = &lexer->text[lexer->current];
-                token.len = 1;
-                consume(lexer);
-                break;
-            case ')':
-                token.type = TOKEN_RIGHT_PAREN;
-                token.start = &lexer->text[lexer->current];
-                token.len = 1;
-                consume(lexer);
-                break;
-            case ',':
-                token.type = TOKEN_COMMA;
-                token.start = &lexer->text[lexer->current];
-                token.len = 1;
-                consume(lexer);
-                break;
-            case '$':
-                token.type = TOKEN_DOLLAR;
-                token.start = &lexer->text[lexer->current];
-                token.len = 1;
-                consume(lexer);
-                break;
-            case '=':
-                token.start = &lexer->text[lexer->current];
-                consume(lexer);
-                this_or_that(lexer, &token, '=', TOKEN_EQUAL, TOKEN_EQEQ);  
-                break;
-            case '&':
-                token.start = &lexer->text[lexer->current];
-                consume(lexer);
-                match(lexer, &token, '&', TOKEN_AND);
-                break;
-            case '|':
-                token.start = &lexer->text[lexer->current];
-                consume(lexer);
-                match(lexer, &token, '|', TOKEN_OR);
-                break;
-            case '!':
-                token.start = &lexer->text[lexer->current];
-                consume(lexer);
-                this_or_that(lexer, &token, '=', TOKEN_NOT, TOKEN_NOTEQ);
-                break;
-            case '<':
-                token.start = &lexer->text[lexer->current];
-                consume(lexer);
-                this_or_that(lexer, &token, '=', TOKEN_LESS, TOKEN_LESSEQ);
-                break;
-            case '>':
-                token.start = &lexer->text[lexer->current];
-                consume(lexer);
-                this_or_that(lexer, &token, '=', TOKEN_GREATER, TOKEN_GREATEREQ);
-                break;
-            case 'a':
-                token = match_identifier(lexer, "ans", 3, TOKEN_ANS);
-                break;
-            case 'e':
-                token = match_identifier(lexer, "exit", 4, TOKEN_EXIT);
-                break;
-            case 'l':
-                token = match_identifier(lexer, "let", 3, TOKEN_LET);
-                break;
-            case 't':
-                token = match_identifier(lexer, "true", 4, TOKEN_TRUE);
-                break;
-            case 'f':
-                token = match_identifier(lexer, "false", 5, TOKEN_FALSE);
-                break;
-            default:
-                if (is_alpha(c)) {
-                    token = match_identifier(lexer, "", 0, TOKEN_IDENTIFIER);
-                }
-                else {
-                    token.type = TOKEN_ERROR;
-                    token.start = &lexer->text[lexer->current];
-                    token.len = strlen(token.start);
-                }
-                break;
+        if (stream->lexer.source.read) scan_chunked(stream, token);
+        else scan_token(&stream->lexer, token);
+        if (stream->lexer.error) {
+            lexer_report(&stream->lexer);
+            token->type = TOKEN_ERROR;
         }
     }
 
-    return token;
+    stream->ended = token->type == TOKEN_END || token->type == TOKEN_ERROR;
+    stream->count++;
 }
 
-bool tokenize(const char *text, TokenList *output)
+// Lexes whatever the parser didn't look at, so an error after the end of
+// the expression still fails the input. Lexing stops at an error, the rest
+// of a chunked input is read and dropped so it isn't taken for the next
+// input, like the rest of a REPL line.
+void token_stream_drain(TokenStream *stream)
 {
-    if (text == NULL || strlen(text) <= 0) return false;
+    while (!stream->ended) {
+        stream->current = stream->count;
+        token_stream_fill(stream);
+    }
 
-    Lexer lexer = lexer_new(text); 
-    Token token = scan_token(&lexer);
+    Lexer *lexer = &stream->lexer;
+    while (lexer->source.read && !lexer->done) {
+        lexer_refill(lexer, lexer->len);
+    }
+}
 
-    while (token.type != TOKEN_END && token.type != TOKEN_ERROR) {
-        if (lexer.error) return false;
-        list_push(output, token);
-        token = scan_token(&lexer);
+static size_t read_fd(void *context, char *buffer, size_t cap)
+{
+    int fd = (int)(intptr_t)context;
+    for (;;) {
+        ssize_t count = read(fd, buffer, cap);
+        if (count >= 0) return (size_t)count;
+        if (errno != EINTR) return 0;
     }
+}
 
-    list_push(output, token);
+static size_t read_file(void *context, char *buffer, size_t cap)
+{
+    return fread(buffer, 1, cap, context);
+}
 
-    if (lexer.logging.file && lexer.logging.path) {
-        if (fclose(lexer.logging.file) != 0) {
-            fprintf(stderr, "Failed to close '%s'\n", lexer.logging.path);
-        }
+// fgets stops after the newline, at most cap bytes and the NUL are written,
+// the window always has room for the NUL.
+static size_t read_line(void *context, char *buffer, size_t cap)
+{
+    LineReader *reader = context;
+    if (reader->line_done) return 0;
+    if (cap > INT_MAX - 1) cap = INT_MAX - 1;
+    if (!fgets(buffer, (int)cap + 1, reader->file)) {
+        reader->line_done = true;
+        return 0;
     }
 
-    return !lexer.error;
+    size_t len = strlen(buffer);
+    reader->line_done = len > 0 && buffer[len - 1] == '\n';
+
+    return len;
+}
+
+LexerSource lexer_source_fd(int fd)
+{
+    return (LexerSource){.read = read_fd, .context = (void*)(intptr_t)fd};
+}
+
+LexerSource lexer_source_file(FILE *file)
+{
+    return (LexerSource){.read = read_file, .context = file};
+}
+
+LexerSource lexer_source_line(LineReader *reader)
+{
+    return (LexerSource){.read = read_line, .context = reader};
 }
 
-void print_tokenlist(TokenList *list)
+void print_tokens(TokenBuffer *buffer)
 {
     static const char* token_names[TOKEN_COUNT] = {
         "NUM", 
@@ -340,8 +824,10 @@ void print_tokenlist(TokenList *list)
         "ERROR",
     };
 
-    for (size_t i = 0; i < list->count; i++) {
-        Token token = list->items[i];
+    size_t payload = 0;
+    for (size_t i = 0; i < buffer->count; i++) {
+        Token token;
+        token_buffer_read(buffer, i, &payload, &token);
         printf("{\n");
         printf("  type: %s\n", token_names[token.type]);
         printf("  text: %.*s\n", token.len, token.start);
@@ -1,7 +1,10 @@
 #pragma once
 
 #include "list.h"
+#include "value.h"
 #include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
 #include "log.h"
 
 typedef enum {
@@ -38,22 +41,206 @@ typedef enum {
     TOKEN_COUNT,
 } TokenType;
 
+// The reserved names, the one table the lexer's keyword hash, MathFunc and
+// the function names are generated from. Keywords get their own token type.
+// Builtins stay identifiers, which are still variable names after '$' or
+// 'let', tagged with their id.
+#define KEYWORDS(X)         \
+    X(ANS,    "ans")        \
+    X(EXIT,   "exit")       \
+    X(LET,    "let")        \
+    X(TRUE,   "true")       \
+    X(FALSE,  "false")
+
+// X(name, text, arity)
+#define MATH_FUNCS(X)       \
+    X(SIN,    "sin",    1)  \
+    X(COS,    "cos",    1)  \
+    X(TAN,    "tan",    1)  \
+    X(ASIN,   "asin",   1)  \
+    X(ACOS,   "acos",   1)  \
+    X(ATAN,   "atan",   1)  \
+    X(ATAN2,  "atan2",  2)  \
+    X(SINH,   "sinh",   1)  \
+    X(COSH,   "cosh",   1)  \
+    X(TANH,   "tanh",   1)  \
+    X(ASINH,  "asinh",  1)  \
+    X(ACOSH,  "acosh",  1)  \
+    X(ATANH,  "atanh",  1)  \
+    X(EXP,    "exp",    1)  \
+    X(LOG,    "log",    1)  \
+    X(LOG10,  "log10",  1)  \
+    X(LOG2,   "log2",   1)  \
+    X(CEIL,   "ceil",   1)  \
+    X(FLOOR,  "floor",  1)  \
+    X(ROUND,  "round",  1)  \
+    X(SQRT,   "sqrt",   1)  \
+    X(PI,     "pi",     0)  \
+    X(EULER,  "e",      0)
+
+// Builtins with their own parse rules.
+#define SPECIAL_FUNCS(X)    \
+    X(EXPORT, "export")     \
+    X(IMPORT, "import")     \
+    X(DROP,   "drop")
+
+typedef enum {
+    BUILTIN_NONE = 0,
+#define X(name, ...) BUILTIN_##name,
+    MATH_FUNCS(X)
+    SPECIAL_FUNCS(X)
+#undef X
+    BUILTIN_COUNT,
+} Builtin;
+
 typedef struct {
     TokenType type;
+    bool is_int;        // A number held in integer
+    uint8_t builtin;    // Builtin of an identifier, BUILTIN_NONE if it isn't one
     const char *start;
     int len;
+    union {
+        uint32_t hash;  // Hash of the name, identifiers only
+        Number num;     // Numbers are parsed by the lexer
+        int64_t integer;
+    };
 } Token;
 
+// Reads up to cap bytes of input into buffer, returns how many were read, 0
+// once the input has ended.
+typedef size_t (*LexerRead)(void *context, char *buffer, size_t cap);
+
+typedef struct {
+    LexerRead read;
+    void *context;
+} LexerSource;
+
+// Reads one line of a FILE*, the newline ends the input. Clear line_done to
+// read the next one.
+typedef struct {
+    FILE *file;
+    bool line_done;
+} LineReader;
+
 typedef struct {
     const char *text;
-    int current;
+    size_t current;
     bool error;
-    LoggingInfo logging;
+    const char *message;  // Logged once the token it belongs to is final
+    LoggingInfo *logging; // Provided by the caller, may be NULL
+    // Chunked input. text is then a window over it holding the live tokens
+    // and whatever has been read past them.
+    LexerSource source;
+    char *window;
+    size_t len;
+    size_t cap;
+    bool done;          // The source has ended
 } Lexer;
 
-LIST_DEF(TokenList, Token);
+// Numbers and identifiers as the lexer decoded them, keywords keep their
+// name's hash too.
+typedef union {
+    Number num;
+    int64_t integer;
+    struct {
+        uint32_t hash;
+        uint8_t builtin;
+    } name;
+} TokenPayload;
+
+// The tokens of whole inputs, one array per field so a pass over the types
+// doesn't pull in the rest. Payloads are only stored for the tokens that
+// have one, in token order, and are read back as the tokens are replayed.
+// Offsets are from the text of the tokenize call that added the token.
+// Cleared rather than freed between inputs, the arrays never shrink.
+#define TOKEN_INT_BIT 0x80  // Set in the type of a number held in integer
+
+typedef struct {
+    const char *text;       // Of the last tokenize call
+    uint8_t *types;
+    uint32_t *offsets;
+    uint32_t *lens;
+    TokenPayload *payloads;
+    size_t count;
+    size_t capacity;
+    size_t payload_count;
+    size_t payload_capacity;
+} TokenBuffer;
+
+static inline TokenType token_type(uint8_t type)
+{
+    return (TokenType)(type & ~TOKEN_INT_BIT);
+}
+
+static inline bool token_has_payload(TokenType type)
+{
+    switch (type) {
+        case TOKEN_NUM:
+        case TOKEN_IDENTIFIER:
+#define X(name, ...) case TOKEN_##name:
+        KEYWORDS(X)
+#undef X
+            return true;
+        default:
+            return false;
+    }
+}
+
+// Tokens pulled one at a time as the parser asks for them, no list of the
+// whole input is built. The ring holds the previous token, the next one and
+// room to look further ahead.
+#define TOKEN_RING 4
+
+typedef struct {
+    Lexer lexer;
+    TokenBuffer *list;  // Replayed instead of lexing text when set
+    size_t payload;     // The list's next payload
+    Token ring[TOKEN_RING];
+    size_t current;     // Index of the next token
+    size_t count;       // Tokens produced so far
+    bool ended;         // The last token produced was END or ERROR
+} TokenStream;
+
+Lexer lexer_new(const char *text, LoggingInfo *logging);
+bool tokenize(const char *text, TokenBuffer *output, LoggingInfo *logging);
+void token_buffer_clear(TokenBuffer *buffer);
+void token_buffer_free(TokenBuffer *buffer);
+void print_tokens(TokenBuffer *buffer);
+LexerSource lexer_source_fd(int fd);
+LexerSource lexer_source_file(FILE *file);
+LexerSource lexer_source_line(LineReader *reader);
+TokenStream token_stream_new(const char *text, LoggingInfo *logging);
+TokenStream token_stream_source(LexerSource source, LoggingInfo *logging);
+TokenStream token_stream_list(TokenBuffer *list);
+void token_stream_free(TokenStream *stream);
+void token_stream_fill(TokenStream *stream);
+void token_stream_drain(TokenStream *stream);
+
+// A lexer error anywhere in the input fails it, the token where it happened
+// is turned into TOKEN_ERROR.
+static inline bool token_stream_failed(TokenStream *stream)
+{
+    return stream->lexer.error;
+}
+
+static inline Token* token_stream_peek(TokenStream *stream)
+{
+    if (stream->current == stream->count) token_stream_fill(stream);
+
+    return &stream->ring[stream->current % TOKEN_RING];
+}
+
+// END or ERROR is returned again and again, never stepped past.
+static inline Token token_stream_next(TokenStream *stream)
+{
+    Token *token = token_stream_peek(stream);
+    if (!stream->ended || stream->current + 1 < stream->count) stream->current++;
+
+    return *token;
+}
 
-Lexer lexer_new(const char *text);
-bool tokenize(const char *text, TokenList *output);
-void print_tokenlist(TokenList *list);
+static inline Token token_stream_prev(TokenStream *stream)
+{
+    return stream->ring[(stream->current - 1) % TOKEN_RING];
+}
 
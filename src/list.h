@@ -46,6 +46,16 @@
     (list)->capacity = 0;                                                   \
   } while (0)
 
+#define list_reserve(list, min_capacity)                                                  \
+  do {                                                                                   \
+    if ((min_capacity) > (list)->capacity) {                                             \
+      size_t new_capacity = (list)->capacity == 0 ? DEFAULT_LIST_CAP : (list)->capacity; \
+      while (new_capacity < (min_capacity)) new_capacity *= 2;                           \
+      (list)->items = realloc((list)->items, new_capacity * sizeof(*(list)->items));     \
+      (list)->capacity = new_capacity;                                                   \
+    }                                                                                    \
+  } while (0)
+
 #define list_push(list, item)                                                            \
   do {                                                                                   \
     if ((list)->count >= (list)->capacity) {                                             \
@@ -56,17 +66,14 @@
     (list)->count += 1;                                                                  \
   } while (0)
 
-static inline void* LIST_GET_POPPED(void* *list_items, size_t type_size, size_t *list_count, size_t *list_cap) 
+// The capacity is kept, a list that's popped and pushed again doesn't go
+// back to the allocator. list_free releases it.
+static inline void* LIST_GET_POPPED(void* *list_items, size_t type_size, size_t *list_count) 
 {
     void *popped = NULL; 
 
     if (*list_count == 0) return popped;
 
-    if (*list_count < (*list_cap) / 3) {
-        *list_cap /= 2;
-        *list_items = realloc(*list_items, (*list_cap) * type_size);
-    }
-
     *list_count -= 1;
 
     popped = (uint8_t*)(*list_items) + ((*list_count) * type_size);
@@ -74,7 +81,7 @@ static inline void* LIST_GET_POPPED(void* *list_items, size_t type_size, size_t
     return popped;
 }
 
-#define list_pop(list) (*(typeof(*(list)->items)*)LIST_GET_POPPED((void*)(&(list)->items), sizeof(*(list)->items), &(list)->count, &(list)->capacity))
+#define list_pop(list) (*(typeof(*(list)->items)*)LIST_GET_POPPED((void*)(&(list)->items), sizeof(*(list)->items), &(list)->count))
 
 #define list_copy(dest, src, start, count)                                   \
   do {                                                                       \
@@ -1,21 +1,27 @@
 #include <stdio.h>
 #include <stdbool.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 #include <time.h>
 #include "list.h"
 #include "lexer.h"
 #include "log.h"
 #include "parser.h"
+#include "expr.h"
 #include "value.h"
 #include "test.h"
+#include "vm.h"
+#include "bench.h"
+#include "pool.h"
+#include "script.h"
 
 void print_value(Value value)
 {
     printf(">> ");
-    switch (value.type) {
+    switch (VALUE_TYPE(value)) {
         case VALUE_NUM:
-            printf("%0.25Lf\n", AS_NUM(value));
+            printf("%0.25Lf\n", AS_LONG_DOUBLE(value));
             break;
         case VALUE_STR:
             printf("%.*s\n", (int)AS_STR(value).len, AS_STR(value).data);
@@ -28,9 +34,9 @@ void print_value(Value value)
 
 void log_value(LoggingInfo *li, Value value)
 {
-    switch (value.type) {
+    switch (VALUE_TYPE(value)) {
         case VALUE_NUM:
-            log_info(li, ">> %0.25Lf", AS_NUM(value));
+            log_info(li, ">> %0.25Lf", AS_LONG_DOUBLE(value));
             break;
         case VALUE_STR:
             log_info(li, ">> %.*s", (int)AS_STR(value).len, AS_STR(value).data);
@@ -41,26 +47,45 @@ void log_value(LoggingInfo *li, Value value)
     }
 }
 
-Value get_result(Parser *parser, TokenList *tl, char *buffer)
+typedef struct {
+    bool disassemble;
+    bool show_folded;
+    const char *file_path;
+    const char *parallel_path;
+    const char *script_path;
+    int threads;
+} Options;
+
+// Static storage: under VALUE_NANBOX a Value holds a pointer to its String,
+// so these must outlive every result.
+#define ERROR_STRING(text) {.data = text, .len = sizeof(text) - 1}
+static String parse_failed = ERROR_STRING("ERROR: Parsing Failed!");
+static String tokenize_failed = ERROR_STRING("ERROR: Tokenization Failed!");
+
+// The parser pulls tokens from the lexer as it goes, no token list is built.
+Value get_result(Parser *parser, Expr *expr, Chunk *chunk, Options *options, TokenStream *tokens)
 {
-    list_clear(tl);
-    if (tokenize(buffer, tl)) {
-        // print_tokenlist(&tl);
-        parser_reset(parser, tl);
-        Value result = parse_expr(parser);
-        if (parser->error) {
-            const char *err = "ERROR: Parsing Failed!";
-            String s = string_create(err, strlen(err));
-            return VAL_STR(s);
+    bool compiled = parser_compile_stream(parser, tokens, expr);
+    if (token_stream_failed(tokens)) {
+        return VAL_STR(&tokenize_failed);
+    }
+
+    Value result = VAL_NUM(0.0);
+    if (compiled) {
+        if (options->show_folded) expr_print(expr, stdout);
+        if (chunk_compile(expr, chunk)) {
+            if (options->disassemble) chunk_disassemble(chunk, stdout);
+            result = vm_run(parser, chunk);
         }
         else {
-            return result;
+            result = parser_eval(parser, expr);
         }
     }
+    if (parser->error) {
+        return VAL_STR(&parse_failed);
+    }
     else {
-        const char *err = "ERROR: Tokenization Failed!";
-        String s = string_create(err, strlen(err));
-        return VAL_STR(s);
+        return result;
     }
 }
 
@@ -73,15 +98,109 @@ const char* consume_arg(int *argc, char* **argv)
     return arg;
 }
 
+// Evaluates every line of the file on the thread pool and prints the results
+// in file order. Lines are either independent expressions or a script whose
+// lines may depend on each other.
+int run_parallel(const char *path, int threads, bool script)
+{
+    bool from_stdin = strcmp(path, "-") == 0;
+    FILE *f = from_stdin ? stdin : fopen(path, "rb");
+    if (!f) {
+        fprintf(stderr, "Failed to open '%s'\n", path);
+        return 1;
+    }
+
+    list_of(const char*) lines = {0};
+    char *line = NULL;
+    size_t line_cap = 0;
+    while (getline(&line, &line_cap, f) != -1) {
+        list_push(&lines, line);
+        line = NULL;
+        line_cap = 0;
+    }
+    free(line);
+    if (!from_stdin) fclose(f);
+
+    PoolResult *results = malloc(sizeof(PoolResult) * (lines.count ? lines.count : 1));
+    Pool *pool = pool_create(threads);
+    size_t produced = lines.count;
+    if (script) produced = script_run(pool, lines.items, lines.count, results);
+    else pool_eval(pool, lines.items, lines.count, results);
+    pool_destroy(pool);
+
+    for (size_t i = 0; i < produced; i++) {
+        print_value(results[i].value);
+    }
+    for (size_t i = 0; i < lines.count; i++) {
+        free((char*)lines.items[i]);
+    }
+
+    pool_results_free(results, produced);
+    free(results);
+    list_free(&lines);
+
+    return 0;
+}
+
+// Evaluates the whole file as one expression. It's lexed a chunk at a time,
+// however long it is.
+int run_file(Parser *parser, Expr *expr, Chunk *chunk, Options *options)
+{
+    bool from_stdin = strcmp(options->file_path, "-") == 0;
+    FILE *f = from_stdin ? stdin : fopen(options->file_path, "rb");
+    if (!f) {
+        fprintf(stderr, "Failed to open '%s'\n", options->file_path);
+        return 1;
+    }
+
+    TokenStream tokens = token_stream_source(lexer_source_file(f), &parser->logging);
+    Value result = get_result(parser, expr, chunk, options, &tokens);
+    if (!parser->exit) print_value(result);
+    token_stream_free(&tokens);
+    if (!from_stdin) fclose(f);
+
+    return 0;
+}
+
+// The arguments joined by spaces, as one expression.
+char* join_args(const char *arg, int argc, char **argv)
+{
+    size_t len = strlen(arg) + 1;
+    for (int i = 0; i < argc; i++) {
+        len += strlen(argv[i]) + 1;
+    }
+
+    char *text = malloc(len + 1);
+    size_t i = 0;
+    while (arg) {
+        size_t arg_len = strlen(arg);
+        memcpy(&text[i], arg, arg_len);
+        i += arg_len;
+        text[i++] = ' ';
+        arg = consume_arg(&argc, &argv);
+    }
+    text[i] = '\0';
+
+    return text;
+}
+
 int main(int argc, char **argv)
 {
+#ifdef BENCH
+    (void)argc;
+    (void)argv;
+    bench_run();
+    return 0;
+#endif
     const char *program = consume_arg(&argc, &argv);
     (void)program;
-    enum { buffer_len = 1024 };
-    char buffer[buffer_len]; 
-    TokenList list = {0};
+    Options options = {0};
+    Expr expr = expr_new();
+    Chunk chunk = chunk_new();
     Parser parser = parser_create();
 #ifdef TEST
+    enum { buffer_len = 1024 };
+    char buffer[buffer_len]; 
     LoggingInfo logger = log_create("tests.txt", NULL, 1);
     srand(time(0));
     for (int i = 0; i < 1000; i++) {
@@ -89,33 +208,125 @@ int main(int argc, char **argv)
         if (len == 0) len = 1;
         get_random_str(buffer, len);
         log_info(&logger, "%s", buffer);
-        Value result = get_result(&parser, &list, buffer);
+        TokenStream tokens = token_stream_new(buffer, &parser.logging);
+        Value result = get_result(&parser, &expr, &chunk, &options, &tokens);
         log_value(&logger, result);
     }
+    if (!stress_test(4, 200)) {
+        fprintf(stderr, "Multi-threaded stress test failed\n");
+        return 1;
+    }
+    if (!optimize_test()) {
+        fprintf(stderr, "Optimizer test failed\n");
+        return 1;
+    }
+    if (!pool_test(4, 20000)) {
+        fprintf(stderr, "Thread pool test failed\n");
+        return 1;
+    }
+    if (!script_test(4, 2000)) {
+        fprintf(stderr, "Script runner test failed\n");
+        return 1;
+    }
+    if (!map_test(200000)) {
+        fprintf(stderr, "Map test failed\n");
+        return 1;
+    }
+    if (!vars_test(20000)) {
+        fprintf(stderr, "Variable table test failed\n");
+        return 1;
+    }
+    if (!number_test(200000)) {
+        fprintf(stderr, "Number test failed\n");
+        return 1;
+    }
+    if (!literal_test(200000)) {
+        fprintf(stderr, "Number literal test failed\n");
+        return 1;
+    }
+    if (!lexer_test(20000)) {
+        fprintf(stderr, "Lexer test failed\n");
+        return 1;
+    }
+    if (!scratch_test(1000)) {
+        fprintf(stderr, "Scratch arena test failed\n");
+        return 1;
+    }
+    if (!batch_test(1000 + 3)) {
+        fprintf(stderr, "Batch evaluation test failed\n");
+        return 1;
+    }
+    if (!intern_test(10000)) {
+        fprintf(stderr, "Intern test failed\n");
+        return 1;
+    }
+    if (!string_test()) {
+        fprintf(stderr, "String literal test failed\n");
+        return 1;
+    }
+    if (!file_test(4 << 20)) {
+        fprintf(stderr, "File expression test failed\n");
+        return 1;
+    }
+    if (!deep_test(300000)) {
+        fprintf(stderr, "Deep expression test failed\n");
+        return 1;
+    }
 #else
     const char *arg = consume_arg(&argc, &argv);
+    while (arg) {
+        if (strcmp(arg, "--disasm") == 0) options.disassemble = true;
+        else if (strcmp(arg, "--folded") == 0) options.show_folded = true;
+        else if (strcmp(arg, "--file") == 0) options.file_path = consume_arg(&argc, &argv);
+        else if (strcmp(arg, "--parallel") == 0) options.parallel_path = consume_arg(&argc, &argv);
+        else if (strcmp(arg, "--script") == 0) options.script_path = consume_arg(&argc, &argv);
+        else if (strcmp(arg, "--threads") == 0) {
+            const char *count = consume_arg(&argc, &argv);
+            options.threads = count ? atoi(count) : 0;
+        }
+        else break;
+        arg = consume_arg(&argc, &argv);
+    }
+    if (options.parallel_path || options.script_path) {
+        int status = options.script_path ? run_parallel(options.script_path, options.threads, true)
+                                         : run_parallel(options.parallel_path, options.threads, false);
+        parser_destroy(&parser);
+        chunk_destroy(&chunk);
+        expr_destroy(&expr);
+        return status;
+    }
+    if (options.file_path) {
+        int status = run_file(&parser, &expr, &chunk, &options);
+        parser_destroy(&parser);
+        chunk_destroy(&chunk);
+        expr_destroy(&expr);
+        return status;
+    }
     if (!arg) {
-        while (true) {
+        // Lines are lexed as they're read, a long one isn't cut into pieces.
+        LineReader reader = {.file = stdin};
+        while (!parser.exit) {
             printf(">> ");
-            fgets(buffer, sizeof(char) * buffer_len, stdin);
-            Value result = get_result(&parser, &list, buffer);
+            int c = getc(stdin);
+            if (c == EOF) break;
+            ungetc(c, stdin);
+            reader.line_done = false;
+            TokenStream tokens = token_stream_source(lexer_source_line(&reader), &parser.logging);
+            Value result = get_result(&parser, &expr, &chunk, &options, &tokens);
+            token_stream_free(&tokens);
+            if (parser.exit) break;
             print_value(result);
         }
     }
     else {
-        size_t i = 0;
-        while (arg) {
-            while (*arg && i < buffer_len - 1) {
-                buffer[i++] = *(arg++);
-            }
-            buffer[i++] = ' ';
-            arg = consume_arg(&argc, &argv);
-        }
-        buffer[i] = '\0';
-        Value result = get_result(&parser, &list, buffer);
-        print_value(result);
+        char *text = join_args(arg, argc, argv);
+        TokenStream tokens = token_stream_new(text, &parser.logging);
+        Value result = get_result(&parser, &expr, &chunk, &options, &tokens);
+        if (!parser.exit) print_value(result);
+        free(text);
     }
 #endif
     parser_destroy(&parser);
-    list_free(&list);
+    chunk_destroy(&chunk);
+    expr_destroy(&expr);
 }
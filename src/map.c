@@ -1,126 +1,278 @@
 #include "map.h"
+#include "hash.h"
 #include <stdlib.h>
 #include <stdint.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
-uint32_t hash(String key)
+static uint32_t key_hash(MAP_KEY key)
 {
-    uint32_t hash = 5381;
-    int c = 1;
+    return hash_bytes(key.data, key.len);
+}
 
-    for (size_t i = 0; i < key.len; i++) {
-        c = key.data[i];
-        hash = ((hash << 5) + hash) + c;
+// Keys usually arrive with the hash the lexer computed, otherwise it's
+// computed here. The high bits pick the group and the low 7 the fingerprint.
+static uint32_t map_hash(Map *map, MAP_KEY key)
+{
+    return key.hash ? key.hash : map->hash(key);
+}
+
+// Bit i is set when control byte i of the group equals byte.
+static uint32_t group_match(const int8_t *group, int8_t byte)
+{
+#ifdef __SSE2__
+    __m128i ctrl = _mm_load_si128((const __m128i*)group);
+
+    return (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(ctrl, _mm_set1_epi8(byte)));
+#else
+    uint32_t mask = 0;
+    for (int i = 0; i < MAP_GROUP; i++) {
+        if (group[i] == byte) mask |= 1u << i;
     }
 
-    return hash;
+    return mask;
+#endif
+}
+
+// Bit i is set when slot i of the group is empty or deleted.
+static uint32_t group_free(const int8_t *group)
+{
+#ifdef __SSE2__
+    return (uint32_t)_mm_movemask_epi8(_mm_load_si128((const __m128i*)group));
+#else
+    uint32_t mask = 0;
+    for (int i = 0; i < MAP_GROUP; i++) {
+        if (group[i] < 0) mask |= 1u << i;
+    }
+
+    return mask;
+#endif
+}
+
+static Map_Table table_new(size_t capacity)
+{
+    Map_Table table;
+    table.capacity = capacity;
+    table.ctrl = aligned_alloc(MAP_GROUP, capacity);
+    memset(table.ctrl, MAP_CTRL_EMPTY, capacity);
+    table.items = (Map_Node*)malloc(sizeof(Map_Node) * capacity);
+
+    return table;
+}
+
+static void table_free(Map_Table *table)
+{
+    free(table->ctrl);
+    free(table->items);
+    *table = (Map_Table){0};
 }
 
 Map map_new()
 {
-    Map map;
-    map.capacity = DEFAULT_MAP_CAP;
-    map.count = 0;
-    map.items = (Map_Node*)calloc(map.capacity, sizeof(Map_Node));
-    map.hash = hash;
+    Map map = {0};
+    map.table = table_new(DEFAULT_MAP_CAP);
+    map.hash = key_hash;
 
     return map;
 }
 
 void map_delete(Map *map)
 {
-    free(map->items);
-    map->items = NULL;
-    map->capacity = 0;
+    table_free(&map->table);
+    table_free(&map->old);
     map->count = 0;
+    map->used = 0;
 
     return;
 }
 
-uint32_t map_get_hash(Map *map, MAP_KEY key)
+// Forgets every key but keeps the current table.
+void map_clear(Map *map)
 {
-    return map->hash(key) % map->capacity;
+    table_free(&map->old);
+    memset(map->table.ctrl, MAP_CTRL_EMPTY, map->table.capacity);
+    map->count = 0;
+    map->used = 0;
 }
 
-uint32_t map_get_i(Map *map, MAP_KEY key)
+// Groups are visited in triangular order, which reaches every group of a
+// power of two table.
+static Map_Node* find(Map_Table *table, MAP_KEY key, uint32_t h, int8_t **ctrl_out)
 {
-    uint32_t hash_value = map_get_hash(map, key);
+    size_t groups = table->capacity / MAP_GROUP;
+    size_t group = (h >> 7) & (groups - 1);
+    int8_t fingerprint = (int8_t)(h & 0x7f);
 
-    for (uint32_t i = 0; i < map->capacity; i++) {
-        uint32_t index = (hash_value + i) % map->capacity;
+    for (size_t step = 1; step <= groups; step++) {
+        int8_t *ctrl = &table->ctrl[group * MAP_GROUP];
 
-        if (map->items[index].valid && CMP(key, map->items[index].key)) {
-            return index;
+        for (uint32_t match = group_match(ctrl, fingerprint); match; match &= match - 1) {
+            size_t slot = group * MAP_GROUP + __builtin_ctz(match);
+            Map_Node *node = &table->items[slot];
+            if (node->key.hash == h && CMP(key, node->key)) {
+                if (ctrl_out) *ctrl_out = &table->ctrl[slot];
+                return node;
+            }
         }
+        if (group_match(ctrl, MAP_CTRL_EMPTY)) return NULL;
+
+        group = (group + step) & (groups - 1);
     }
 
-    return 0;
+    return NULL;
 }
 
-bool map_set(Map *map, MAP_KEY key, MAP_VALUE value)
+static Map_Node* lookup(Map *map, MAP_KEY key, uint32_t h, int8_t **ctrl_out)
 {
-    uint32_t hash_value = map_get_hash(map, key);
-    
-    for (uint32_t i = 0; i < map->capacity; i++) {
-        uint32_t index = (hash_value + i) % map->capacity;
+    Map_Node *node = find(&map->table, key, h, ctrl_out);
+    if (!node && map->old.ctrl) node = find(&map->old, key, h, ctrl_out);
 
-        if (!map->items[index].valid) {
-            map->items[index].key = key;
-            map->items[index].value = value;
-            map->items[index].valid = true;
-            map->count++;
+    return node;
+}
 
-            return true;
-        }
-        else if (CMP(key, map->items[index].key)) { 
-            map->items[index].value = value;
+// Places a key known not to be in the table in the first empty or deleted
+// slot on its probe sequence.
+static Map_Node* insert(Map *map, MAP_KEY key, MAP_VALUE value, uint32_t h)
+{
+    Map_Table *table = &map->table;
+    size_t groups = table->capacity / MAP_GROUP;
+    size_t group = (h >> 7) & (groups - 1);
 
-            return true;
+    for (size_t step = 1; step <= groups; step++) {
+        uint32_t free_slots = group_free(&table->ctrl[group * MAP_GROUP]);
+        if (free_slots) {
+            size_t slot = group * MAP_GROUP + __builtin_ctz(free_slots);
+            if (table->ctrl[slot] == MAP_CTRL_EMPTY) map->used++;
+            table->ctrl[slot] = (int8_t)(h & 0x7f);
+            key.hash = h;
+            table->items[slot] = (Map_Node){.key = key, .value = value};
+            return &table->items[slot];
         }
+
+        group = (group + step) & (groups - 1);
     }
-    
-    return false;
+
+    return NULL;
 }
 
-MAP_VALUE map_get(Map *map, MAP_KEY key)
+static void migrate(Map *map, size_t slots)
 {
-    uint32_t hash_value = map_get_hash(map, key);
-    
-    for (uint32_t i = 0; i < map->capacity; i++) {
-        uint32_t index = (hash_value + i) % map->capacity;
+    if (!map->old.ctrl) return;
 
-        if (map->items[index].valid && CMP(key, map->items[index].key)) {
-            return map->items[index].value;
+    for (; slots > 0 && map->old_index < map->old.capacity; slots--, map->old_index++) {
+        int8_t *ctrl = &map->old.ctrl[map->old_index];
+        if (*ctrl >= 0) {
+            Map_Node *node = &map->old.items[map->old_index];
+            insert(map, node->key, node->value, map_hash(map, node->key));
+            *ctrl = MAP_CTRL_DELETED;
         }
     }
-    
-    return (MAP_VALUE){0};
+
+    if (map->old_index == map->old.capacity) table_free(&map->old);
+}
+
+// Keeps full and deleted slots under 7/8 of the table. A table mostly
+// holding deleted slots is rebuilt at the same size, otherwise it doubles.
+static void grow(Map *map)
+{
+    if ((map->used + 1) * 8 <= map->table.capacity * 7) return;
+
+    // A previous resize still running is finished first.
+    migrate(map, map->old.capacity);
+
+    size_t capacity = map->table.capacity;
+    if (map->count * 2 >= capacity) capacity *= 2;
+
+    map->old = map->table;
+    map->old_index = 0;
+    map->table = table_new(capacity);
+    map->used = 0;
+}
+
+// Finds the key's entry or adds one holding key and a zero value, with a single
+// hash and probe. A new entry's key can be replaced by an equal owned copy.
+Map_Node* map_entry(Map *map, MAP_KEY key, bool *inserted)
+{
+    migrate(map, MAP_MIGRATE_STEP);
+
+    uint32_t h = map_hash(map, key);
+    Map_Node *node = lookup(map, key, h, NULL);
+    if (inserted) *inserted = node == NULL;
+    if (node) return node;
+
+    grow(map);
+    map->count++;
+
+    return insert(map, key, (MAP_VALUE){0}, h);
+}
+
+bool map_set(Map *map, MAP_KEY key, MAP_VALUE value)
+{
+    map_entry(map, key, NULL)->value = value;
+
+    return true;
+}
+
+MAP_VALUE map_get(Map *map, MAP_KEY key)
+{
+    Map_Node *node = lookup(map, key, map_hash(map, key), NULL);
+
+    return node ? node->value : (MAP_VALUE){0};
+}
+
+// The stored value, NULL if the key isn't there. Valid until the map changes.
+MAP_VALUE* map_get_ptr(Map *map, MAP_KEY key)
+{
+    Map_Node *node = lookup(map, key, map_hash(map, key), NULL);
+
+    return node ? &node->value : NULL;
 }
 
 bool map_has(Map *map, MAP_KEY key)
 {
-    uint32_t hash_value = map_get_hash(map, key);
-    
-    for (uint32_t i = 0; i < map->capacity; i++) {
-        uint32_t index = (hash_value + i) % map->capacity;
+    return lookup(map, key, map_hash(map, key), NULL) != NULL;
+}
 
-        if (map->items[index].valid && CMP(key, map->items[index].key)) {
-            return true;
-        }
+// Marks the slot deleted so probe sequences running through its group stay
+// intact. The stored key and value are copied to removed for the caller to free.
+bool map_remove(Map *map, MAP_KEY key, Map_Node *removed)
+{
+    migrate(map, MAP_MIGRATE_STEP);
+
+    int8_t *ctrl = NULL;
+    Map_Node *node = lookup(map, key, map_hash(map, key), &ctrl);
+    if (!node) return false;
+
+    if (removed) *removed = *node;
+    *ctrl = MAP_CTRL_DELETED;
+    map->count--;
+
+    return true;
+}
+
+// Walks every live entry of both tables, start with *iter = 0.
+Map_Node* map_next(Map *map, size_t *iter)
+{
+    while (*iter < map->table.capacity + map->old.capacity) {
+        size_t i = (*iter)++;
+        Map_Table *table = i < map->table.capacity ? &map->table : &map->old;
+        if (table == &map->old) i -= map->table.capacity;
+        if (table->ctrl[i] >= 0) return &table->items[i];
     }
-    
-    return false;
+
+    return NULL;
 }
 
 MAP_VALUE* map_array(Map *map)
 {
-    if (map->count <= 0 || map->count > map->capacity) return NULL;
+    if (map->count <= 0) return NULL;
 
     MAP_VALUE *array = malloc(sizeof(MAP_VALUE) * map->count);
+    size_t iter = 0, j = 0;
 
-    for (size_t i = 0, j = 0; i < map->capacity && j < map->count; i++) {
-        if (map->items[i].valid) {
-            array[j++] = map->items[i].value;
-        }
+    for (Map_Node *node = map_next(map, &iter); node; node = map_next(map, &iter)) {
+        array[j++] = node->value;
     }
 
     return array;
@@ -7,38 +7,58 @@
 #include <stddef.h>
 #include <stdint.h>
 #include <string.h>
-#include "lexer.h"
 #include "value.h"
 
 #define MAP_KEY String
-#define MAP_VALUE Value
+#define MAP_VALUE size_t   // An index into storage owned by the map's user
 
-#define CMP(key, other) ((key).len != (other).len ? false : memcmp((key).data, (other).data, (key).len) == 0) 
+#define CMP(key, other) ((key).len != (other).len ? false : \
+    (key).data == (other).data || memcmp((key).data, (other).data, (key).len) == 0)
+
+// Control bytes, a full slot holds the low 7 bits of its key's hash.
+#define MAP_CTRL_EMPTY   ((int8_t)-128)
+#define MAP_CTRL_DELETED ((int8_t)-2)   // Removed, probing continues past it
+
+#define MAP_GROUP 16
 
 typedef struct {
     MAP_KEY key;
     MAP_VALUE value;
-    bool valid;
 } Map_Node;
 
+// Slots are probed a group of MAP_GROUP at a time by comparing their control
+// bytes against the key's fingerprint, keys are only compared on a match.
 typedef struct {
+    int8_t *ctrl;
     Map_Node *items;
-    size_t count;
-    size_t capacity;
+    size_t capacity;      // Power of two, at least MAP_GROUP
+} Map_Table;
+
+// When the table passes its load factor a bigger one is allocated and the old
+// entries move over a few slots per map_set/map_remove, lookups check both
+// tables until the move is done.
+typedef struct {
+    Map_Table table;
+    size_t count;         // Live keys in both tables
+    size_t used;          // Full and deleted slots in table
+    Map_Table old;        // Table being moved into table, NULL ctrl when not resizing
+    size_t old_index;     // Next slot of old to move
     uint32_t(*hash)(MAP_KEY);
 } Map;
 
-#define DEFAULT_MAP_CAP 300 
+#define DEFAULT_MAP_CAP 64
+#define MAP_MIGRATE_STEP 16
 
 Map map_new(void);
 void map_delete(Map *map);
+void map_clear(Map *map);
+Map_Node* map_entry(Map *map, MAP_KEY key, bool *inserted);
 bool map_set(Map *map, MAP_KEY key, MAP_VALUE value);
 MAP_VALUE map_get(Map *map, MAP_KEY key);
-uint32_t map_get_hash(Map *map, MAP_KEY key);
-uint32_t map_get_i(Map *map, MAP_KEY key);
+MAP_VALUE* map_get_ptr(Map *map, MAP_KEY key);
 bool map_has(Map *map, MAP_KEY key);
-uint32_t map_get_hash(Map *map, MAP_KEY key);
-uint32_t map_get_i(Map *map, MAP_KEY key);
+bool map_remove(Map *map, MAP_KEY key, Map_Node *removed);
+Map_Node* map_next(Map *map, size_t *iter);
 MAP_VALUE* map_array(Map *map);
 
 #endif // _MAP_H
@@ -0,0 +1,87 @@
+#pragma once
+
+#include "value.h"
+#include <math.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+// Arithmetic on two VALUE_NUM operands. While both are integers the result is
+// computed in int64, and only a result that overflows or isn't whole falls
+// back to Number, so counters and ids never touch the FPU.
+
+#define NUM_BOTH_INT(a, b) (IS_INT(a) && IS_INT(b))
+
+// 2^63, the first value past INT64_MAX, exact as a double.
+#define NUM_INT_LIMIT 9223372036854775808.0
+
+#define NUM_CMP(a, op, b) (NUM_BOTH_INT(a, b) ? AS_INT(a) op AS_INT(b) : AS_NUM(a) op AS_NUM(b))
+
+static inline Value num_add(Value a, Value b)
+{
+    int64_t result;
+    if (NUM_BOTH_INT(a, b) && !__builtin_add_overflow(AS_INT(a), AS_INT(b), &result)) return VAL_INT(result);
+
+    return VAL_NUM(AS_NUM(a) + AS_NUM(b));
+}
+
+static inline Value num_sub(Value a, Value b)
+{
+    int64_t result;
+    if (NUM_BOTH_INT(a, b) && !__builtin_sub_overflow(AS_INT(a), AS_INT(b), &result)) return VAL_INT(result);
+
+    return VAL_NUM(AS_NUM(a) - AS_NUM(b));
+}
+
+static inline Value num_mul(Value a, Value b)
+{
+    int64_t result;
+    if (NUM_BOTH_INT(a, b) && !__builtin_mul_overflow(AS_INT(a), AS_INT(b), &result)) return VAL_INT(result);
+
+    return VAL_NUM(AS_NUM(a) * AS_NUM(b));
+}
+
+// Only exact quotients stay integers. INT64_MIN / -1 overflows.
+static inline Value num_div(Value a, Value b)
+{
+    if (NUM_BOTH_INT(a, b) && AS_INT(b) != 0 && !(AS_INT(b) == -1 && AS_INT(a) == INT64_MIN) &&
+        AS_INT(a) % AS_INT(b) == 0) {
+        return VAL_INT(AS_INT(a) / AS_INT(b));
+    }
+
+    return VAL_NUM(AS_NUM(a) / AS_NUM(b));
+}
+
+// Non-negative integer powers by squaring. Every square is used by a later
+// multiply, so any overflow means the result overflows.
+static inline Value num_pow(Value a, Value b)
+{
+    if (NUM_BOTH_INT(a, b) && AS_INT(b) >= 0) {
+        int64_t base = AS_INT(a);
+        int64_t exp = AS_INT(b);
+        int64_t result = 1;
+        bool overflow = false;
+        while (exp > 0 && !overflow) {
+            if (exp & 1) overflow = __builtin_mul_overflow(result, base, &result);
+            exp >>= 1;
+            if (exp > 0 && !overflow) overflow = __builtin_mul_overflow(base, base, &base);
+        }
+        if (!overflow) return VAL_INT(result);
+    }
+
+    return VAL_NUM(NUM_FN(pow)(AS_NUM(a), AS_NUM(b)));
+}
+
+static inline Value num_neg(Value a)
+{
+    if (IS_INT(a) && AS_INT(a) != INT64_MIN) return VAL_INT(-AS_INT(a));
+
+    return VAL_NUM(AS_NUM(a) * -1);
+}
+
+// A whole number from floor, ceil or round, kept as an integer if it fits.
+static inline Value num_integral(Number num)
+{
+    if (num >= -NUM_INT_LIMIT && num < NUM_INT_LIMIT) return VAL_INT((int64_t)num);
+
+    return VAL_NUM(num);
+}
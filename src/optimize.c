@@ -0,0 +1,307 @@
+#include "optimize.h"
+#include "number.h"
+#include "expr.h"
+#include "parser.h"
+#include "value.h"
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+// The type a node is guaranteed to produce when it evaluates without error.
+typedef enum {
+    TYPE_UNKNOWN,
+    TYPE_NUM,
+    TYPE_STR,
+    TYPE_BOOL,
+} StaticType;
+
+static StaticType value_static_type(Value value)
+{
+    switch (VALUE_TYPE(value)) {
+        case VALUE_NUM:  return TYPE_NUM;
+        case VALUE_STR:  return TYPE_STR;
+        case VALUE_BOOL: return TYPE_BOOL;
+    }
+
+    return TYPE_UNKNOWN;
+}
+
+// What the pass knows about a node once it's in its final form.
+typedef struct {
+    StaticType type;
+    bool pure;      // Evaluating it can neither fail nor have side effects
+} NodeInfo;
+
+// The operand can't fail and is known to have the type its operator checks
+// for, so the operator can't fail on it either.
+static bool operand_fits(NodeInfo *info, NodeId id, StaticType type)
+{
+    return id == NO_NODE || (info[id].pure && info[id].type == type);
+}
+
+// Operators taking operands of either type that must match, like == and +.
+static bool operands_match(NodeInfo *info, Node *node, StaticType a, StaticType b)
+{
+    StaticType type = info[node->left].type;
+
+    return (type == a || type == b) && operand_fits(info, node->left, type) && operand_fits(info, node->right, type);
+}
+
+// Worked out from the operands' info, which the forward pass has already
+// filled in, so long chains like a + b + c + ... stay linear.
+static NodeInfo node_info(NodeInfo *info, Node *node)
+{
+    NodeInfo result = {.type = TYPE_UNKNOWN, .pure = false};
+
+    switch (node->type) {
+        case NODE_VALUE:
+            result.type = value_static_type(node->as.value);
+            result.pure = true;
+            break;
+        case NODE_UNARY:
+            result.type = node->op == TOKEN_NOT ? TYPE_BOOL : TYPE_NUM;
+            result.pure = operand_fits(info, node->left, result.type);
+            break;
+        case NODE_BINARY:
+            switch (node->op) {
+                case TOKEN_PLUS:
+                    result.type = info[node->left].type;
+                    result.pure = operands_match(info, node, TYPE_NUM, TYPE_STR);
+                    break;
+                case TOKEN_MINUS:
+                case TOKEN_STAR:
+                case TOKEN_SLASH:
+                case TOKEN_CARET:
+                    result.type = TYPE_NUM;
+                    result.pure = operands_match(info, node, TYPE_NUM, TYPE_NUM);
+                    break;
+                case TOKEN_EQEQ:
+                case TOKEN_NOTEQ:
+                    result.type = TYPE_BOOL;
+                    result.pure = operands_match(info, node, TYPE_NUM, TYPE_STR) ||
+                                  operands_match(info, node, TYPE_BOOL, TYPE_BOOL);
+                    break;
+                case TOKEN_AND:
+                case TOKEN_OR:
+                    result.type = TYPE_BOOL;
+                    result.pure = operands_match(info, node, TYPE_BOOL, TYPE_BOOL);
+                    break;
+                default:
+                    result.type = TYPE_BOOL;
+                    result.pure = operands_match(info, node, TYPE_NUM, TYPE_NUM);
+                    break;
+            }
+            break;
+        case NODE_CALL:
+            result.type = TYPE_NUM;
+            result.pure = operand_fits(info, node->left, TYPE_NUM) && operand_fits(info, node->right, TYPE_NUM);
+            break;
+        case NODE_LET:
+            result.type = info[node->left].type;
+            break;
+        case NODE_EXPORT:
+        case NODE_DROP:
+            result.type = TYPE_BOOL;
+            break;
+        default:
+            break;
+    }
+
+    return result;
+}
+
+static bool is_constant(Node *node, ValueType type)
+{
+    return node->type == NODE_VALUE && VALUE_TYPE(node->as.value) == type;
+}
+
+static bool is_num(Node *node, Number num)
+{
+    return is_constant(node, VALUE_NUM) && AS_NUM(node->as.value) == num;
+}
+
+static bool is_bool(Node *node, bool bol)
+{
+    return is_constant(node, VALUE_BOOL) && AS_BOOL(node->as.value) == bol;
+}
+
+static void make_constant(Node *node, Value value)
+{
+    node->type = NODE_VALUE;
+    node->left = NO_NODE;
+    node->right = NO_NODE;
+    node->as.value = value;
+}
+
+static bool fold_unary(Node *node, Node *operand)
+{
+    if (node->op == TOKEN_MINUS && is_constant(operand, VALUE_NUM)) {
+        make_constant(node, num_neg(operand->as.value));
+        return true;
+    }
+    if (node->op == TOKEN_NOT && is_constant(operand, VALUE_BOOL)) {
+        make_constant(node, VAL_BOOL(!AS_BOOL(operand->as.value)));
+        return true;
+    }
+
+    return false;
+}
+
+static bool fold_binary(Parser *parser, Node *node, Node *left, Node *right)
+{
+    if (left->type != NODE_VALUE || right->type != NODE_VALUE) return false;
+
+    Value a = left->as.value;
+    Value b = right->as.value;
+
+    if (VALUE_TYPE(a) != VALUE_TYPE(b)) return false;
+
+    switch (VALUE_TYPE(a)) {
+        case VALUE_NUM:
+            if (node->op == TOKEN_AND || node->op == TOKEN_OR) return false;
+            break;
+        case VALUE_BOOL:
+            if (node->op != TOKEN_EQEQ && node->op != TOKEN_NOTEQ &&
+                node->op != TOKEN_AND && node->op != TOKEN_OR) return false;
+            break;
+        case VALUE_STR:
+            if (node->op == TOKEN_PLUS) {
+                size_t len = AS_STR(a).len + AS_STR(b).len;
+                char *data = malloc(sizeof(char) * (len + 1));
+                memcpy(data, AS_STR(a).data, AS_STR(a).len);
+                memcpy(&data[AS_STR(a).len], AS_STR(b).data, AS_STR(b).len);
+                String joined = {.data = data, .len = len};
+                make_constant(node, value_retain(VAL_STR(&joined)));
+                free(data);
+                return true;
+            }
+            if (node->op != TOKEN_EQEQ && node->op != TOKEN_NOTEQ) return false;
+            break;
+    }
+
+    // The operand types are valid for the operator, so this can't fail.
+    make_constant(node, do_operation(parser, a, b, node->op));
+
+    return true;
+}
+
+static bool fold_call(Expr *expr, Node *node)
+{
+    Value args[2] = {VAL_NUM(0.0), VAL_NUM(0.0)};
+    NodeId ids[2] = {node->left, node->right};
+
+    for (int i = 0; i < math_func_arity(node->func); i++) {
+        Node *arg = &expr->nodes.items[ids[i]];
+        if (!is_constant(arg, VALUE_NUM)) return false;
+        args[i] = arg->as.value;
+    }
+
+    make_constant(node, math_call(node->func, args[0], args[1]));
+
+    return true;
+}
+
+// Returns the node a binary node can be replaced with, or NO_NODE.
+static NodeId simplify_binary(Expr *expr, NodeInfo *info, Node *node)
+{
+    Node *left = &expr->nodes.items[node->left];
+    Node *right = &expr->nodes.items[node->right];
+    StaticType left_type = info[node->left].type;
+    StaticType right_type = info[node->right].type;
+
+    switch (node->op) {
+        case TOKEN_PLUS:
+            // Only differs from the unfolded form for x = -0.
+            if (left_type == TYPE_NUM && is_num(right, 0)) return node->left;
+            if (right_type == TYPE_NUM && is_num(left, 0)) return node->right;
+            break;
+        case TOKEN_MINUS:
+            if (left_type == TYPE_NUM && is_num(right, 0)) return node->left;
+            break;
+        case TOKEN_STAR:
+            if (left_type == TYPE_NUM && is_num(right, 1)) return node->left;
+            if (right_type == TYPE_NUM && is_num(left, 1)) return node->right;
+            break;
+        case TOKEN_SLASH:
+        case TOKEN_CARET:
+            if (left_type == TYPE_NUM && is_num(right, 1)) return node->left;
+            break;
+        case TOKEN_AND:
+            if (right_type == TYPE_BOOL && is_bool(left, true)) return node->right;
+            if (left_type == TYPE_BOOL && is_bool(right, true)) return node->left;
+            if (right_type == TYPE_BOOL && is_bool(left, false) && info[node->right].pure) return node->left;
+            if (left_type == TYPE_BOOL && is_bool(right, false) && info[node->left].pure) return node->right;
+            break;
+        case TOKEN_OR:
+            if (right_type == TYPE_BOOL && is_bool(left, false)) return node->right;
+            if (left_type == TYPE_BOOL && is_bool(right, false)) return node->left;
+            if (right_type == TYPE_BOOL && is_bool(left, true) && info[node->right].pure) return node->left;
+            if (left_type == TYPE_BOOL && is_bool(right, true) && info[node->left].pure) return node->right;
+            break;
+        default:
+            break;
+    }
+
+    return NO_NODE;
+}
+
+static NodeId simplify_unary(Expr *expr, NodeInfo *info, Node *node)
+{
+    Node *operand = &expr->nodes.items[node->left];
+
+    // --x and !!x, as long as x already has the type the operators produce.
+    if (operand->type == NODE_UNARY && operand->op == node->op) {
+        StaticType type = info[operand->left].type;
+        if (node->op == TOKEN_MINUS && type == TYPE_NUM) return operand->left;
+        if (node->op == TOKEN_NOT && type == TYPE_BOOL) return operand->left;
+    }
+
+    return NO_NODE;
+}
+
+void expr_optimize(Parser *parser, Expr *expr)
+{
+    if (expr->root == NO_NODE) return;
+
+    // Children are always pushed before their parents, so a single forward
+    // pass sees every operand in its final form. Nodes that get replaced by
+    // one of their operands are recorded in 'alias' and stay in the list
+    // unreferenced, so ownership of their strings doesn't change.
+    size_t count = expr->nodes.count;
+    NodeId *alias = malloc(sizeof(NodeId) * count);
+    NodeInfo *info = malloc(sizeof(NodeInfo) * count);
+
+    for (size_t i = 0; i < count; i++) {
+        Node *node = &expr->nodes.items[i];
+        alias[i] = (NodeId)i;
+
+        if (node->left != NO_NODE) node->left = alias[node->left];
+        if (node->right != NO_NODE) node->right = alias[node->right];
+
+        switch (node->type) {
+            case NODE_UNARY:
+                if (!fold_unary(node, &expr->nodes.items[node->left])) {
+                    NodeId replacement = simplify_unary(expr, info, node);
+                    if (replacement != NO_NODE) alias[i] = replacement;
+                }
+                break;
+            case NODE_BINARY:
+                if (!fold_binary(parser, node, &expr->nodes.items[node->left], &expr->nodes.items[node->right])) {
+                    NodeId replacement = simplify_binary(expr, info, node);
+                    if (replacement != NO_NODE) alias[i] = replacement;
+                }
+                break;
+            case NODE_CALL:
+                fold_call(expr, node);
+                break;
+            default:
+                break;
+        }
+
+        info[i] = alias[i] == (NodeId)i ? node_info(info, node) : info[alias[i]];
+    }
+
+    expr->root = alias[expr->root];
+    free(info);
+    free(alias);
+}
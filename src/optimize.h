@@ -0,0 +1,6 @@
+#pragma once
+
+#include "expr.h"
+#include "parser.h"
+
+void expr_optimize(Parser *parser, Expr *expr);
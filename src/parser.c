@@ -1,29 +1,31 @@
 #include "parser.h"
 #include "arena.h"
+#include "expr.h"
+#include "intern.h"
 #include "lexer.h"
-#include "map.h"
+#include "vars.h"
+#include "optimize.h"
 #include "log.h"
 #include "value.h"
-#include <math.h> 
 #include <stdio.h>
 #include <string.h>
 #include <stdbool.h>
 #include <stdlib.h>
 #include <assert.h>
 
-Value unary(Parser *parser);
-Value binary(Parser *parser);
-Value number(Parser *parser);
-Value grouping(Parser *parser);
-Value ans(Parser *parser);
-Value identifier(Parser *parser);
-Value exit_prog(Parser *parser);
-Value declare(Parser *parser);
-Value get_var(Parser *parser);
-Value string(Parser *parser);
-Value boolean(Parser *parser);
-
-ParseRule rules[TOKEN_COUNT] = {
+NodeId unary(Parser *parser);
+NodeId binary(Parser *parser);
+NodeId number(Parser *parser);
+NodeId grouping(Parser *parser);
+NodeId ans(Parser *parser);
+NodeId identifier(Parser *parser);
+NodeId exit_prog(Parser *parser);
+NodeId declare(Parser *parser);
+NodeId get_var(Parser *parser);
+NodeId string(Parser *parser);
+NodeId boolean(Parser *parser);
+
+static const ParseRule rules[TOKEN_COUNT] = {
     {NULL, NULL, PREC_NONE},            // TOKEN_NONE 
     {number, NULL, PREC_NONE},          // TOKEN_NUM
     {string, NULL, PREC_NONE},          // TOKEN_STRING
@@ -57,13 +59,7 @@ ParseRule rules[TOKEN_COUNT] = {
     // TOKEN_COUNT
 };
 
-Value exit_prog(Parser *parser)
-{
-    (void)(parser);
-    exit(parser->error);
-}
-
-ParseRule* get_rule(Token token)
+const ParseRule* get_rule(Token token)
 {
     return &rules[token.type];
 }
@@ -71,28 +67,38 @@ ParseRule* get_rule(Token token)
 Parser parser_create()
 {
     Parser parser;
-    parser.current = 0;
+    parser.tokens = NULL;
+    parser.expr = NULL;
+    parser.depth = 0;
     parser.error = false;
+    parser.exit = false;
     parser.ans = VAL_NUM(0);
-    parser.map = map_new();
-    parser.arena = arena_init(1024);
+    parser.vars = vars_new();
+    parser.scratch = arena_init(1024);
+    parser.boxes = arena_init(1024);
+    parser.walk = list_new(ExprStack);
+    parser.values = list_new(ValueList);
     parser.logging = log_create("parser_log.txt", NULL, 0);
 
     return parser;
 }
 
-void parser_reset(Parser *parser, TokenList *list)
+void parser_reset(Parser *parser, TokenStream *tokens)
 {
     parser->error = false;
-    parser->current = 0;
-    parser->tokens = list;
+    parser->depth = 0;
+    parser->tokens = tokens;
 }
 
 void parser_destroy(Parser *parser)
 {
-    parser->current = 0;
-    arena_deinit(&parser->arena);
-    map_delete(&parser->map);
+    parser->tokens = NULL;
+    arena_deinit(&parser->scratch);
+    arena_deinit(&parser->boxes);
+    list_free(&parser->walk);
+    list_free(&parser->values);
+    value_release(&parser->ans);
+    vars_delete(&parser->vars);
     if (parser->logging.file && parser->logging.path) {
         if (fclose(parser->logging.file) != 0) {
             fprintf(stderr, "Failed to close '%s'\n", parser->logging.path);
@@ -102,17 +108,18 @@ void parser_destroy(Parser *parser)
 
 Token prev(Parser *parser)
 {
-    return parser->tokens->items[parser->current - 1];
+    return token_stream_prev(parser->tokens);
 }
 
 Token peek(Parser *parser)
 {
-    return parser->tokens->items[parser->current];
+    return *token_stream_peek(parser->tokens);
 }
 
+// Tokens end with TOKEN_END or TOKEN_ERROR, which is never stepped past.
 Token consume(Parser *parser)
 {
-    return parser->tokens->items[parser->current++];
+    return token_stream_next(parser->tokens);
 }
 
 Token expect(Parser *parser, TokenType expected)
@@ -129,549 +136,310 @@ Token expect(Parser *parser, TokenType expected)
     }
 }
 
-Value do_operation(Parser *parser, Value left, Value right, Token oper)
+NodeId push_node(Parser *parser, Node node)
 {
-    if (left.type != right.type) {
-        char buffer1[100];
-        value_to_str(buffer1, &left);
-        char buffer2[100];
-        value_to_str(buffer2, &right);
-
-        log_info(&parser->logging, "Error: Value: %s of type: %s has a different type than Value: %s of type: %s",
-                buffer1, value_type_to_str(left.type), buffer2, value_type_to_str(right.type));
-
-        parser->error = true;
-    }
-
-    Value result;
-
-    #define invalid_op()\
-        do { \
-            log_info(&parser->logging, "Error: Can't perform this operation: %.*s on a value of this type: %s",\
-                    oper.len, oper.start, value_type_to_str(left.type));\
-            parser->error = true;\
-        } while (0)
-
-    switch (oper.type) {
-        case TOKEN_PLUS: 
-            switch (left.type) {
-                case VALUE_BOOL: invalid_op(); break;
-                case VALUE_NUM: result = VAL_NUM(AS_NUM(left) + AS_NUM(right)); break;
-                case VALUE_STR: result = VAL_STR(string_add(&parser->arena, &AS_STR(left), &AS_STR(right))); break;
-            }
-            break;
-        case TOKEN_MINUS: 
-            if (left.type != VALUE_NUM) invalid_op();
-            else result = VAL_NUM(AS_NUM(left) - AS_NUM(right));
-            break;
-        case TOKEN_STAR:  
-            if (left.type != VALUE_NUM) invalid_op();
-            else result = VAL_NUM(AS_NUM(left) * AS_NUM(right));
-            break;
-        case TOKEN_SLASH: 
-            if (left.type != VALUE_NUM) invalid_op();
-            else result = VAL_NUM(AS_NUM(left) / AS_NUM(right));
-            break;
-        case TOKEN_CARET: 
-            if (left.type != VALUE_NUM) invalid_op();
-            else result = VAL_NUM(pow(AS_NUM(left), AS_NUM(right)));
-            break;
-        case TOKEN_EQEQ:
-            switch (left.type) {
-                case VALUE_NUM:  result = VAL_BOOL(AS_NUM(left) == AS_NUM(right)); break;
-                case VALUE_STR:  result = VAL_BOOL(string_compare(&AS_STR(left), &AS_STR(right))); break;
-                case VALUE_BOOL: result = VAL_BOOL(AS_BOOL(left) == AS_BOOL(right)); break;
-            }
-            break;
-        case TOKEN_NOTEQ:
-            switch (left.type) {
-                case VALUE_NUM:  result = VAL_BOOL(AS_NUM(left) != AS_NUM(right)); break;
-                case VALUE_STR:  result = VAL_BOOL(!string_compare(&AS_STR(left), &AS_STR(right))); break;
-                case VALUE_BOOL: result = VAL_BOOL(AS_BOOL(left) != AS_BOOL(right)); break;
-            }
-            break;
-        case TOKEN_LESS: 
-            if (left.type != VALUE_NUM) invalid_op();
-            else result = VAL_BOOL(AS_NUM(left) < AS_NUM(right));
-            break;
-        case TOKEN_LESSEQ:
-            if (left.type != VALUE_NUM) invalid_op();
-            else result = VAL_BOOL(AS_NUM(left) <= AS_NUM(right));
-            break;
-        case TOKEN_GREATER:
-            if (left.type != VALUE_NUM) invalid_op();
-            else result = VAL_BOOL(AS_NUM(left) > AS_NUM(right));
-            break;
-        case TOKEN_GREATEREQ:
-            if (left.type != VALUE_NUM) invalid_op();
-            else result = VAL_BOOL(AS_NUM(left) >= AS_NUM(right));
-            break;
-        case TOKEN_OR: 
-            if (left.type != VALUE_BOOL) invalid_op();
-            else result = VAL_BOOL(AS_BOOL(left) || AS_BOOL(right));
-            break;
-        case TOKEN_AND: 
-            if (left.type != VALUE_BOOL) invalid_op();
-            else result = VAL_BOOL(AS_BOOL(left) && AS_BOOL(right));
-            break;
-        default: break; // Unreachable
-    }
-
-    #undef invalid_op
+    return expr_push(parser->expr, node);
+}
 
-    return result;
+// Identifiers are interned with the hash computed by the lexer. A token's
+// text only lives as long as the lexer's window keeps it, names are interned
+// before the tokens after them are lexed. The node takes the reference, a
+// node that is never pushed has to release it.
+static String token_name(Token token)
+{
+    return intern(token.start, token.len, token.hash);
 }
 
-Value expression(Parser *parser, precedence rbp, TokenType expected_first_token)
+static NodeId parse_expression(Parser *parser, precedence rbp, TokenType expected_first_token)
 {
-    if (parser->error) return VAL_NUM(0.0);
     Token token = consume(parser);
     if (expected_first_token != TOKEN_NONE && token.type != expected_first_token) {
         parser->error = true;
         log_info(&parser->logging, "The first token wasn't as expected.");
-        return VAL_BOOL(false);
+        return NO_NODE;
     }
 
-    ParseRule *left_rule = get_rule(token);
+    const ParseRule *left_rule = get_rule(token);
     if (!left_rule->prefix) {
         parser->error = true;
         log_info(&parser->logging, "The token '%.*s' must be exceeded by a value.", token.len, token.start);
-        return VAL_BOOL(false);
+        return NO_NODE;
     }
 
-    Value left = left_rule->prefix(parser);
+    NodeId left = left_rule->prefix(parser);
 
     while ((int)rbp < get_rule(peek(parser))->lbp) {
-        if (parser->error) return VAL_NUM(0.0);
+        if (parser->error) return NO_NODE;
         token = consume(parser);
-        ParseRule *right_rule = get_rule(token);
+        const ParseRule *right_rule = get_rule(token);
         if (!right_rule->infix) {
             parser->error = true;
             log_info(&parser->logging, "The token '%.*s' must be preceeded by a value.", token.len, token.start);
-            return VAL_BOOL(false);
+            return NO_NODE;
         }
-        Value right = right_rule->infix(parser); 
-        left = do_operation(parser, left, right, token);
+        NodeId right = right_rule->infix(parser); 
+        if (parser->error) return NO_NODE;
+        left = push_node(parser, (Node){.type = NODE_BINARY, .op = token.type, .left = left, .right = right});
     }
 
     return left;
 }
 
-Value parse_expr(Parser *parser)
+NodeId expression(Parser *parser, precedence rbp, TokenType expected_first_token)
 {
-    if (parser->tokens->count <= 0 ||
-        parser->tokens->items[0].type == TOKEN_END ||
-        parser->tokens->items[0].type == TOKEN_ERROR) {
+    if (parser->error) return NO_NODE;
+    if (parser->depth >= PARSER_MAX_DEPTH) {
         parser->error = true;
-        return VAL_NUM(0.0);
+        log_info(&parser->logging, "Error: Expression nested deeper than %d levels", PARSER_MAX_DEPTH);
+        return NO_NODE;
     }
-    Value result = expression(parser, PREC_NONE, TOKEN_NONE);
-    parser->ans = result;
 
-    return result;
-}
+    parser->depth++;
+    NodeId node = parse_expression(parser, rbp, expected_first_token);
+    parser->depth--;
 
-Value ans(Parser *parser)
-{
-    return parser->ans;
+    return node;
 }
 
-Value grouping(Parser *parser)
+bool parser_compile(Parser *parser, TokenBuffer *list, Expr *expr)
 {
-    Value result = expression(parser, PREC_NONE, TOKEN_NONE);
-    expect(parser, TOKEN_RIGHT_PAREN);
+    if (list->count <= 0) {
+        expr_clear(expr);
+        parser->error = true;
+        return false;
+    }
 
-    return result;
+    TokenStream tokens = token_stream_list(list);
+
+    return parser_compile_stream(parser, &tokens, expr);
 }
 
-Value unary(Parser *parser)
+// Parses tokens as they're lexed. The rest of the input is lexed even when
+// parsing stops early, check token_stream_failed before using the result.
+bool parser_compile_stream(Parser *parser, TokenStream *tokens, Expr *expr)
 {
-    Token token = prev(parser);
-    Value result = expression(parser, PREC_UNARY, TOKEN_NONE);
+    expr_clear(expr);
+    parser_reset(parser, tokens);
 
-    switch (token.type) {
-        case TOKEN_NOT:   result = VAL_BOOL(!AS_BOOL(result));   break;
-        case TOKEN_MINUS: result = VAL_NUM(AS_NUM(result) * -1); break;
-        default: break;
+    TokenType first = peek(parser).type;
+    if (first == TOKEN_END || first == TOKEN_ERROR) {
+        token_stream_drain(tokens);
+        parser->error = true;
+        return false;
     }
 
-    return result;
+    parser->expr = expr;
+    NodeId root = expression(parser, PREC_NONE, TOKEN_NONE);
+    parser->expr = NULL;
+    token_stream_drain(tokens);
+
+    if (parser->error || root == NO_NODE) {
+        parser->error = true;
+        return false;
+    }
+
+    expr->root = root;
+    expr_optimize(parser, expr);
+
+    return true;
 }
 
-Value binary(Parser *parser)
+Value parse_expr(Parser *parser)
 {
-    Value result = expression(parser, get_rule(prev(parser))->lbp, TOKEN_NONE);
+    Expr expr = expr_new();
+    Value result = VAL_NUM(0.0);
+
+    if (parser_compile_stream(parser, parser->tokens, &expr)) {
+        result = parser_eval(parser, &expr);
+    }
+
+    expr_destroy(&expr);
 
     return result;
 }
 
-bool expected_str(const char *str, const char *expected, size_t len)
+NodeId ans(Parser *parser)
 {
-    return strlen(expected) != len ? false : memcmp(str, expected, sizeof(char) * len) == 0;
+    return push_node(parser, (Node){.type = NODE_ANS, .left = NO_NODE, .right = NO_NODE});
 }
 
-typedef enum {
-    SIN,
-    COS,
-    TAN,
-    ASIN,
-    ACOS,
-    ATAN,
-    ATAN2,
-    SINH,
-    COSH,
-    TANH,
-    ASINH,
-    ACOSH,
-    ATANH,
-    EXP,
-    LOG,
-    LOG10,
-    LOG2,
-    CEIL,
-    FLOOR,
-    ROUND,
-    SQRT,
-    PI,
-    EULER,
-    MATHFUNC_COUNT,
-} MathFunc;
-
-Value math_func(Parser *parser, MathFunc func)
+NodeId exit_prog(Parser *parser)
 {
-    Value r1, r2;
-
-    switch (func) {
-        case SIN:
-            expect(parser, TOKEN_LEFT_PAREN);
-            return VAL_NUM(sinl(AS_NUM(grouping(parser)))); 
-        case COS:
-            expect(parser, TOKEN_LEFT_PAREN);
-            return VAL_NUM(cosl(AS_NUM(grouping(parser))));
-        case TAN:
-            expect(parser, TOKEN_LEFT_PAREN);
-            return VAL_NUM(tanl(AS_NUM(grouping(parser))));
-        case ASIN:
-            expect(parser, TOKEN_LEFT_PAREN);
-            return VAL_NUM(asinl(AS_NUM(grouping(parser))));
-        case ACOS:
-            expect(parser, TOKEN_LEFT_PAREN);
-            return VAL_NUM(acosl(AS_NUM(grouping(parser))));
-        case ATAN:
-            expect(parser, TOKEN_LEFT_PAREN);
-            return VAL_NUM(atanl(AS_NUM(grouping(parser))));
-        case ATAN2:
-            expect(parser, TOKEN_LEFT_PAREN);
-            r1 = expression(parser, PREC_NONE, TOKEN_NONE);
-            expect(parser, TOKEN_COMMA);
-            r2 = grouping(parser);
-            return VAL_NUM(atan2l(AS_NUM(r1), AS_NUM(r2)));
-        case SINH:
-            expect(parser, TOKEN_LEFT_PAREN);
-            return VAL_NUM(sinhl(AS_NUM(grouping(parser))));
-        case COSH:
-            expect(parser, TOKEN_LEFT_PAREN);
-            return VAL_NUM(coshl(AS_NUM(grouping(parser))));
-        case TANH:
-            expect(parser, TOKEN_LEFT_PAREN);
-            return VAL_NUM(tanhl(AS_NUM(grouping(parser))));
-        case ASINH:
-            expect(parser, TOKEN_LEFT_PAREN);
-            return VAL_NUM(asinhl(AS_NUM(grouping(parser))));
-        case ACOSH:
-            expect(parser, TOKEN_LEFT_PAREN);
-            return VAL_NUM(acoshl(AS_NUM(grouping(parser))));
-        case ATANH:
-            expect(parser, TOKEN_LEFT_PAREN);
-            return VAL_NUM(atanhl(AS_NUM(grouping(parser))));
-        case EXP:
-            expect(parser, TOKEN_LEFT_PAREN);
-            return VAL_NUM(expl(AS_NUM(grouping(parser))));
-        case LOG:
-            expect(parser, TOKEN_LEFT_PAREN);
-            return VAL_NUM(logl(AS_NUM(grouping(parser))));
-        case LOG10:
-            expect(parser, TOKEN_LEFT_PAREN);
-            return VAL_NUM(log10l(AS_NUM(grouping(parser))));
-        case LOG2:
-            expect(parser, TOKEN_LEFT_PAREN);
-            return VAL_NUM(log2l(AS_NUM(grouping(parser))));
-        case CEIL:
-            expect(parser, TOKEN_LEFT_PAREN);
-            return VAL_NUM(ceill(AS_NUM(grouping(parser))));
-        case FLOOR:
-            expect(parser, TOKEN_LEFT_PAREN);
-            return VAL_NUM(floorl(AS_NUM(grouping(parser))));
-        case ROUND:
-            expect(parser, TOKEN_LEFT_PAREN);
-            return VAL_NUM(roundl(AS_NUM(grouping(parser))));
-        case SQRT:
-            expect(parser, TOKEN_LEFT_PAREN);
-            return VAL_NUM(sqrtl(AS_NUM(grouping(parser))));
-        case PI:
-            return VAL_NUM(3.14159265358979323846264338327950288419716939937510f);
-        case EULER:
-            return VAL_NUM(2.71828182845904523536028747135266249775724709369995f);
-        default:
-            return VAL_NUM(0.0f); // unreachable
-    }
+    return push_node(parser, (Node){.type = NODE_EXIT, .left = NO_NODE, .right = NO_NODE});
 }
 
-bool is_name(FILE *f, String name)
+NodeId grouping(Parser *parser)
 {
-    if (f == NULL || feof(f)) return false;
-
-    char c = fgetc(f);
-    size_t i = 0;
-
-    while (i < name.len && c != '\0' && !feof(f)) {
-        if (c != name.data[i++]) return false;
-        c = fgetc(f);
-    }
-
-    if (i != name.len || c != '\0') return false;
+    NodeId result = expression(parser, PREC_NONE, TOKEN_NONE);
+    expect(parser, TOKEN_RIGHT_PAREN);
 
-    return true;
+    return result;
 }
 
-bool export_variable(Parser *parser, FILE *f, String variable_name)
+NodeId unary(Parser *parser)
 {
-    if (f == NULL) return false;
-
-    // printf("var_len: %zu\n", variable_name.len);
-    if (!map_has(&parser->map, variable_name)) return false;
-
-    Value value = map_get(&parser->map, variable_name); 
+    Token token = prev(parser);
+    NodeId operand = expression(parser, PREC_UNARY, TOKEN_NONE);
+    if (parser->error) return NO_NODE;
 
-    if (fwrite(variable_name.data, sizeof(char), variable_name.len, f) != variable_name.len) return false;
-    if (fputc('\0', f) == EOF) return false;
+    return push_node(parser, (Node){.type = NODE_UNARY, .op = token.type, .left = operand, .right = NO_NODE});
+}
 
-    if (fwrite(&value.type, sizeof(ValueType), 1, f) != 1) return false;
-    switch (value.type) {
-        case VALUE_NUM:
-            if (fwrite(&AS_NUM(value), sizeof(AS_NUM(value)), 1, f) != 1) return false;
-            break;
-        case VALUE_BOOL:
-            if (fwrite(&AS_BOOL(value), sizeof(AS_BOOL(value)), 1, f) != 1) return false;
-            break;
-        case VALUE_STR:
-            if (fwrite(&AS_STR(value).len, sizeof(AS_STR(value).len), 1, f) != 1) return false;
-            if (fwrite(AS_STR(value).data, sizeof(char), AS_STR(value).len, f) != AS_STR(value).len) return false;
-            break;
-        default:
-            return false;
-    }
+NodeId binary(Parser *parser)
+{
+    NodeId result = expression(parser, get_rule(prev(parser))->lbp, TOKEN_NONE);
 
-    return true;
+    return result;
 }
 
-bool import_variable(Parser *parser, FILE *f, String variable_name, Value *value)
+NodeId math_func(Parser *parser, MathFunc func)
 {
-    if (f == NULL || feof(f)) return false;
+    Node node = {.type = NODE_CALL, .func = func, .left = NO_NODE, .right = NO_NODE};
 
-    if (!is_name(f, variable_name)) return false;
-
-    if (fread(&value->type, sizeof(ValueType), 1, f) != 1) return false;
-    switch (value->type) {
-        case VALUE_NUM:
-            if (fread(&AS_NUM(*value), sizeof(AS_NUM(*value)), 1, f) != 1) return false;
+    switch (math_func_arity(func)) {
+        case 0:
             break;
-        case VALUE_BOOL:
-            if (fread(&AS_BOOL(*value), sizeof(AS_BOOL(*value)), 1, f) != 1) return false;
+        case 1:
+            expect(parser, TOKEN_LEFT_PAREN);
+            node.left = grouping(parser);
             break;
-        case VALUE_STR:
-            if (fread(&AS_STR(*value).len, sizeof(AS_STR(*value).len), 1, f) != 1) return false;
-            char *buffer = arena_alloc(&parser->arena, sizeof(char) * (AS_STR(*value).len + 1));
-            if (fread(buffer, sizeof(char), AS_STR(*value).len, f) != AS_STR(*value).len) return false;
-            buffer[AS_STR(*value).len] = '\0';
-            AS_STR(*value).data = buffer;
+        case 2:
+            expect(parser, TOKEN_LEFT_PAREN);
+            node.left = expression(parser, PREC_NONE, TOKEN_NONE);
+            expect(parser, TOKEN_COMMA);
+            node.right = grouping(parser);
             break;
-        default:
-            return false;
     }
 
-    return true;
+    if (parser->error) return NO_NODE;
+
+    return push_node(parser, node);
 }
 
-Value identifier(Parser *parser)
+NodeId identifier(Parser *parser)
 {
-    static const char* funcs[MATHFUNC_COUNT] = {
-        "sin",
-        "cos",
-        "tan",
-        "asin",
-        "acos",
-        "atan",
-        "atan2",
-        "sinh",
-        "cosh",
-        "tanh",
-        "asinh",
-        "acosh",
-        "atanh",
-        "exp",
-        "log",
-        "log10",
-        "log2",
-        "ceil",
-        "floor",
-        "round",
-        "sqrt",
-        "pi",
-        "e",
-    };
-
     Token ident = prev(parser);
 
-    if (expected_str(ident.start, "export", ident.len)) {
+    if (ident.builtin == BUILTIN_EXPORT) {
         expect(parser, TOKEN_LEFT_PAREN);
 
         if (expect(parser, TOKEN_DOLLAR).type == TOKEN_ERROR) {
             log_info(&parser->logging, "Error: First argument should be a variable starting with '$'.");
-            return VAL_BOOL(false);
+            return NO_NODE;
         }
 
         Token ident = expect(parser, TOKEN_IDENTIFIER);
         if (ident.type == TOKEN_ERROR) {
             log_info(&parser->logging, "Error: Invalid identifier.");
-            return VAL_BOOL(false);
+            return NO_NODE;
+        }
+
+        Node node = {.type = NODE_EXPORT, .right = NO_NODE};
+        node.as.name = token_name(ident);
+        expect(parser, TOKEN_COMMA);
+        node.left = grouping(parser);
+        if (parser->error) {
+            intern_release(&node.as.name);
+            return NO_NODE;
         }
 
-        String var_name = (String){.data = (char*)ident.start, .len = ident.len};
+        return push_node(parser, node);
+    }
+    else if (ident.builtin == BUILTIN_DROP) {
+        expect(parser, TOKEN_LEFT_PAREN);
 
-        if (!map_has(&parser->map, var_name)) {
-            log_info(&parser->logging, "Error: variable '%.*s' doesn't exist.", (int)ident.len, ident.start);
-            return VAL_BOOL(false);
+        if (expect(parser, TOKEN_DOLLAR).type == TOKEN_ERROR) {
+            log_info(&parser->logging, "Error: Argument should be a variable starting with '$'.");
+            return NO_NODE;
         }
 
+        Token ident = expect(parser, TOKEN_IDENTIFIER);
+        if (parser->error) return NO_NODE;
+
+        Node node = {.type = NODE_DROP, .left = NO_NODE, .right = NO_NODE};
+        node.as.name = token_name(ident);
+        expect(parser, TOKEN_RIGHT_PAREN);
         if (parser->error) {
-            log_info(&parser->logging, "Error: Couldn't export variable because of parsing error.");
-            return VAL_BOOL(false);
+            intern_release(&node.as.name);
+            return NO_NODE;
         }
 
-        expect(parser, TOKEN_COMMA);
-        String var_path = AS_STR(grouping(parser));
-        FILE *file = fopen(var_path.data, "wb");
-        if (file == NULL) {
-            log_info(&parser->logging, "Error: Couldn't write to file '%s'", var_path.data);
-            parser->error = true;
-            return VAL_BOOL(false);
-        }
-        if (!export_variable(parser, file, var_name)) {
-            fclose(file);
-            log_info(&parser->logging, "Error: Failed to export variable '%s'", var_name.data);
-            parser->error = true;
-            return VAL_BOOL(false);
-        }
-        fclose(file);
-        return VAL_BOOL(true);
+        return push_node(parser, node);
     }
-    else if (expected_str(ident.start, "import", ident.len)) {
+    else if (ident.builtin == BUILTIN_IMPORT) {
         expect(parser, TOKEN_LEFT_PAREN);
-        String var_name = AS_STR(expression(parser, PREC_NONE, TOKEN_STRING));
+        NodeId name = expression(parser, PREC_NONE, TOKEN_STRING);
         expect(parser, TOKEN_COMMA);
-        String var_path = AS_STR(grouping(parser));
-        FILE *file = fopen(var_path.data, "rb");
-        if (file == NULL) {
-            log_info(&parser->logging, "Couldn't read from file '%s'", var_path.data);
-            parser->error = true;
-            return VAL_BOOL(false);
-        }
-        Value var = {0};
-        if (!import_variable(parser, file, var_name, &var)) {
-            fclose(file);
-            log_info(&parser->logging, "Failed to import variable '%s'", var_name.data);
-            parser->error = true;
-            return VAL_BOOL(false);
-        }
-        fclose(file);
-        return var;
+        NodeId path = grouping(parser);
+        if (parser->error) return NO_NODE;
+
+        return push_node(parser, (Node){.type = NODE_IMPORT, .left = name, .right = path});
     }
 
-    for (size_t i = 0; i < array_len(funcs); i++) {
-        if (expected_str(ident.start, funcs[i], ident.len)) {
-            return math_func(parser, (MathFunc)i);
-        }
+    else if (BUILTIN_IS_MATH(ident.builtin)) {
+        return math_func(parser, BUILTIN_MATH_FUNC(ident.builtin));
     }
 
     log_info(&parser->logging, "Error: Unkown identifier '%.*s'", ident.len, ident.start);
     parser->error = true;
 
-    return VAL_BOOL(false);
+    return NO_NODE;
 }
 
-Value declare(Parser *parser)
+NodeId declare(Parser *parser)
 {
     Token ident = consume(parser); 
+    Node node = {.type = NODE_LET, .right = NO_NODE};
+    node.as.name = token_name(ident);
     expect(parser, TOKEN_EQUAL); 
-    Value result = expression(parser, PREC_NONE, TOKEN_NONE);
-
-    if (result.type == VALUE_STR) {
-        result = VAL_STR(string_create(AS_STR(result).data, AS_STR(result).len));
-    }
-
-    String str = {.data = (char*)ident.start, .len = ident.len};
-
-    if (!map_has(&parser->map, str)) {
-        String key = string_create(ident.start, ident.len);
-        map_set(&parser->map, key, result);
-    }
-    else {
-        Value val = map_get(&parser->map, str);
-        if (val.type == VALUE_STR) {
-            string_destroy(&AS_STR(val));
-        }
-        map_set(&parser->map, str, result);
+    node.left = expression(parser, PREC_NONE, TOKEN_NONE);
+    if (parser->error) {
+        intern_release(&node.as.name);
+        return NO_NODE;
     }
 
-    return result;
+    return push_node(parser, node);
 }
 
-Value get_var(Parser *parser)
+NodeId get_var(Parser *parser)
 {
     Token ident = expect(parser, TOKEN_IDENTIFIER);
-    String str = {.data = (char*)ident.start, .len = ident.len};
-    
-    if (!map_has(&parser->map, str)) {
-        log_info(&parser->logging, "Error: Variable '%.*s' doesn't exist", ident.len, ident.start);
-        parser->error = true;
-        for (size_t i = 0; i < parser->map.capacity; i++) {
-            if (parser->map.items[i].valid) {
-                String key = parser->map.items[i].key;
-                Value value = parser->map.items[i].value;
-                static char buffer[100];
-                value_to_str(buffer, &value);
-                printf("Key: %.*s, Value: %s\n", (int)key.len, key.data, buffer);
-            }
-        }
-    }
-    Value result = map_get(&parser->map, str);
+    if (parser->error) return NO_NODE;
 
-    return result;
+    Node node = {.type = NODE_VAR, .left = NO_NODE, .right = NO_NODE};
+    node.as.name = token_name(ident);
+
+    return push_node(parser, node);
 }
 
-Value number(Parser *parser)
+NodeId number(Parser *parser)
 {
+    Node node = {.type = NODE_VALUE, .left = NO_NODE, .right = NO_NODE};
     Token num = prev(parser);
-    enum { temp_len = 100};
-    static char temp[temp_len];
-    snprintf(temp, temp_len, "%.*s", num.len, num.start);
-    Value result = VAL_NUM(strtold(temp, NULL));
+    node.as.value = num.is_int ? VAL_INT(num.integer) : VAL_NUM(num.num);
 
-    return result;
+    return push_node(parser, node);
 }
 
-Value string(Parser *parser)
+NodeId string(Parser *parser)
 {
     Token token = prev(parser);
-    String str = string_create_arena(&parser->arena, token.start, token.len);
 
-    return VAL_STR(str);
+    // The node keeps its own reference to a copy of the text, released with
+    // the Expr, so literals don't pile up in the intern table.
+    String text = {.data = (char*)token.start, .len = token.len};
+    Node node = {.type = NODE_VALUE, .left = NO_NODE, .right = NO_NODE};
+    node.as.value = value_retain(VAL_STR(&text));
+
+    return push_node(parser, node);
 }
 
-Value boolean(Parser *parser)
+NodeId boolean(Parser *parser)
 {
     Token token = prev(parser);
 
-    return token.type == TOKEN_TRUE ? VAL_BOOL(true) : VAL_BOOL(false);
+    Node node = {.type = NODE_VALUE, .left = NO_NODE, .right = NO_NODE};
+    node.as.value = token.type == TOKEN_TRUE ? VAL_BOOL(true) : VAL_BOOL(false);
+
+    return push_node(parser, node);
 }
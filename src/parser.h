@@ -2,9 +2,10 @@
 
 #include "lexer.h"
 #include "log.h"
-#include "map.h"
+#include "vars.h"
 #include "value.h"
 #include "arena.h"
+#include "expr.h"
 #include <stdbool.h>
 
 typedef enum {
@@ -19,17 +20,27 @@ typedef enum {
     PREC_UNARY,
 } precedence;
 
+// Each level of nesting (parentheses, unary operators, '^' chains) takes a
+// few C stack frames while parsing. Deeper input is a parse error rather than
+// a stack overflow.
+#define PARSER_MAX_DEPTH 1024
+
 typedef struct {
-    TokenList *tokens;
-    int current;
+    TokenStream *tokens;
+    Expr *expr;
+    size_t depth;   // expression() calls in progress
     Value ans;
-    Map map;
-    Arena arena;
+    Vars vars;
+    Arena scratch;  // Temporaries of the current evaluation, reset when it ends
+    Arena boxes;    // Headers of NaN-boxed temporary strings, reset with scratch
+    ExprStack walk; // Stacks of the tree walking evaluator, kept between evaluations
+    ValueList values;
     bool error;
+    bool exit;    // 'exit' was evaluated, evaluation stops as if it failed
     LoggingInfo logging;
 } Parser;
 
-typedef Value (*ParseFn)(Parser *parser);
+typedef NodeId (*ParseFn)(Parser *parser);
 
 typedef struct {
     ParseFn prefix;
@@ -39,6 +50,19 @@ typedef struct {
 
 Parser parser_create();
 void parser_destroy(Parser *parser);
-void parser_reset(Parser *parser, TokenList *list);
-Value expression(Parser *parser, precedence rbp, TokenType expected_first_token);
+void parser_reset(Parser *parser, TokenStream *tokens);
+NodeId expression(Parser *parser, precedence rbp, TokenType expected_first_token);
+bool parser_compile(Parser *parser, TokenBuffer *list, Expr *expr);
+bool parser_compile_stream(Parser *parser, TokenStream *tokens, Expr *expr);
+Value parser_eval(Parser *parser, Expr *expr);
 Value parse_expr(Parser *parser);
+Value do_operation(Parser *parser, Value left, Value right, TokenType oper);
+Value do_unary(Parser *parser, Value operand, TokenType oper);
+Value math_call(MathFunc func, Value arg1, Value arg2);
+Value load_var(Parser *parser, String name, VarRef *ref);
+Value declare_var(Parser *parser, String name, VarRef *ref, Value result);
+Value export_var(Parser *parser, String var_name, Value path);
+Value import_var(Parser *parser, Value name, Value path);
+Value drop_var(Parser *parser, String name);
+Value set_ans(Parser *parser, Value result);
+Value finish_eval(Parser *parser, Value result);
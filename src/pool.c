@@ -0,0 +1,248 @@
+#include "pool.h"
+#include "list.h"
+#include "vars.h"
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+// Lines claimed from a worker's own range at a time.
+#define POOL_GRAIN 16
+
+static const char *tokenize_failed = "ERROR: Tokenization Failed!";
+static const char *parse_failed = "ERROR: Parsing Failed!";
+
+// Lines are independent, so each one starts from the state of a fresh parser
+// no matter which worker runs it or what that worker ran before.
+void pool_worker_reset(Worker *worker)
+{
+    Parser *parser = &worker->parser;
+
+    vars_clear(&parser->vars);
+    arena_reset(&parser->scratch);
+    arena_reset(&parser->boxes);
+    set_ans(parser, VAL_NUM(0));
+    parser->exit = false;
+}
+
+PoolResult pool_error(const char *message)
+{
+    String text = {.data = (char*)message, .len = strlen(message)};
+
+    return (PoolResult){.value = value_retain(VAL_STR(&text)), .error = true};
+}
+
+// Evaluates tokens against the worker's current parser state.
+PoolResult pool_worker_run(Worker *worker, TokenStream *tokens)
+{
+    Parser *parser = &worker->parser;
+    Value result = VAL_NUM(0.0);
+
+    bool compiled = parser_compile_stream(parser, tokens, &worker->expr);
+    if (token_stream_failed(tokens)) return pool_error(tokenize_failed);
+
+    if (compiled) {
+        if (chunk_compile(&worker->expr, &worker->chunk)) result = vm_run(parser, &worker->chunk);
+        else result = parser_eval(parser, &worker->expr);
+    }
+    if (parser->error) return pool_error(parse_failed);
+
+    // The parser's ans is replaced by the next line, the result keeps its own reference.
+    return (PoolResult){.value = value_retain(result), .error = false};
+}
+
+static PoolResult worker_eval(Worker *worker, const char *line)
+{
+    pool_worker_reset(worker);
+    TokenStream tokens = token_stream_new(line, &worker->parser.logging);
+
+    return pool_worker_run(worker, &tokens);
+}
+
+static bool take_own(Worker *worker, size_t *begin, size_t *end)
+{
+    pthread_mutex_lock(&worker->lock);
+    *begin = worker->begin;
+    *end = worker->begin + POOL_GRAIN < worker->end ? worker->begin + POOL_GRAIN : worker->end;
+    worker->begin = *end;
+    pthread_mutex_unlock(&worker->lock);
+
+    return *begin < *end;
+}
+
+// Moves the back half of some other worker's range into ours. Returns false
+// once every range is empty.
+static bool steal(Worker *worker)
+{
+    Pool *pool = worker->pool;
+    int first = rand_r(&worker->seed) % pool->thread_count;
+
+    for (int i = 0; i < pool->thread_count; i++) {
+        Worker *victim = &pool->workers[(first + i) % pool->thread_count];
+        if (victim == worker) continue;
+
+        pthread_mutex_lock(&victim->lock);
+        size_t remaining = victim->end - victim->begin;
+        size_t end = victim->end;
+        size_t begin = end - (remaining + 1) / 2;
+        victim->end = begin;
+        pthread_mutex_unlock(&victim->lock);
+
+        if (remaining == 0) continue;
+
+        pthread_mutex_lock(&worker->lock);
+        worker->begin = begin;
+        worker->end = end;
+        pthread_mutex_unlock(&worker->lock);
+
+        return true;
+    }
+
+    return false;
+}
+
+typedef struct {
+    const char **lines;
+    PoolResult *results;
+} EvalBatch;
+
+static void eval_job(Worker *worker, void *context)
+{
+    EvalBatch *batch = context;
+    size_t begin, end;
+
+    do {
+        while (take_own(worker, &begin, &end)) {
+            for (size_t i = begin; i < end; i++) {
+                batch->results[i] = worker_eval(worker, batch->lines[i]);
+            }
+        }
+    } while (steal(worker));
+}
+
+static void* worker_main(void *arg)
+{
+    Worker *worker = arg;
+    Pool *pool = worker->pool;
+    size_t seen = 0;
+
+    pthread_mutex_lock(&pool->lock);
+    for (;;) {
+        while (!pool->quit && pool->generation == seen) {
+            pthread_cond_wait(&pool->start, &pool->lock);
+        }
+        if (pool->quit) break;
+        seen = pool->generation;
+        pthread_mutex_unlock(&pool->lock);
+
+        pool->job(worker, pool->context);
+
+        pthread_mutex_lock(&pool->lock);
+        if (--pool->running == 0) pthread_cond_signal(&pool->done);
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    return NULL;
+}
+
+int pool_default_threads(void)
+{
+    long count = sysconf(_SC_NPROCESSORS_ONLN);
+
+    return count > 0 ? (int)count : 1;
+}
+
+Pool* pool_create(int thread_count)
+{
+    if (thread_count <= 0) thread_count = pool_default_threads();
+
+    Pool *pool = calloc(1, sizeof(Pool));
+    pool->thread_count = thread_count;
+    pool->workers = calloc(thread_count, sizeof(Worker));
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->start, NULL);
+    pthread_cond_init(&pool->done, NULL);
+
+    for (int i = 0; i < thread_count; i++) {
+        Worker *worker = &pool->workers[i];
+        worker->pool = pool;
+        worker->seed = (unsigned int)i * 2654435761u + 1;
+        worker->parser = parser_create();
+        worker->expr = expr_new();
+        worker->chunk = chunk_new();
+        pthread_mutex_init(&worker->lock, NULL);
+    }
+    for (int i = 0; i < thread_count; i++) {
+        pthread_create(&pool->workers[i].thread, NULL, worker_main, &pool->workers[i]);
+    }
+
+    return pool;
+}
+
+void pool_destroy(Pool *pool)
+{
+    pthread_mutex_lock(&pool->lock);
+    pool->quit = true;
+    pthread_cond_broadcast(&pool->start);
+    pthread_mutex_unlock(&pool->lock);
+
+    for (int i = 0; i < pool->thread_count; i++) {
+        Worker *worker = &pool->workers[i];
+        pthread_join(worker->thread, NULL);
+        pool_worker_reset(worker);
+        pthread_mutex_destroy(&worker->lock);
+        chunk_destroy(&worker->chunk);
+        expr_destroy(&worker->expr);
+        parser_destroy(&worker->parser);
+    }
+
+    pthread_cond_destroy(&pool->done);
+    pthread_cond_destroy(&pool->start);
+    pthread_mutex_destroy(&pool->lock);
+    free(pool->workers);
+    free(pool);
+}
+
+// Evaluates every line and stores its result at the same index in results.
+// Blocks until all lines are done.
+void pool_eval(Pool *pool, const char **lines, size_t count, PoolResult *results)
+{
+    if (count == 0) return;
+
+    size_t share = count / pool->thread_count;
+    size_t extra = count % pool->thread_count;
+    size_t begin = 0;
+
+    for (int i = 0; i < pool->thread_count; i++) {
+        Worker *worker = &pool->workers[i];
+        size_t len = share + ((size_t)i < extra ? 1 : 0);
+        pthread_mutex_lock(&worker->lock);
+        worker->begin = begin;
+        worker->end = begin + len;
+        pthread_mutex_unlock(&worker->lock);
+        begin += len;
+    }
+
+    EvalBatch batch = {.lines = lines, .results = results};
+    pool_run(pool, eval_job, &batch);
+}
+
+void pool_run(Pool *pool, PoolJob job, void *context)
+{
+    pthread_mutex_lock(&pool->lock);
+    pool->job = job;
+    pool->context = context;
+    pool->running = pool->thread_count;
+    pool->generation++;
+    pthread_cond_broadcast(&pool->start);
+    while (pool->running > 0) {
+        pthread_cond_wait(&pool->done, &pool->lock);
+    }
+    pthread_mutex_unlock(&pool->lock);
+}
+
+void pool_results_free(PoolResult *results, size_t count)
+{
+    for (size_t i = 0; i < count; i++) {
+        value_release(&results[i].value);
+    }
+}
@@ -0,0 +1,60 @@
+#pragma once
+
+#include "expr.h"
+#include "lexer.h"
+#include "parser.h"
+#include "value.h"
+#include "vm.h"
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+// Result of one line. String values are owned by the caller, free them with
+// pool_results_free.
+typedef struct {
+    Value value;
+    bool error;
+} PoolResult;
+
+typedef struct Pool Pool;
+typedef struct Worker Worker;
+
+// Runs once on every worker, pool_run returns when all of them have returned.
+typedef void (*PoolJob)(Worker *worker, void *context);
+
+// Every worker owns its parser and compile buffers, and a range of line indices
+// it claims from the front. Idle workers steal the back half of a victim's range.
+struct Worker {
+    Pool *pool;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    size_t begin;
+    size_t end;
+    unsigned int seed;
+    Parser parser;
+    Expr expr;
+    Chunk chunk;
+};
+
+struct Pool {
+    Worker *workers;
+    int thread_count;
+    pthread_mutex_t lock;
+    pthread_cond_t start;
+    pthread_cond_t done;
+    size_t generation;
+    int running;
+    bool quit;
+    PoolJob job;
+    void *context;
+};
+
+Pool* pool_create(int thread_count);
+void pool_destroy(Pool *pool);
+void pool_run(Pool *pool, PoolJob job, void *context);
+void pool_eval(Pool *pool, const char **lines, size_t count, PoolResult *results);
+void pool_worker_reset(Worker *worker);
+PoolResult pool_worker_run(Worker *worker, TokenStream *tokens);
+PoolResult pool_error(const char *message);
+void pool_results_free(PoolResult *results, size_t count);
+int pool_default_threads(void);
@@ -0,0 +1,411 @@
+#include "script.h"
+#include "list.h"
+#include "map.h"
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+static const char *tokenize_failed = "ERROR: Tokenization Failed!";
+
+typedef struct {
+    String name;    // Points into the line's text
+    Value value;    // Retained, set once the line is done
+    bool present;   // The variable existed after the line ran
+    bool dropped;   // Written by drop($name), absent means removed
+    long prev;      // Last earlier line writing the same name, -1 if none
+} ScriptWrite;
+
+typedef struct {
+    String name;
+    long writer;    // Last earlier line writing the name, -1 if none
+} ScriptRead;
+
+typedef struct {
+    String name;
+    Value *value;
+} Binding;
+
+// Lines that wait on a line form a list through the script's edges.
+typedef struct {
+    size_t to;
+    long next;
+} ScriptEdge;
+
+LIST_DEF(ScriptWriteList, ScriptWrite);
+LIST_DEF(ScriptReadList, ScriptRead);
+LIST_DEF(ScriptEdgeList, ScriptEdge);
+LIST_DEF(BindingList, Binding);
+LIST_DEF(IndexList, size_t);
+
+// A line's tokens, reads and writes are ranges of the script's lists, so a
+// long script doesn't make a handful of small allocations per line.
+typedef struct {
+    const char *text;
+    size_t first_token;
+    size_t token_count;
+    size_t first_payload;
+    size_t first_read;
+    size_t read_count;
+    size_t first_write;
+    size_t write_count;
+    bool tokenized;
+    bool reads_ans;
+    bool barrier;   // File access or 'exit', ordered against every other line
+    size_t pending;
+    long dependents; // First edge to a line waiting on this one, -1 if none
+    bool done;
+} ScriptLine;
+
+typedef struct {
+    ScriptLine *lines;
+    PoolResult *results;
+    size_t count;
+    TokenBuffer tokens;
+    ScriptReadList reads;
+    ScriptWriteList writes;
+    ScriptEdgeList edges;
+    Map writers;    // name -> last line writing it, while building the graph
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    IndexList ready;
+    size_t ready_head;
+    size_t remaining;
+    size_t produced;
+} Script;
+
+static String token_name(Token token)
+{
+    return (String){.data = (char*)token.start, .len = token.len, .hash = token.hash};
+}
+
+// A view of the line's tokens, only valid once every line is tokenized.
+static TokenBuffer line_tokens(Script *script, ScriptLine *line)
+{
+    return (TokenBuffer){
+        .text = line->text,
+        .types = &script->tokens.types[line->first_token],
+        .offsets = &script->tokens.offsets[line->first_token],
+        .lens = &script->tokens.lens[line->first_token],
+        .payloads = &script->tokens.payloads[line->first_payload],
+        .count = line->token_count,
+        .capacity = line->token_count,
+    };
+}
+
+// Token k of the line, its payload is the payload'th of the line.
+static Token line_token(TokenBuffer *tokens, size_t k, size_t payload)
+{
+    Token token = {
+        .type = token_type(tokens->types[k]),
+        .start = tokens->text + tokens->offsets[k],
+        .len = (int)tokens->lens[k],
+    };
+    if (token.type == TOKEN_IDENTIFIER) {
+        token.hash = tokens->payloads[payload].name.hash;
+        token.builtin = tokens->payloads[payload].name.builtin;
+    }
+
+    return token;
+}
+
+static bool is_barrier(Token token)
+{
+    if (token.type == TOKEN_EXIT) return true;
+
+    return token.type == TOKEN_IDENTIFIER && (token.builtin == BUILTIN_IMPORT || token.builtin == BUILTIN_EXPORT);
+}
+
+// payload is the '$' token's, a '(' has none so 'drop' has the one before.
+static bool is_drop(TokenBuffer *tokens, size_t dollar, size_t payload)
+{
+    if (dollar < 2 || tokens->types[dollar - 1] != TOKEN_LEFT_PAREN) return false;
+
+    return line_token(tokens, dollar - 2, payload - 1).builtin == BUILTIN_DROP;
+}
+
+static ScriptWrite* find_write(Script *script, ScriptLine *line, String name)
+{
+    for (size_t i = line->first_write; i < line->first_write + line->write_count; i++) {
+        if (string_compare(&script->writes.items[i].name, &name)) return &script->writes.items[i];
+    }
+
+    return NULL;
+}
+
+static bool has_read(Script *script, ScriptLine *line, String name)
+{
+    for (size_t i = line->first_read; i < line->first_read + line->read_count; i++) {
+        if (string_compare(&script->reads.items[i].name, &name)) return true;
+    }
+
+    return false;
+}
+
+static long last_writer(Script *script, String name)
+{
+    size_t *writer = map_get_ptr(&script->writers, name);
+
+    return writer ? (long)*writer : -1;
+}
+
+static void add_dependent(Script *script, size_t from, size_t to)
+{
+    list_push(&script->edges, ((ScriptEdge){.to = to, .next = script->lines[from].dependents}));
+    script->lines[from].dependents = (long)script->edges.count - 1;
+}
+
+static void add_edge(Script *script, size_t from, size_t to)
+{
+    add_dependent(script, from, to);
+    script->lines[to].pending++;
+}
+
+// Collects what each line reads and writes and adds an edge from every line
+// that has to run before it.
+static void analyze(Script *script, const char **text)
+{
+    long last_barrier = -1;
+
+    for (size_t i = 0; i < script->count; i++) {
+        ScriptLine *line = &script->lines[i];
+        line->text = text[i];
+        line->first_token = script->tokens.count;
+        line->first_payload = script->tokens.payload_count;
+        line->tokenized = tokenize(text[i], &script->tokens, NULL);
+        if (!line->tokenized) {
+            script->tokens.count = line->first_token;
+            script->tokens.payload_count = line->first_payload;
+        }
+        line->token_count = script->tokens.count - line->first_token;
+        TokenBuffer tokens = line_tokens(script, line);
+        line->first_read = script->reads.count;
+        line->first_write = script->writes.count;
+        line->dependents = -1;
+
+        // Only the types are scanned, the payloads are counted along to
+        // find the names.
+        for (size_t k = 0, payload = 0; k < tokens.count; k++) {
+            Token token = line_token(&tokens, k, payload);
+            size_t next_payload = payload + token_has_payload(token.type);
+            bool named = k + 1 < tokens.count && tokens.types[k + 1] == TOKEN_IDENTIFIER;
+            String name = named ? token_name(line_token(&tokens, k + 1, next_payload)) : (String){0};
+
+            if (token.type == TOKEN_LET && named && !find_write(script, line, name)) {
+                list_push(&script->writes, ((ScriptWrite){.name = name, .present = false, .prev = -1}));
+                line->write_count++;
+            }
+            else if (token.type == TOKEN_DOLLAR && named) {
+                if (!has_read(script, line, name)) {
+                    list_push(&script->reads, ((ScriptRead){.name = name, .writer = -1}));
+                    line->read_count++;
+                }
+                if (is_drop(&tokens, k, payload)) {
+                    ScriptWrite *write = find_write(script, line, name);
+                    if (write) write->dropped = true;
+                    else {
+                        list_push(&script->writes, ((ScriptWrite){.name = name, .dropped = true, .prev = -1}));
+                        line->write_count++;
+                    }
+                }
+            }
+            else if (token.type == TOKEN_ANS) {
+                line->reads_ans = true;
+            }
+            else if (is_barrier(token)) {
+                line->barrier = true;
+            }
+            payload = next_payload;
+        }
+
+        for (size_t r = line->first_read; r < line->first_read + line->read_count; r++) {
+            ScriptRead *read = &script->reads.items[r];
+            read->writer = last_writer(script, read->name);
+            if (read->writer >= 0) add_edge(script, read->writer, i);
+        }
+        if (line->reads_ans && i > 0) add_edge(script, i - 1, i);
+
+        if (line->barrier) {
+            for (size_t j = last_barrier < 0 ? 0 : (size_t)last_barrier; j < i; j++) {
+                add_edge(script, j, i);
+            }
+            last_barrier = (long)i;
+        }
+        else if (last_barrier >= 0) {
+            add_edge(script, last_barrier, i);
+        }
+
+        for (size_t w = line->first_write; w < line->first_write + line->write_count; w++) {
+            ScriptWrite *write = &script->writes.items[w];
+            write->prev = last_writer(script, write->name);
+            map_set(&script->writers, write->name, i);
+        }
+    }
+}
+
+static void wait_on(Script *script, size_t line, size_t waiting)
+{
+    add_dependent(script, line, waiting);
+    script->lines[waiting].pending = 1;
+}
+
+// Finds the values line i sees for its variables and 'ans'. A let that failed
+// leaves the variable alone, so the search walks back to the write before it.
+// Returns false if that needs a line that hasn't finished, i is requeued once
+// it has.
+static bool bind(Script *script, size_t i, BindingList *bindings, Value **ans)
+{
+    ScriptLine *line = &script->lines[i];
+
+    list_clear(bindings);
+    for (size_t r = line->first_read; r < line->first_read + line->read_count; r++) {
+        String name = script->reads.items[r].name;
+
+        for (long c = script->reads.items[r].writer; c >= 0;) {
+            if (!script->lines[c].done) {
+                wait_on(script, c, i);
+                return false;
+            }
+            ScriptWrite *write = find_write(script, &script->lines[c], name);
+            if (write->present) {
+                list_push(bindings, ((Binding){.name = name, .value = &write->value}));
+                break;
+            }
+            // The variable was injected if it existed, so it's gone for good.
+            if (write->dropped) break;
+            c = write->prev;
+        }
+    }
+
+    *ans = NULL;
+    for (size_t j = i; line->reads_ans && j-- > 0;) {
+        if (!script->lines[j].done) {
+            wait_on(script, j, i);
+            return false;
+        }
+        if (!script->results[j].error) {
+            *ans = &script->results[j].value;
+            break;
+        }
+    }
+
+    return true;
+}
+
+static PoolResult run_line(Script *script, Worker *worker, ScriptLine *line, BindingList *bindings, Value *ans)
+{
+    Parser *parser = &worker->parser;
+
+    pool_worker_reset(worker);
+    if (!line->tokenized) return pool_error(tokenize_failed);
+
+    for (size_t b = 0; b < bindings->count; b++) {
+        declare_var(parser, bindings->items[b].name, NULL, *bindings->items[b].value);
+    }
+    if (ans) set_ans(parser, *ans);
+
+    TokenBuffer list = line_tokens(script, line);
+    TokenStream tokens = token_stream_list(&list);
+    PoolResult result = pool_worker_run(worker, &tokens);
+
+    for (size_t w = line->first_write; w < line->first_write + line->write_count; w++) {
+        ScriptWrite *write = &script->writes.items[w];
+        Value *value = vars_get(&parser->vars, write->name, NULL);
+        write->present = value != NULL;
+        if (value) write->value = value_retain(*value);
+    }
+
+    return result;
+}
+
+static void finish(Script *script, size_t i, PoolResult result, bool exited)
+{
+    ScriptLine *line = &script->lines[i];
+
+    script->results[i] = result;
+    line->done = true;
+    script->remaining--;
+
+    if (exited) {
+        // Everything after 'exit' waits on it and never runs.
+        script->produced = i;
+        script->remaining -= script->count - i - 1;
+    }
+    else {
+        for (long e = line->dependents; e >= 0; e = script->edges.items[e].next) {
+            size_t next = script->edges.items[e].to;
+            if (--script->lines[next].pending == 0) list_push(&script->ready, next);
+        }
+    }
+
+    pthread_cond_broadcast(&script->wake);
+}
+
+static void script_job(Worker *worker, void *context)
+{
+    Script *script = context;
+    BindingList bindings = {0};
+
+    pthread_mutex_lock(&script->lock);
+    while (script->remaining > 0) {
+        if (script->ready_head == script->ready.count) {
+            pthread_cond_wait(&script->wake, &script->lock);
+            continue;
+        }
+
+        size_t i = script->ready.items[script->ready_head++];
+        Value *ans = NULL;
+        if (!bind(script, i, &bindings, &ans)) continue;
+        pthread_mutex_unlock(&script->lock);
+
+        PoolResult result = run_line(script, worker, &script->lines[i], &bindings, ans);
+        bool exited = worker->parser.exit;
+
+        pthread_mutex_lock(&script->lock);
+        finish(script, i, result, exited);
+    }
+    pthread_mutex_unlock(&script->lock);
+
+    list_free(&bindings);
+}
+
+size_t script_run(Pool *pool, const char **lines, size_t count, PoolResult *results)
+{
+    if (count == 0) return 0;
+
+    Script script = {
+        .lines = calloc(count, sizeof(ScriptLine)),
+        .results = results,
+        .count = count,
+        .writers = map_new(),
+        .remaining = count,
+        .produced = count,
+    };
+    pthread_mutex_init(&script.lock, NULL);
+    pthread_cond_init(&script.wake, NULL);
+
+    analyze(&script, lines);
+    for (size_t i = 0; i < count; i++) {
+        if (script.lines[i].pending == 0) list_push(&script.ready, i);
+    }
+
+    pool_run(pool, script_job, &script);
+
+    // The result of 'exit' itself isn't shown.
+    if (script.produced < count) pool_results_free(&results[script.produced], 1);
+
+    for (size_t w = 0; w < script.writes.count; w++) {
+        ScriptWrite *write = &script.writes.items[w];
+        if (write->present) value_release(&write->value);
+    }
+    list_free(&script.ready);
+    list_free(&script.edges);
+    list_free(&script.writes);
+    list_free(&script.reads);
+    token_buffer_free(&script.tokens);
+    map_delete(&script.writers);
+    pthread_cond_destroy(&script.wake);
+    pthread_mutex_destroy(&script.lock);
+    free(script.lines);
+
+    return script.produced;
+}
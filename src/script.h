@@ -0,0 +1,10 @@
+#pragma once
+
+#include "pool.h"
+#include <stddef.h>
+
+// Runs a script line by line on the pool with the results of a sequential run.
+// Lines only wait for the lines whose variables or 'ans' they read, file
+// access and 'exit' are ordered against everything. Returns how many results
+// were produced, lines after 'exit' don't run.
+size_t script_run(Pool *pool, const char **lines, size_t count, PoolResult *results);
@@ -1,4 +1,21 @@
 #include "test.h"
+#include "batch.h"
+#include "expr.h"
+#include "intern.h"
+#include "lexer.h"
+#include "list.h"
+#include "map.h"
+#include "number.h"
+#include "parser.h"
+#include "pool.h"
+#include "script.h"
+#include "value.h"
+#include "vars.h"
+#include "vm.h"
+#include <math.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
 #include <time.h>
 #include <stdlib.h>
 
@@ -16,3 +33,985 @@ bool get_random_str(char *buff, size_t len)
 
     return true;
 }
+
+static const char* stress_lines[] = {
+    "let a = 3",
+    "let b = $a * 4 + 1",
+    "sqrt($b) + sin($a)",
+    "ans * 2",
+    "$a < $b && !($a == $b)",
+    "atan2($a, $b) ^ 2",
+    "$nope + 1",
+    "1 +",
+    "@",
+    "let c = $b / 0",
+    "-$c",
+    "(1 + 2) * 3 - 4 / 5 + pi",
+    "let a = $a + 1",
+    "let s = \"con\" + \"cat\"",
+    "$s + \" \" + $s + ans",
+};
+
+enum { stress_line_count = array_len(stress_lines), stress_result_len = 128 };
+
+typedef struct {
+    int iterations;
+    int failures;
+    char expected[stress_line_count][stress_result_len];
+} StressContext;
+
+// Runs every line once, alternating the tree walker and the VM so both are
+// exercised, and records what each line printed.
+static void stress_run(Parser *parser, TokenBuffer *list, Expr *expr, Chunk *chunk, bool use_vm,
+                       char results[][stress_result_len])
+{
+    for (size_t i = 0; i < stress_line_count; i++) {
+        Value result = VAL_NUM(0.0);
+        token_buffer_clear(list);
+
+        if (tokenize(stress_lines[i], list, &parser->logging) && parser_compile(parser, list, expr)) {
+            if (use_vm && chunk_compile(expr, chunk)) result = vm_run(parser, chunk);
+            else result = parser_eval(parser, expr);
+        }
+        else {
+            parser->error = true;
+        }
+
+        if (parser->error) snprintf(results[i], stress_result_len, "error");
+        else value_to_str(results[i], stress_result_len, &result);
+    }
+}
+
+static void* stress_thread(void *arg)
+{
+    StressContext *context = arg;
+    TokenBuffer list = {0};
+    Expr expr = expr_new();
+    Chunk chunk = chunk_new();
+    char results[stress_line_count][stress_result_len];
+
+    for (int it = 0; it < context->iterations; it++) {
+        Parser parser = parser_create();
+        stress_run(&parser, &list, &expr, &chunk, it % 2 == 0, results);
+        parser_destroy(&parser);
+
+        for (size_t i = 0; i < stress_line_count; i++) {
+            if (strcmp(results[i], context->expected[i]) != 0) {
+                __atomic_add_fetch(&context->failures, 1, __ATOMIC_RELAXED);
+            }
+        }
+    }
+
+    chunk_destroy(&chunk);
+    expr_destroy(&expr);
+    token_buffer_free(&list);
+
+    return NULL;
+}
+
+// Every thread runs the same script on its own Parser. With no state shared
+// between parsers they must all print exactly what a single thread does.
+bool stress_test(int thread_count, int iterations)
+{
+    StressContext context = {.iterations = iterations, .failures = 0};
+    TokenBuffer list = {0};
+    Expr expr = expr_new();
+    Chunk chunk = chunk_new();
+    Parser parser = parser_create();
+
+    stress_run(&parser, &list, &expr, &chunk, false, context.expected);
+
+    parser_destroy(&parser);
+    chunk_destroy(&chunk);
+    expr_destroy(&expr);
+    token_buffer_free(&list);
+
+    pthread_t *threads = malloc(sizeof(pthread_t) * thread_count);
+    for (int i = 0; i < thread_count; i++) {
+        pthread_create(&threads[i], NULL, stress_thread, &context);
+    }
+    for (int i = 0; i < thread_count; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    free(threads);
+
+    return context.failures == 0;
+}
+
+// Folding must not change what a line prints. An operand is only dropped
+// when it can't fail, and ans can hold any type.
+static const char* optimize_cases[][3] = {
+    {"\"s\"", "false && (ans < 1)", "error"},
+    {"\"s\"", "false && !ans", "error"},
+    {"2", "false && (ans < 1)", "false"},
+    {"2", "true || $nope", "error"},
+    {"2", "true || -\"s\" == 1", "error"},
+    {"2", "false && (1 < 2)", "false"},
+    {"2", "true || sqrt(2) > 1", "true"},
+    {"2", "ans * 1 + 0", "2.000000000000000"},
+};
+
+// Each case runs its first line, then the second on both the VM and the
+// tree walker.
+bool optimize_test(void)
+{
+    char result[stress_result_len];
+    Expr expr = expr_new();
+    Chunk chunk = chunk_new();
+    Parser parser = parser_create();
+    bool ok = true;
+
+    for (size_t i = 0; i < array_len(optimize_cases) * 2 && ok; i++) {
+        const char **lines = optimize_cases[i / 2];
+        bool use_vm = i % 2 == 0;
+        TokenStream tokens = token_stream_new(lines[0], &parser.logging);
+        ok = parser_compile_stream(&parser, &tokens, &expr) && (parser_eval(&parser, &expr), !parser.error);
+
+        tokens = token_stream_new(lines[1], &parser.logging);
+        Value value = VAL_NUM(0.0);
+        if (ok && parser_compile_stream(&parser, &tokens, &expr)) {
+            if (use_vm && chunk_compile(&expr, &chunk)) value = vm_run(&parser, &chunk);
+            else value = parser_eval(&parser, &expr);
+        }
+        if (parser.error) snprintf(result, sizeof(result), "error");
+        else value_to_str(result, sizeof(result), &value);
+
+        ok = ok && strcmp(result, lines[2]) == 0;
+        if (!ok) fprintf(stderr, "'%s' after '%s' printed %s on the %s\n", lines[1], lines[0], result, use_vm ? "VM" : "tree walker");
+    }
+
+    parser_destroy(&parser);
+    chunk_destroy(&chunk);
+    expr_destroy(&expr);
+
+    return ok;
+}
+
+static const char* pool_lines[] = {
+    "1 + 2 * 3",
+    "sqrt(16) + sin(0)",
+    "\"con\" + \"cat\"",
+    "1 +",
+    "let x = 3",
+    "$x",
+    "2 ^ 10 > 1000 && !false",
+    "atan2(1, 2)",
+};
+
+// Results from the pool must come back in input order and match what a single
+// worker produces, however the lines were split and stolen.
+bool pool_test(int thread_count, size_t line_count)
+{
+    const char **lines = malloc(sizeof(char*) * line_count);
+    PoolResult *expected = malloc(sizeof(PoolResult) * line_count);
+    PoolResult *results = malloc(sizeof(PoolResult) * line_count);
+    for (size_t i = 0; i < line_count; i++) {
+        lines[i] = pool_lines[rand() % array_len(pool_lines)];
+    }
+
+    Pool *pool = pool_create(1);
+    pool_eval(pool, lines, line_count, expected);
+    pool_destroy(pool);
+
+    pool = pool_create(thread_count);
+    pool_eval(pool, lines, line_count, results);
+    pool_destroy(pool);
+
+    size_t failures = 0;
+    for (size_t i = 0; i < line_count; i++) {
+        char one[stress_result_len], two[stress_result_len];
+        value_to_str(one, sizeof(one), &expected[i].value);
+        value_to_str(two, sizeof(two), &results[i].value);
+        if (expected[i].error != results[i].error || strcmp(one, two) != 0) failures++;
+    }
+
+    pool_results_free(results, line_count);
+    pool_results_free(expected, line_count);
+    free(results);
+    free(expected);
+    free(lines);
+
+    return failures == 0;
+}
+
+static const char* script_lines[] = {
+    "let a = $b + 1",
+    "let b = $c * 2 - $a",
+    "let c = ans + 1",
+    "$a + $b * $c",
+    "ans * 2",
+    "let d = $d + true",
+    "let d = $a > 1",
+    "$d && true",
+    "let d = \"str\"",
+    "$d + \"!\"",
+    "let d = $d + \"!\"",
+    "let e = (let a = 2) + $d",
+    "sqrt($e * $e) > $a",
+    "1 +",
+    "let c = $c / 3",
+    "drop($e)",
+    "let e = $a * 2",
+};
+
+// A script run on the pool must print what running it line by line prints.
+bool script_test(int thread_count, size_t line_count)
+{
+    const char **lines = malloc(sizeof(char*) * line_count);
+    PoolResult *results = malloc(sizeof(PoolResult) * line_count);
+    const char *prelude[] = {"let a = 1", "let b = 2", "let c = 3", "let d = 4", "let e = 5"};
+    for (size_t i = 0; i < line_count; i++) {
+        lines[i] = i < array_len(prelude) ? prelude[i] : script_lines[rand() % array_len(script_lines)];
+    }
+
+    Pool *pool = pool_create(thread_count);
+    size_t produced = script_run(pool, lines, line_count, results);
+    pool_destroy(pool);
+
+    TokenBuffer list = {0};
+    Expr expr = expr_new();
+    Chunk chunk = chunk_new();
+    Parser parser = parser_create();
+    size_t failures = produced == line_count ? 0 : 1;
+
+    for (size_t i = 0; i < produced; i++) {
+        Value result = VAL_NUM(0.0);
+        token_buffer_clear(&list);
+        if (tokenize(lines[i], &list, &parser.logging) && parser_compile(&parser, &list, &expr)) {
+            if (chunk_compile(&expr, &chunk)) result = vm_run(&parser, &chunk);
+            else result = parser_eval(&parser, &expr);
+        }
+        else {
+            parser.error = true;
+        }
+
+        char one[stress_result_len], two[stress_result_len];
+        value_to_str(one, sizeof(one), &result);
+        value_to_str(two, sizeof(two), &results[i].value);
+        if (parser.error != results[i].error || (!parser.error && strcmp(one, two) != 0)) failures++;
+    }
+
+    parser_destroy(&parser);
+    chunk_destroy(&chunk);
+    expr_destroy(&expr);
+    token_buffer_free(&list);
+    pool_results_free(results, produced);
+    free(results);
+    free(lines);
+
+    return failures == 0;
+}
+
+// Temporaries are dropped after every evaluation, so a session repeating the
+// same string work must not keep growing its scratch arena.
+bool scratch_test(int iterations)
+{
+    const char *lines[] = {
+        "let s = \"scratch\"",
+        "let s = $s + \" \" + $s",
+        "let s = \"scratch\"",
+        "ans + $s + ans",
+        "let t = $s",
+        "$t",
+    };
+    TokenBuffer list = {0};
+    Expr expr = expr_new();
+    Parser parser = parser_create();
+    size_t first = 0;
+    bool ok = true;
+
+    for (int it = 0; it < iterations && ok; it++) {
+        for (size_t i = 0; i < array_len(lines); i++) {
+            token_buffer_clear(&list);
+            ok = ok && tokenize(lines[i], &list, &parser.logging) && parser_compile(&parser, &list, &expr);
+            if (ok) parser_eval(&parser, &expr);
+            ok = ok && !parser.error;
+        }
+        if (it == 0) first = arena_high_water(&parser.scratch);
+    }
+    ok = ok && arena_high_water(&parser.scratch) == first && parser.scratch.used == 0;
+
+    // Assigning a stored string shares its buffer instead of copying it.
+    String s = {.data = "s", .len = 1}, t = {.data = "t", .len = 1};
+    ok = ok && AS_STR(*vars_get(&parser.vars, s, NULL)).data == AS_STR(*vars_get(&parser.vars, t, NULL)).data;
+    ok = ok && AS_STR(parser.ans).data == AS_STR(*vars_get(&parser.vars, t, NULL)).data;
+
+    parser_destroy(&parser);
+    expr_destroy(&expr);
+    token_buffer_free(&list);
+
+    return ok;
+}
+
+// Chains the optimizer can't fold, far longer than the C stack would allow
+// one call per node for. Compiled, run on the VM, walked by the tree
+// evaluator and printed, they must give the sum.
+bool deep_test(size_t terms)
+{
+    static const char *term[] = {"ans", "$x"};
+    char *text = malloc(terms * 6 + 1);
+    Expr expr = expr_new();
+    Chunk chunk = chunk_new();
+    Parser parser = parser_create();
+    FILE *out = tmpfile();
+    bool ok = true;
+
+    for (size_t t = 0; t < array_len(term) && ok; t++) {
+        size_t len = 0;
+        for (size_t i = 0; i < terms; i++) {
+            len += sprintf(&text[len], i ? " + %s" : "%s", term[t]);
+        }
+
+        TokenStream tokens = token_stream_new("let x = 2", &parser.logging);
+        ok = parser_compile_stream(&parser, &tokens, &expr) && AS_NUM(parser_eval(&parser, &expr)) == 2;
+        tokens = token_stream_new(text, &parser.logging);
+        ok = ok && parser_compile_stream(&parser, &tokens, &expr) && chunk_compile(&expr, &chunk);
+        if (!ok) break;
+
+        Value vm = vm_run(&parser, &chunk);
+        ok = !parser.error && AS_NUM(vm) == 2.0 * terms;
+        set_ans(&parser, VAL_NUM(2));
+        Value tree = parser_eval(&parser, &expr);
+        ok = ok && !parser.error && AS_NUM(tree) == 2.0 * terms;
+        if (out) expr_print(&expr, out);
+        if (!ok) fprintf(stderr, "A chain of %zu '%s' failed\n", terms, term[t]);
+    }
+
+    if (out) fclose(out);
+    parser_destroy(&parser);
+    chunk_destroy(&chunk);
+    expr_destroy(&expr);
+    free(text);
+
+    return ok;
+}
+
+// A multi-megabyte expression read from a file a chunk at a time, as --file
+// reads it, with a group nested just inside the depth limit. Nesting past the
+// limit must fail to parse rather than overflow the stack.
+bool file_test(size_t bytes)
+{
+    static const char term[] = "($x + 2 * 3) - 6 + ";
+    size_t terms = bytes / (sizeof(term) - 1);
+    int nested = PARSER_MAX_DEPTH - 10;
+    Expr expr = expr_new();
+    Chunk chunk = chunk_new();
+    Parser parser = parser_create();
+    FILE *f = tmpfile();
+    bool ok = f != NULL;
+
+    if (ok) {
+        for (size_t i = 0; i < terms; i++) fputs(term, f);
+        for (int i = 0; i < nested; i++) fputc('(', f);
+        fputc('1', f);
+        for (int i = 0; i < nested; i++) fputc(')', f);
+        fputc('\n', f);
+        rewind(f);
+    }
+    if (ok) {
+        TokenStream tokens = token_stream_new("let x = 1", &parser.logging);
+        ok = parser_compile_stream(&parser, &tokens, &expr) && AS_NUM(parser_eval(&parser, &expr)) == 1;
+    }
+    if (ok) {
+        TokenStream tokens = token_stream_source(lexer_source_file(f), &parser.logging);
+        ok = parser_compile_stream(&parser, &tokens, &expr) && !token_stream_failed(&tokens);
+        // Too many constants for the VM, so --file falls back to the tree
+        // evaluator like this.
+        if (ok) {
+            Value result = chunk_compile(&expr, &chunk) ? vm_run(&parser, &chunk) : parser_eval(&parser, &expr);
+            ok = !parser.error && AS_NUM(result) == terms + 1.0;
+        }
+        token_stream_free(&tokens);
+        if (!ok) fprintf(stderr, "A %zu byte file failed to evaluate\n", bytes);
+    }
+    if (f) fclose(f);
+
+    // Lines read as the REPL reads them. A lexer error early in a line far
+    // longer than the lexer's window fails the whole line, none of its tail
+    // may run as the next one.
+    f = tmpfile();
+    ok = ok && f != NULL;
+    if (ok) {
+        const char *heads[] = {"1 & 2 ", "& "};
+        for (size_t h = 0; h < array_len(heads); h++) {
+            fputs(heads[h], f);
+            for (int i = 0; i < 3000; i++) fputs("+ 1 ", f);
+            fputs("\n1 + 1\n", f);
+        }
+        rewind(f);
+
+        LineReader reader = {.file = f};
+        for (size_t line = 0; line < 4 && ok; line++) {
+            reader.line_done = false;
+            TokenStream tokens = token_stream_source(lexer_source_line(&reader), &parser.logging);
+            bool compiled = parser_compile_stream(&parser, &tokens, &expr);
+            if (line % 2 == 0) ok = token_stream_failed(&tokens);
+            else ok = compiled && AS_NUM(parser_eval(&parser, &expr)) == 2 && !parser.error;
+            token_stream_free(&tokens);
+            if (!ok) fprintf(stderr, "Line %zu after a long failed line gave the wrong result\n", line);
+        }
+        ok = ok && getc(f) == EOF;
+    }
+    if (f) fclose(f);
+
+    // Each nesting is too deep: parentheses, unary operators and both mixed.
+    static const char *deep[] = {"(", "!", "-("};
+    for (size_t d = 0; d < array_len(deep) && ok; d++) {
+        size_t count = 100000, len = strlen(deep[d]);
+        char *text = malloc(count * (len + 1) + 2);
+        size_t at = 0;
+        for (size_t i = 0; i < count; i++, at += len) memcpy(&text[at], deep[d], len);
+        text[at++] = '1';
+        if (strchr(deep[d], '(')) {
+            memset(&text[at], ')', count);
+            at += count;
+        }
+        text[at] = '\0';
+
+        TokenStream tokens = token_stream_new(text, &parser.logging);
+        ok = !parser_compile_stream(&parser, &tokens, &expr) && parser.error;
+        if (!ok) fprintf(stderr, "Nesting '%s' %zu deep wasn't rejected\n", deep[d], count);
+        free(text);
+    }
+
+    parser_destroy(&parser);
+    chunk_destroy(&chunk);
+    expr_destroy(&expr);
+
+    return ok;
+}
+
+// Every kernel set must give what the VM gives row by row. The row count is
+// neither a multiple of the block nor of a vector, so the tails are covered.
+bool batch_test(size_t rows)
+{
+    static const char *formulas[] = {
+        "$a * 2 + $b / 4 - 1.5",
+        "-$a ^ 2 + atan2($a, $b) * sqrt(4)",
+        "sin($a) + floor($b) - exp(-$a) + pi",
+        "$a < $b && !($a == $b) || $a >= 1",
+        "!($a <= $b) == ($a > $b) && $b != 0",
+        "($a != $b || false) && (true || $a > 0)",
+    };
+    static const BatchIsa isas[] = {BATCH_SCALAR, BATCH_SSE2, BATCH_AVX2};
+    double *a = malloc(sizeof(double) * rows);
+    double *b = malloc(sizeof(double) * rows);
+    double *out = malloc(sizeof(double) * rows);
+    String name_a = {.data = "a", .len = 1}, name_b = {.data = "b", .len = 1};
+    Column columns[] = {{.name = name_a, .data = a}, {.name = name_b, .data = b}};
+    Parser parser = parser_create();
+    Expr expr = expr_new();
+    Chunk chunk = chunk_new();
+    bool ok = true;
+
+    // Few distinct values, so the comparisons come out both ways.
+    for (size_t i = 0; i < rows; i++) {
+        a[i] = (rand() % 13 - 6) * 0.5;
+        b[i] = (rand() % 13 - 6) * 0.5;
+    }
+
+    for (size_t f = 0; f < array_len(formulas) && ok; f++) {
+        TokenStream tokens = token_stream_new(formulas[f], &parser.logging);
+        ok = parser_compile_stream(&parser, &tokens, &expr) && chunk_compile(&expr, &chunk);
+
+        for (size_t k = 0; k < array_len(isas) && ok; k++) {
+            ok = batch_eval_isa(&parser, &chunk, columns, array_len(columns), rows, out, isas[k]);
+            for (size_t i = 0; i < rows && ok; i++) {
+                declare_var(&parser, name_a, NULL, VAL_NUM(a[i]));
+                declare_var(&parser, name_b, NULL, VAL_NUM(b[i]));
+                Value result = vm_run(&parser, &chunk);
+                double expected = VALUE_TYPE(result) == VALUE_BOOL ? AS_BOOL(result) : (double)AS_NUM(result);
+                // The kernels work in double, the VM in Number.
+                ok = (isnan(out[i]) && isnan(expected)) || fabs(out[i] - expected) <= 1e-9 * (1 + fabs(expected));
+                if (!ok) {
+                    fprintf(stderr, "'%s' on %s, row %zu: %g, the VM gives %g\n",
+                            formulas[f], batch_isa_name(isas[k]), i, out[i], expected);
+                }
+            }
+        }
+    }
+
+    chunk_destroy(&chunk);
+    expr_destroy(&expr);
+    parser_destroy(&parser);
+    free(out);
+    free(b);
+    free(a);
+
+    return ok;
+}
+
+// String literals are owned by the Expr and the Chunk rather than interned,
+// so a chunk must still run after its text and Expr are gone.
+bool string_test(void)
+{
+    static const char *formulas[][2] = {
+        {"'literal'", "literal"},
+        {"'lit' + 'eral'", "literal"},     // Folded into a new constant
+        {"'lit' + ('' + 'eral')", "literal"},
+    };
+    Parser parser = parser_create();
+    Chunk chunk = chunk_new();
+    bool ok = true;
+
+    for (size_t f = 0; f < array_len(formulas) && ok; f++) {
+        char *text = strdup(formulas[f][0]);
+        Expr expr = expr_new();
+        TokenStream tokens = token_stream_new(text, &parser.logging);
+        ok = parser_compile_stream(&parser, &tokens, &expr) && chunk_compile(&expr, &chunk);
+        expr_destroy(&expr);
+        free(text);
+        if (!ok) break;
+
+        Value result = vm_run(&parser, &chunk);
+        String expected = {.data = (char*)formulas[f][1], .len = strlen(formulas[f][1])};
+        ok = !parser.error && VALUE_TYPE(result) == VALUE_STR && string_compare(&AS_STR(result), &expected);
+    }
+
+    chunk_destroy(&chunk);
+    parser_destroy(&parser);
+
+    return ok;
+}
+
+// Declaring, reading, missing and dropping many distinct names must leave the
+// intern table as it was once nothing refers to them any more.
+bool intern_test(size_t name_count)
+{
+    static const char *lines[] = {"let n%zu = %zu", "$n%zu + 1", "$miss%zu", "drop($n%zu)", "let n = $n%zu"};
+    char text[64];
+    Expr expr = expr_new();
+    Chunk chunk = chunk_new();
+    Parser parser = parser_create();
+    size_t before = intern_count();
+
+    for (size_t i = 0; i < name_count; i++) {
+        for (size_t l = 0; l < array_len(lines); l++) {
+            snprintf(text, sizeof(text), lines[l], i, i);
+            TokenStream tokens = token_stream_new(text, &parser.logging);
+            if (!parser_compile_stream(&parser, &tokens, &expr)) continue;
+            if (i % 2 && chunk_compile(&expr, &chunk)) vm_run(&parser, &chunk);
+            else parser_eval(&parser, &expr);
+        }
+    }
+    // Only the compiled names and 'n' are still held, a handful at most.
+    bool ok = intern_count() <= before + array_len(lines) * 2;
+
+    parser_destroy(&parser);
+    chunk_destroy(&chunk);
+    expr_destroy(&expr);
+    ok = ok && intern_count() == before;
+
+    return ok;
+}
+
+// Random sets and removes checked against a plain array while the table
+// resizes underneath, every key must be found with its latest value until
+// it's removed.
+bool map_test(size_t key_count)
+{
+    enum { key_len = 24 };
+    char *keys = malloc(key_count * key_len);
+    long *values = malloc(sizeof(long) * key_count);  // -1 when absent
+    Map map = map_new();
+    bool ok = true;
+
+    for (size_t i = 0; i < key_count; i++) {
+        snprintf(&keys[i * key_len], key_len, "k%zu", i);
+        values[i] = -1;
+    }
+
+    for (size_t op = 0; op < key_count * 4; op++) {
+        // Mostly recent keys so removes often hit entries that were just moved.
+        size_t i = (size_t)rand() % (op / 4 + 1);
+        String key = {.data = &keys[i * key_len], .len = strlen(&keys[i * key_len])};
+
+        if (rand() % 3 == 0) {
+            ok = ok && map_remove(&map, key, NULL) == (values[i] != -1);
+            values[i] = -1;
+        }
+        else {
+            bool inserted;
+            Map_Node *node = map_entry(&map, key, &inserted);
+            ok = ok && inserted == (values[i] == -1);
+            node->value = op;
+            values[i] = (long)op;
+        }
+    }
+
+    size_t live = 0, expected_live = 0, iter = 0;
+    for (Map_Node *node = map_next(&map, &iter); node; node = map_next(&map, &iter)) {
+        size_t i = strtoul(node->key.data + 1, NULL, 10);
+        ok = ok && (long)node->value == values[i];
+        live++;
+    }
+    for (size_t i = 0; i < key_count; i++) {
+        String key = {.data = &keys[i * key_len], .len = strlen(&keys[i * key_len])};
+        ok = ok && map_has(&map, key) == (values[i] != -1);
+        if (values[i] != -1) expected_live++;
+    }
+    ok = ok && live == map.count && live == expected_live;
+
+    map_delete(&map);
+    free(values);
+    free(keys);
+
+    return ok;
+}
+
+// Cached refs must follow sets, removes and clears: every name is read
+// through its ref after each random operation and checked against a plain
+// array, so a stale ref pointing at a freed or reused slot is caught.
+bool vars_test(size_t op_count)
+{
+    enum { name_count = 64, name_len = 16 };
+    char names[name_count][name_len];
+    VarRef refs[name_count] = {0};
+    long values[name_count];  // -1 when absent
+    Vars vars = vars_new();
+    bool ok = true;
+
+    for (size_t i = 0; i < name_count; i++) {
+        snprintf(names[i], name_len, "v%zu", i);
+        values[i] = -1;
+    }
+
+    for (size_t op = 0; op < op_count && ok; op++) {
+        size_t i = (size_t)rand() % name_count;
+        String name = {.data = names[i], .len = strlen(names[i])};
+        int kind = rand() % 100;
+
+        if (kind == 0) {
+            vars_clear(&vars);
+            for (size_t j = 0; j < name_count; j++) values[j] = -1;
+        }
+        else if (kind < 40) {
+            ok = vars_remove(&vars, name) == (values[i] != -1);
+            values[i] = -1;
+        }
+        else {
+            vars_set(&vars, name, &refs[i], VAL_NUM(op));
+            values[i] = (long)op;
+        }
+
+        for (size_t j = 0; j < name_count && ok; j++) {
+            String other = {.data = names[j], .len = strlen(names[j])};
+            Value *value = vars_get(&vars, other, &refs[j]);
+            ok = values[j] == -1 ? value == NULL : value && AS_NUM(*value) == values[j];
+        }
+    }
+    ok = ok && vars.index.count == vars.count;
+
+    vars_delete(&vars);
+
+    return ok;
+}
+
+static int64_t random_operand(void)
+{
+    int64_t small = rand() % 2001 - 1000;
+    switch (rand() % 4) {
+        case 0:  return small;
+        case 1:  return (int64_t)rand() * (rand() % 2 ? 1 : -1);
+        case 2:  return ((int64_t)1 << 47) + small;
+        default: return rand() % 2 ? INT64_MAX - llabs(small) : INT64_MIN + llabs(small);
+    }
+}
+
+// Integer arithmetic must be exact while the result fits and promote to
+// Number when it doesn't. Results are checked against 128 bit arithmetic.
+bool number_test(size_t op_count)
+{
+    bool ok = true;
+
+    for (size_t op = 0; op < op_count && ok; op++) {
+        int64_t x = random_operand();
+        int64_t y = random_operand();
+        Value a = VAL_INT(x);
+        Value b = VAL_INT(y);
+        Value result;
+        __int128 expected;
+
+        switch (op % 3) {
+            case 0:  result = num_add(a, b); expected = (__int128)x + y; break;
+            case 1:  result = num_sub(a, b); expected = (__int128)x - y; break;
+            default: result = num_mul(a, b); expected = (__int128)x * y; break;
+        }
+
+        bool fits = expected >= INT64_MIN && expected <= INT64_MAX;
+        if (IS_INT(result)) {
+            ok = fits && AS_INT(result) == (int64_t)expected;
+        }
+        else {
+            // Operands past the encoding's integers were rounded too.
+            long double scale = op % 3 == 2 ? fabsl((long double)expected) : fabsl((long double)x) + fabsl((long double)y);
+            ok = fabsl(AS_LONG_DOUBLE(result) - (long double)expected) <= 1e-15L * (1 + scale);
+            // Integer operands whose result fits stay integers, as far as the
+            // encoding can hold them.
+            if (fits && IS_INT(a) && IS_INT(b)) ok = ok && !IS_INT(VAL_INT((int64_t)expected));
+        }
+    }
+
+    return ok;
+}
+
+static size_t random_digits(char *out, size_t max)
+{
+    size_t len = 1 + (size_t)rand() % max;
+    for (size_t i = 0; i < len; i++) out[i] = '0' + rand() % 10;
+
+    return len;
+}
+
+// Literals parsed by the lexer must match the C library's parse bit for bit,
+// whether they take the fast path or not.
+bool literal_test(size_t literal_count)
+{
+    char text[128];
+    TokenBuffer tokens = {0};
+    bool ok = true;
+
+    for (size_t n = 0; n < literal_count && ok; n++) {
+        size_t len = random_digits(text, 24);
+        if (rand() % 2) {
+            text[len++] = '.';
+            len += random_digits(&text[len], 24);
+        }
+        if (rand() % 3 == 0) {
+            len += (size_t)sprintf(&text[len], "e%d", rand() % 700 - 350);
+        }
+        text[len] = '\0';
+
+        token_buffer_clear(&tokens);
+        ok = tokenize(text, &tokens, NULL) && tokens.count == 2;
+        if (!ok) break;
+
+        TokenStream stream = token_stream_list(&tokens);
+        Token token = token_stream_next(&stream);
+        ok = token.type == TOKEN_NUM;
+        if (!ok) break;
+        if (token.is_int) ok = !strpbrk(text, ".e") && (long double)token.integer == strtold(text, NULL);
+        else ok = token.num == NUM_PARSE(text, NULL);
+        if (!ok) fprintf(stderr, "Literal %s parsed as %.21Lg\n", text, token.is_int ? (long double)token.integer : (long double)token.num);
+    }
+
+    token_buffer_free(&tokens);
+
+    return ok;
+}
+
+typedef struct {
+    TokenType type;
+    size_t start;
+    size_t len;
+} ExpectedToken;
+
+LIST_DEF(ExpectedTokenList, ExpectedToken);
+
+// Appends a random token to text and returns what the lexer should make of
+// it. Names are often one letter off a keyword.
+static ExpectedToken random_token(char *text, size_t *len)
+{
+    static const char *operators[] = {"+", "-", "*", "/", "^", "(", ")", ",", "$", "=", "==", "!", "!=",
+                                      "<", "<=", ">", ">=", "&&", "||"};
+    static const TokenType operator_types[] = {
+        TOKEN_PLUS, TOKEN_MINUS, TOKEN_STAR, TOKEN_SLASH, TOKEN_CARET, TOKEN_LEFT_PAREN, TOKEN_RIGHT_PAREN,
+        TOKEN_COMMA, TOKEN_DOLLAR, TOKEN_EQUAL, TOKEN_EQEQ, TOKEN_NOT, TOKEN_NOTEQ, TOKEN_LESS, TOKEN_LESSEQ,
+        TOKEN_GREATER, TOKEN_GREATEREQ, TOKEN_AND, TOKEN_OR,
+    };
+    static const char *keywords[] = {"ans", "exit", "let", "true", "false"};
+    static const TokenType keyword_types[] = {TOKEN_ANS, TOKEN_EXIT, TOKEN_LET, TOKEN_TRUE, TOKEN_FALSE};
+    static const char alnum[] = "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789";
+
+    ExpectedToken token = {.start = *len};
+    char *out = &text[*len];
+
+    switch (rand() % 4) {
+        case 0: {
+            int k = rand() % 5;
+            token.len = strlen(keywords[k]);
+            memcpy(out, keywords[k], token.len);
+            token.type = keyword_types[k];
+            if (rand() % 2) {
+                out[rand() % token.len] = alnum[rand() % 52];
+                if (memcmp(out, keywords[k], token.len) != 0) token.type = TOKEN_IDENTIFIER;
+            }
+            if (rand() % 2) {
+                size_t extra = (size_t)rand() % 40;
+                for (size_t i = 0; i < extra; i++) out[token.len++] = alnum[rand() % 62];
+                if (extra) token.type = TOKEN_IDENTIFIER;
+            }
+            break;
+        }
+        case 1:
+            token.type = TOKEN_NUM;
+            token.len = random_digits(out, 40);
+            break;
+        case 2: {
+            char quote = rand() % 2 ? '"' : '\'';
+            size_t body = (size_t)rand() % 70;
+            out[token.len++] = quote;
+            for (size_t i = 0; i < body; i++) {
+                int r = rand() % 8;
+                if (r == 0) {
+                    out[token.len++] = '\\';
+                    out[token.len++] = rand() % 2 ? quote : '\\';
+                }
+                else out[token.len++] = r == 1 ? ' ' : alnum[rand() % 62];
+            }
+            out[token.len++] = quote;
+            token.type = TOKEN_STRING;
+            token.start++;
+            token.len -= 2;
+            break;
+        }
+        default: {
+            int k = rand() % 19;
+            token.type = operator_types[k];
+            token.len = strlen(operators[k]);
+            memcpy(out, operators[k], token.len);
+            break;
+        }
+    }
+    *len += token.len + (token.type == TOKEN_STRING ? 2 : 0);
+
+    return token;
+}
+
+LIST_DEF(TokenList, Token);
+
+// A buffer's tokens in order, decoded as the parser replays them.
+static void replay_tokens(TokenBuffer *buffer, TokenList *out)
+{
+    list_clear(out);
+    TokenStream stream = token_stream_list(buffer);
+    for (size_t i = 0; i < buffer->count; i++) {
+        list_push(out, token_stream_next(&stream));
+    }
+}
+
+// Hands out the text a few bytes at a time, so tokens straddle the chunks.
+typedef struct {
+    const char *text;
+    size_t len;
+    size_t offset;
+} ChunkReader;
+
+static size_t read_chunk(void *context, char *buffer, size_t cap)
+{
+    ChunkReader *reader = context;
+    size_t count = 1 + (size_t)rand() % 7;
+    if (count > cap) count = cap;
+    if (count > reader->len - reader->offset) count = reader->len - reader->offset;
+    memcpy(buffer, reader->text + reader->offset, count);
+    reader->offset += count;
+
+    return count;
+}
+
+// Lines of random tokens and whitespace at every alignment, the lexer must
+// find the same tokens whichever way its runs are scanned, listed up front,
+// streamed or read in chunks.
+bool lexer_test(size_t line_count)
+{
+    enum { max_tokens = 40, text_cap = max_tokens * 200 + 64 };
+    char *buffer = malloc(text_cap);
+    static const char spaces[] = " \t\n\r";
+    ExpectedTokenList expected = {0};
+    TokenBuffer tokens = {0};
+    TokenList decoded = {0};
+    bool ok = true;
+
+    // Every builtin is found by the lexer's word hash, a longer name isn't.
+    static const struct {
+        const char *text;
+        Builtin builtin;
+    } builtins[] = {
+#define X(name, text, ...) {text, BUILTIN_##name},
+        MATH_FUNCS(X)
+        SPECIAL_FUNCS(X)
+#undef X
+    };
+    for (size_t i = 0; i < array_len(builtins) && ok; i++) {
+        snprintf(buffer, text_cap, "%s %sx", builtins[i].text, builtins[i].text);
+        token_buffer_clear(&tokens);
+        ok = tokenize(buffer, &tokens, NULL);
+        replay_tokens(&tokens, &decoded);
+        ok = ok && decoded.items[0].builtin == builtins[i].builtin &&
+             decoded.items[1].type == TOKEN_IDENTIFIER && decoded.items[1].builtin == BUILTIN_NONE;
+        if (!ok) fprintf(stderr, "Builtin '%s' not recognized\n", builtins[i].text);
+    }
+
+    // Exponents, hex and escapes look past the end of their token, cut
+    // anywhere they still lex the same.
+    static const char edges[] = "1e+5 2E-3e 0x1f 0x 7e 1.5e-30 == != <= 'a\\'b' \"c\\\"\" x==y";
+    token_buffer_clear(&tokens);
+    ok = ok && tokenize(edges, &tokens, NULL);
+    replay_tokens(&tokens, &decoded);
+    for (int n = 0; n < 200 && ok; n++) {
+        ChunkReader reader = {.text = edges, .len = sizeof(edges) - 1};
+        TokenStream stream = token_stream_source((LexerSource){.read = read_chunk, .context = &reader}, NULL);
+        for (size_t t = 0; t < tokens.count && ok; t++) {
+            Token token = token_stream_next(&stream);
+            ok = token.type == decoded.items[t].type && token.len == decoded.items[t].len &&
+                 token.integer == decoded.items[t].integer;
+        }
+        token_stream_free(&stream);
+        if (!ok) fprintf(stderr, "Lexing '%s' in chunks failed\n", edges);
+    }
+
+    for (size_t n = 0; n < line_count && ok; n++) {
+        char *text = buffer + rand() % 32;
+        size_t len = 0;
+        list_clear(&expected);
+
+        size_t count = 1 + (size_t)rand() % max_tokens;
+        for (size_t t = 0; t < count; t++) {
+            size_t gap = 1 + (size_t)rand() % (rand() % 4 ? 3 : 70);
+            for (size_t i = 0; i < gap; i++) text[len++] = spaces[rand() % 4];
+            list_push(&expected, random_token(text, &len));
+        }
+        text[len] = '\0';
+
+        token_buffer_clear(&tokens);
+        ok = tokenize(text, &tokens, NULL) && tokens.count == count + 1;
+        replay_tokens(&tokens, &decoded);
+        ok = ok && decoded.items[count].type == TOKEN_END;
+        for (size_t t = 0; t < count && ok; t++) {
+            Token token = decoded.items[t];
+            ExpectedToken want = expected.items[t];
+            ok = token.type == want.type && token.start == &text[want.start] && (size_t)token.len == want.len;
+        }
+
+        // Pulled one at a time, the same tokens come out.
+        TokenStream stream = token_stream_new(text, NULL);
+        for (size_t t = 0; t <= count && ok; t++) {
+            Token token = token_stream_next(&stream);
+            ok = token.type == decoded.items[t].type && token.start == decoded.items[t].start && token.len == decoded.items[t].len;
+            if (ok && token.type == TOKEN_NUM) ok = token.is_int == decoded.items[t].is_int && token.integer == decoded.items[t].integer;
+            if (ok && token.type == TOKEN_IDENTIFIER) ok = token.hash == decoded.items[t].hash && token.builtin == decoded.items[t].builtin;
+        }
+
+        ChunkReader reader = {.text = text, .len = len};
+        stream = token_stream_source((LexerSource){.read = read_chunk, .context = &reader}, NULL);
+        for (size_t t = 0; t <= count && ok; t++) {
+            Token token = token_stream_next(&stream);
+            Token want = decoded.items[t];
+            ok = token.type == want.type && token.len == want.len && token.is_int == want.is_int &&
+                 (want.type == TOKEN_END || memcmp(token.start, want.start, want.len) == 0);
+            if (ok && want.type == TOKEN_NUM) {
+                ok = want.is_int ? token.integer == want.integer : token.num == want.num;
+            }
+            if (ok && want.type == TOKEN_IDENTIFIER) ok = token.hash == want.hash && token.builtin == want.builtin;
+        }
+        token_stream_free(&stream);
+        if (!ok) fprintf(stderr, "Tokenizing '%s' failed\n", text);
+    }
+
+    token_buffer_free(&tokens);
+    list_free(&decoded);
+    list_free(&expected);
+    free(buffer);
+
+    return ok;
+}
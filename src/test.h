@@ -4,3 +4,18 @@
 #include <stddef.h>
 
 bool get_random_str(char *buff, size_t len);
+bool stress_test(int thread_count, int iterations);
+bool optimize_test(void);
+bool pool_test(int thread_count, size_t line_count);
+bool script_test(int thread_count, size_t line_count);
+bool scratch_test(int iterations);
+bool deep_test(size_t terms);
+bool batch_test(size_t rows);
+bool string_test(void);
+bool intern_test(size_t name_count);
+bool file_test(size_t bytes);
+bool map_test(size_t key_count);
+bool vars_test(size_t op_count);
+bool number_test(size_t op_count);
+bool literal_test(size_t literal_count);
+bool lexer_test(size_t line_count);
@@ -1,5 +1,6 @@
 #include "value.h"
 #include "arena.h" 
+#include "hash.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -9,6 +10,7 @@ String string_create(const char *text, size_t len)
 {
     String str;
     str.len = len;
+    str.hash = 0;
     str.data = malloc(sizeof(char) * (str.len + 1));
     assert(text && len && "Text doesn't exist");
     memcpy(str.data, text, sizeof(char) * len);
@@ -17,17 +19,93 @@ String string_create(const char *text, size_t len)
     return str;
 }
 
+// Text of strings that outlive an evaluation. It never changes once written,
+// so every holder shares one buffer and the last one to let go frees it.
+// NaN-boxed values point at str, the others copy it.
+typedef struct {
+    String str;
+    uint32_t refs;
+    char data[];
+} StringBuf;
+
+#define STRING_BUF(string) ((StringBuf*)((string).data - offsetof(StringBuf, data)))
+
+// A string value for a temporary of the current evaluation. NaN-boxed values
+// need the String itself to outlive them, so it's copied into the arena.
+Value value_temp_string(Arena *arena, String string)
+{
+#ifdef VALUE_NANBOX
+    String *str = arena_alloc(arena, sizeof(String));
+    *str = string;
+    return VAL_STR(str);
+#else
+    (void)arena;
+    return VAL_STR(&string);
+#endif
+}
+
+// Takes a reference for storage that outlives the evaluation (variables, ans,
+// results). A refcounted string is shared, any other string is copied into a
+// new buffer once.
+Value value_retain(Value value)
+{
+    if (VALUE_TYPE(value) != VALUE_STR) return value;
+
+    if (VALUE_COUNTED(value)) {
+        __atomic_add_fetch(&STRING_BUF(AS_STR(value))->refs, 1, __ATOMIC_RELAXED);
+        return value;
+    }
+
+    String str = AS_STR(value);
+    StringBuf *buf = malloc(sizeof(StringBuf) + sizeof(char) * (str.len + 1));
+    assert(buf && "Failed to allocate a string");
+    buf->refs = 1;
+    memcpy(buf->data, str.data, sizeof(char) * str.len);
+    buf->data[str.len] = '\0';
+    // The header may be shared between threads, so its hash is filled in now
+    // rather than cached on first use.
+    buf->str = (String){.data = buf->data, .len = str.len, .hash = string_hash(&str)};
+
+#ifdef VALUE_NANBOX
+    return nanbox_from_str(&buf->str, true);
+#else
+    value = VAL_STR(&buf->str);
+    value.counted = true;
+    return value;
+#endif
+}
+
+// Drops a reference taken by value_retain, the buffer goes with the last one.
+void value_release(Value *value)
+{
+    if (VALUE_TYPE(*value) == VALUE_STR && VALUE_COUNTED(*value)) {
+        StringBuf *buf = STRING_BUF(AS_STR(*value));
+        if (__atomic_sub_fetch(&buf->refs, 1, __ATOMIC_ACQ_REL) == 0) free(buf);
+    }
+    *value = VAL_NUM(0);
+}
+
 void string_destroy(String *string)
 {
     free(string->data);
     string->data = NULL;
     string->len = 0;
+    string->hash = 0;
+}
+
+// Hash of the contents, computed on first use and kept in the string.
+uint32_t string_hash(String *string)
+{
+    if (string->hash == 0) string->hash = hash_bytes(string->data, string->len);
+
+    return string->hash;
 }
 
 String string_create_arena(Arena *arena, const char *text, size_t len)
 {
     String str;
     str.len = len;
+    str.hash = 0;
     str.data = arena_alloc(arena, sizeof(char) * (str.len + 1));
     memcpy(str.data, text, sizeof(char) * len);
     str.data[str.len] = '\0';
@@ -35,17 +113,17 @@ String string_create_arena(Arena *arena, const char *text, size_t len)
     return str;
 }
 
-void value_to_str(char *buffer, Value *value)
+void value_to_str(char *buffer, size_t len, Value *value)
 {
-    switch (value->type) {
+    switch (VALUE_TYPE(*value)) {
         case VALUE_NUM:
-            sprintf(buffer, "%0.15Lf", AS_NUM(*value));
+            snprintf(buffer, len, "%0.15Lf", AS_LONG_DOUBLE(*value));
             break;
         case VALUE_STR:
-            sprintf(buffer, "%.*s", (int)AS_STR(*value).len, AS_STR(*value).data);
+            snprintf(buffer, len, "%.*s", (int)AS_STR(*value).len, AS_STR(*value).data);
             break;
         case VALUE_BOOL:
-            sprintf(buffer, "%s", AS_BOOL(*value) ? "true" : "false");
+            snprintf(buffer, len, "%s", AS_BOOL(*value) ? "true" : "false");
             break;
     }
 }
@@ -61,13 +139,23 @@ char* value_type_to_str(ValueType type)
     return NULL;
 }
 
+// A string ending at the top of the arena is appended to in place, so a chain
+// of '+' copies every piece once. Otherwise it's copied into room for twice
+// the result, and the room left over is given back for the next '+' to use.
 String string_add(Arena *arena, String *one, String *two)
 {
     String str;
     str.len = one->len + two->len;
-    str.data = arena_alloc(arena, str.len * sizeof(char));
+    str.hash = 0;
 
-    memcpy(str.data, one->data, one->len * sizeof(char));
+    if (arena_resize(arena, one->data, one->len, str.len)) {
+        str.data = one->data;
+    }
+    else {
+        str.data = arena_alloc(arena, str.len * 2 * sizeof(char));
+        arena_resize(arena, str.data, str.len * 2, str.len);
+        memcpy(str.data, one->data, one->len * sizeof(char));
+    }
     memcpy(&str.data[one->len], two->data, two->len * sizeof(char));
 
     return str;
@@ -75,6 +163,10 @@ String string_add(Arena *arena, String *one, String *two)
 
 bool string_compare(String* one, String *two)
 {
+    // Interned strings are equal exactly when they're the same data.
+    if (one->data == two->data && one->len == two->len) return true;
+    if (one->hash && two->hash && one->hash != two->hash) return false;
+
     if (one->len == two->len) {
         return memcmp(one->data, two->data, one->len * sizeof(char)) == 0;
     }
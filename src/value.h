@@ -2,40 +2,167 @@
 
 #include <stdbool.h>
 #include <stddef.h>
+#include <stdint.h>
+#include <string.h>
 #include "arena.h"
 
+// Numbers are doubles, build with -DNUMBER_LONG_DOUBLE for long doubles.
+// Whole numbers are kept as int64 while they fit, see number.h.
+#ifdef NUMBER_LONG_DOUBLE
+#ifdef VALUE_NANBOX
+#error "NaN-boxed values hold doubles, NUMBER_LONG_DOUBLE needs the default encoding"
+#endif
+typedef long double Number;
+#define NUM_FN(name) name##l    // The libm function for Number
+#define NUM_PARSE    strtold
+#else
+typedef double Number;
+#define NUM_FN(name) name
+#define NUM_PARSE    strtod
+#endif
+
 typedef enum {
     VALUE_NUM,
     VALUE_STR,
     VALUE_BOOL,
 } ValueType;
 
+// The length and the cached hash share the second word so a String is 16
+// bytes. A hash of 0 hasn't been computed yet.
 typedef struct {
     char *data;
-    size_t len;
+    uint32_t len;
+    uint32_t hash;
 } String;
 
+#ifdef VALUE_NANBOX
+
+// 8 byte values (build with -DVALUE_NANBOX). Numbers are doubles stored as
+// is. Anything else is a quiet NaN carrying a tag: bools are immediates,
+// integers of up to 48 bits set bit 49 above their payload, and strings set
+// the sign bit and point at their String, so the String has to outlive the
+// value. Bit 0 of the pointer marks a refcounted string.
+typedef struct {
+    uint64_t bits;
+} Value;
+
+#define NANBOX_QNAN     0x7ffc000000000000ull
+#define NANBOX_SIGN     0x8000000000000000ull
+#define NANBOX_CANON    0x7ff8000000000000ull   // The only NaN numbers use
+#define NANBOX_FALSE    (NANBOX_QNAN | 2)
+#define NANBOX_TRUE     (NANBOX_QNAN | 3)
+#define NANBOX_INT      (NANBOX_QNAN | (1ull << 49))
+#define NANBOX_INT_MASK ((1ull << 48) - 1)
+#define NANBOX_INT_MAX  ((int64_t)1 << 47)  // Larger integers are stored as doubles
+#define NANBOX_COUNTED  1ull
+#define NANBOX_PTR_MASK (~(NANBOX_SIGN | NANBOX_QNAN | NANBOX_COUNTED))
+
+static inline ValueType nanbox_type(Value value)
+{
+    if ((value.bits & NANBOX_QNAN) != NANBOX_QNAN) return VALUE_NUM;
+    if (value.bits & NANBOX_SIGN) return VALUE_STR;
+
+    return (value.bits & NANBOX_INT) == NANBOX_INT ? VALUE_NUM : VALUE_BOOL;
+}
+
+#define NANBOX_IS_INT(val) (((val).bits & (NANBOX_SIGN | NANBOX_INT)) == NANBOX_INT)
+
+// Shifting the payload to the top and back sign extends it.
+static inline int64_t nanbox_int(Value value)
+{
+    return (int64_t)(value.bits << 16) >> 16;
+}
+
+static inline double nanbox_num(Value value)
+{
+    if (NANBOX_IS_INT(value)) return (double)nanbox_int(value);
+
+    double num;
+    memcpy(&num, &value.bits, sizeof(num));
+    return num;
+}
+
+static inline Value nanbox_from_num(double num)
+{
+    Value value;
+    memcpy(&value.bits, &num, sizeof(num));
+    // A NaN with other payload bits could look like a tag.
+    if (num != num) value.bits = NANBOX_CANON;
+    return value;
+}
+
+static inline Value nanbox_from_int(int64_t num)
+{
+    if (num < -NANBOX_INT_MAX || num >= NANBOX_INT_MAX) return nanbox_from_num((double)num);
+
+    return (Value){.bits = NANBOX_INT | ((uint64_t)num & NANBOX_INT_MASK)};
+}
+
+static inline Value nanbox_from_str(String *str, bool counted)
+{
+    return (Value){.bits = NANBOX_SIGN | NANBOX_QNAN | (uint64_t)(uintptr_t)str | (counted ? NANBOX_COUNTED : 0)};
+}
+
+#define VALUE_TYPE(val)    nanbox_type(val)
+#define VALUE_COUNTED(val) ((val).bits & NANBOX_COUNTED)
+
+#define IS_INT(val)  NANBOX_IS_INT(val)
+#define AS_INT(val)  nanbox_int(val)
+#define AS_NUM(val)  nanbox_num(val)
+#define AS_STR(val)  (*(String*)(uintptr_t)((val).bits & NANBOX_PTR_MASK))
+#define AS_BOOL(val) ((val).bits == NANBOX_TRUE)
+
+#define VAL_INT(val)  nanbox_from_int(val)
+#define VAL_NUM(val)  nanbox_from_num(val)
+#define VAL_STR(ptr)  nanbox_from_str((ptr), false)
+#define VAL_BOOL(val) ((Value){.bits = (val) ? NANBOX_TRUE : NANBOX_FALSE})
+
+#else
+
 typedef struct {
     ValueType type;
+    bool counted;   // The string's data is a refcounted buffer, see value_retain
+    bool is_int;    // A number held in as.integer
     union {
-        long double num;
+        Number num;
+        int64_t integer;
         String str;
         bool   bol;
     } as;
 } Value;
 
-#define AS_NUM(val)  ((val).as.num)
+#define VALUE_TYPE(val)    ((val).type)
+#define VALUE_COUNTED(val) ((val).counted)
+
+static inline Number value_num(Value value)
+{
+    return value.is_int ? (Number)value.as.integer : value.as.num;
+}
+
+#define IS_INT(val)  ((val).is_int)
+#define AS_INT(val)  ((val).as.integer)
+#define AS_NUM(val)  value_num(val)
 #define AS_STR(val)  ((val).as.str)
 #define AS_BOOL(val) ((val).as.bol)
 
+#define VAL_INT(val)  ((Value){.type = VALUE_NUM,  .is_int = true, .as = {.integer = (val)}})
 #define VAL_NUM(val)  ((Value){.type = VALUE_NUM,  .as = {.num = (val)}})
-#define VAL_STR(val)  ((Value){.type = VALUE_STR,  .as = {.str = (val)}})
+#define VAL_STR(ptr)  ((Value){.type = VALUE_STR,  .as = {.str = *(ptr)}})
 #define VAL_BOOL(val) ((Value){.type = VALUE_BOOL, .as = {.bol = (val)}})
 
+#endif
+
+// A number for printf's %Lf, integers too large for Number stay exact.
+#define AS_LONG_DOUBLE(val) (IS_INT(val) ? (long double)AS_INT(val) : (long double)AS_NUM(val))
+
 String string_create(const char *text, size_t len);
 void string_destroy(String *string);
+uint32_t string_hash(String *string);
 String string_create_arena(Arena *arena, const char *text, size_t len);
 bool string_compare(String* one, String *two);
 String string_add(Arena *arena, String *one, String *two);
-void value_to_str(char *buffer, Value *value);
+Value value_temp_string(Arena *arena, String string);
+Value value_retain(Value value);
+void value_release(Value *value);
+void value_to_str(char *buffer, size_t len, Value *value);
 char* value_type_to_str(ValueType type);
@@ -0,0 +1,126 @@
+#include "vars.h"
+#include "intern.h"
+#include <stdlib.h>
+
+static uint32_t next_id = 0;
+
+// Ids are shared by every thread's tables, 0 is left for zeroed refs.
+static uint32_t new_id(void)
+{
+    return __atomic_add_fetch(&next_id, 1, __ATOMIC_RELAXED);
+}
+
+Vars vars_new(void)
+{
+    Vars vars = {0};
+    vars.index = map_new();
+    vars.id = new_id();
+
+    return vars;
+}
+
+static void free_values(Vars *vars)
+{
+    size_t iter = 0;
+    for (VarSlot *slot = vars_next(vars, &iter); slot; slot = vars_next(vars, &iter)) {
+        value_release(&slot->value);
+        intern_release(&slot->name);
+    }
+}
+
+void vars_delete(Vars *vars)
+{
+    free_values(vars);
+    map_delete(&vars->index);
+    list_free(&vars->slots);
+    list_free(&vars->free);
+    vars->count = 0;
+}
+
+// Removes every variable. The new id makes every ref to the old slots stale.
+void vars_clear(Vars *vars)
+{
+    if (vars->slots.count == 0) return;
+
+    free_values(vars);
+    map_clear(&vars->index);
+    list_clear(&vars->slots);
+    list_clear(&vars->free);
+    vars->count = 0;
+    vars->id = new_id();
+}
+
+static Value* found(Vars *vars, uint32_t slot, VarRef *ref)
+{
+    if (ref) *ref = (VarRef){.table = vars->id, .slot = slot, .version = vars->slots.items[slot].version};
+
+    return &vars->slots.items[slot].value;
+}
+
+Value* vars_lookup(Vars *vars, String name, VarRef *ref)
+{
+    size_t *slot = map_get_ptr(&vars->index, name);
+    if (!slot) return NULL;
+
+    return found(vars, (uint32_t)*slot, ref);
+}
+
+// Stores value, whose reference the table takes over, creating the variable
+// if needed. The old value of an existing variable is released.
+Value* vars_set(Vars *vars, String name, VarRef *ref, Value value)
+{
+    Value *stored = vars_get(vars, name, ref);
+
+    if (!stored) {
+        Map_Node *node = map_entry(&vars->index, name, NULL);
+
+        uint32_t slot;
+        if (vars->free.count > 0) slot = vars->free.items[--vars->free.count];
+        else {
+            list_push(&vars->slots, ((VarSlot){0}));
+            slot = vars->slots.count - 1;
+        }
+
+        // The entry's key has the hash filled in.
+        vars->slots.items[slot].name = intern_string(node->key);
+        vars->slots.items[slot].value = VAL_NUM(0);
+        node->key = vars->slots.items[slot].name;
+        node->value = slot;
+        vars->count++;
+        stored = found(vars, slot, ref);
+    }
+    else {
+        value_release(stored);
+    }
+
+    *stored = value;
+
+    return stored;
+}
+
+bool vars_remove(Vars *vars, String name)
+{
+    Map_Node removed;
+    if (!map_remove(&vars->index, name, &removed)) return false;
+
+    uint32_t index = (uint32_t)removed.value;
+    VarSlot *slot = &vars->slots.items[index];
+    value_release(&slot->value);
+    intern_release(&slot->name);
+    slot->version++;
+    list_push(&vars->free, index);
+    vars->count--;
+
+    return true;
+}
+
+// Walks the variables in slot order, start with *iter = 0.
+VarSlot* vars_next(Vars *vars, size_t *iter)
+{
+    while (*iter < vars->slots.count) {
+        VarSlot *slot = &vars->slots.items[(*iter)++];
+        if (slot->name.data) return slot;
+    }
+
+    return NULL;
+}
@@ -0,0 +1,54 @@
+#pragma once
+
+#include "list.h"
+#include "map.h"
+#include "value.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// A variable lives in a slot whose index doesn't change while it exists, so
+// compiled code can remember the slot instead of hashing the name each time.
+typedef struct {
+    String name;        // Interned, NULL data when the slot is free
+    Value value;        // Retained, released with the slot
+    uint32_t version;   // Bumped when the slot is freed, refs to it go stale
+} VarSlot;
+
+LIST_DEF(VarSlotList, VarSlot);
+LIST_DEF(VarFreeList, uint32_t);
+
+// Where a name was last found. A zeroed ref never matches.
+typedef struct {
+    uint32_t table;
+    uint32_t slot;
+    uint32_t version;
+} VarRef;
+
+typedef struct {
+    Map index;          // name -> slot, keys share the slots' names
+    VarSlotList slots;
+    VarFreeList free;
+    size_t count;
+    uint32_t id;        // Unique per table, renewed by vars_clear
+} Vars;
+
+Vars vars_new(void);
+void vars_delete(Vars *vars);
+void vars_clear(Vars *vars);
+Value* vars_lookup(Vars *vars, String name, VarRef *ref);
+Value* vars_set(Vars *vars, String name, VarRef *ref, Value value);
+bool vars_remove(Vars *vars, String name);
+VarSlot* vars_next(Vars *vars, size_t *iter);
+
+// The variable's value, NULL if it doesn't exist. ref may be NULL, otherwise
+// a still valid ref skips the hash lookup and a stale one is updated.
+static inline Value* vars_get(Vars *vars, String name, VarRef *ref)
+{
+    if (ref && ref->table == vars->id && ref->slot < vars->slots.count) {
+        VarSlot *slot = &vars->slots.items[ref->slot];
+        if (slot->version == ref->version) return &slot->value;
+    }
+
+    return vars_lookup(vars, name, ref);
+}
@@ -0,0 +1,483 @@
+#include "vm.h"
+#include "expr.h"
+#include "intern.h"
+#include "list.h"
+#include "map.h"
+#include "parser.h"
+#include "value.h"
+#include "number.h"
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if (defined(__GNUC__) || defined(__clang__)) && !defined(VM_NO_COMPUTED_GOTO)
+  #define VM_COMPUTED_GOTO
+#endif
+
+static const char* op_names[OP_COUNT] = {
+    "CONST",
+    "ANS",
+    "LOAD",
+    "NEG",
+    "NOT",
+    "ADD",
+    "SUB",
+    "MUL",
+    "DIV",
+    "POW",
+    "EQ",
+    "NEQ",
+    "LESS",
+    "LESSEQ",
+    "GREATER",
+    "GREATEREQ",
+    "OR",
+    "AND",
+    "CALL",
+    "LET",
+    "EXPORT",
+    "IMPORT",
+    "DROP",
+    "EXIT",
+    "RETURN",
+};
+
+Chunk chunk_new(void)
+{
+    Chunk chunk;
+    chunk.code = list_new(ByteList);
+    chunk.constants = list_new(ValueList);
+    chunk.names = list_new(StringList);
+    chunk.refs = list_new(VarRefList);
+    chunk.max_stack = 0;
+
+    return chunk;
+}
+
+void chunk_destroy(Chunk *chunk)
+{
+    for (size_t i = 0; i < chunk->constants.count; i++) {
+        value_release(&chunk->constants.items[i]);
+    }
+    for (size_t i = 0; i < chunk->names.count; i++) {
+        intern_release(&chunk->names.items[i]);
+    }
+    list_free(&chunk->code);
+    list_free(&chunk->constants);
+    list_free(&chunk->names);
+    list_free(&chunk->refs);
+    chunk->max_stack = 0;
+}
+
+typedef struct {
+    Expr *expr;
+    Chunk *chunk;
+    Map names;      // Name -> its index in chunk->names, made on the first name
+    size_t depth;
+    bool error;
+} Compiler;
+
+static void emit_byte(Compiler *compiler, uint8_t byte)
+{
+    list_push(&compiler->chunk->code, byte);
+}
+
+static void emit_u16(Compiler *compiler, OpCode op, size_t operand)
+{
+    if (operand > UINT16_MAX) {
+        compiler->error = true;
+        return;
+    }
+
+    emit_byte(compiler, op);
+    emit_byte(compiler, operand & 0xff);
+    emit_byte(compiler, (operand >> 8) & 0xff);
+}
+
+// Moves the simulated stack pointer, keeping track of the deepest point.
+static void stack_effect(Compiler *compiler, int effect)
+{
+    compiler->depth += effect;
+    if (compiler->depth > compiler->chunk->max_stack) {
+        compiler->chunk->max_stack = compiler->depth;
+    }
+}
+
+static size_t add_constant(Compiler *compiler, Value value)
+{
+    list_push(&compiler->chunk->constants, value_retain(value));
+
+    return compiler->chunk->constants.count - 1;
+}
+
+static size_t add_name(Compiler *compiler, String name)
+{
+    StringList *names = &compiler->chunk->names;
+
+    // Names are interned and carry their hash, so a lookup is one probe and
+    // a pointer compare however many distinct names the chunk has.
+    if (!compiler->names.table.ctrl) compiler->names = map_new();
+    bool inserted;
+    Map_Node *node = map_entry(&compiler->names, name, &inserted);
+    if (inserted) {
+        node->value = names->count;
+        list_push(names, intern_retain(name));
+        list_push(&compiler->chunk->refs, ((VarRef){0}));
+    }
+
+    return node->value;
+}
+
+static OpCode binary_op(TokenType type)
+{
+    switch (type) {
+        case TOKEN_PLUS:      return OP_ADD;
+        case TOKEN_MINUS:     return OP_SUB;
+        case TOKEN_STAR:      return OP_MUL;
+        case TOKEN_SLASH:     return OP_DIV;
+        case TOKEN_CARET:     return OP_POW;
+        case TOKEN_EQEQ:      return OP_EQ;
+        case TOKEN_NOTEQ:     return OP_NEQ;
+        case TOKEN_LESS:      return OP_LESS;
+        case TOKEN_LESSEQ:    return OP_LESSEQ;
+        case TOKEN_GREATER:   return OP_GREATER;
+        case TOKEN_GREATEREQ: return OP_GREATEREQ;
+        case TOKEN_OR:        return OP_OR;
+        case TOKEN_AND:       return OP_AND;
+        default:              return OP_COUNT;
+    }
+}
+
+// Emits a node, its operands' code has already been emitted.
+static void compile_node(Compiler *compiler, Node *node)
+{
+    switch (node->type) {
+        case NODE_VALUE:
+            emit_u16(compiler, OP_CONST, add_constant(compiler, node->as.value));
+            stack_effect(compiler, 1);
+            break;
+        case NODE_ANS:
+            emit_byte(compiler, OP_ANS);
+            stack_effect(compiler, 1);
+            break;
+        case NODE_VAR:
+            emit_u16(compiler, OP_LOAD, add_name(compiler, node->as.name));
+            stack_effect(compiler, 1);
+            break;
+        case NODE_UNARY:
+            if (node->op == TOKEN_NOT) emit_byte(compiler, OP_NOT);
+            else if (node->op == TOKEN_MINUS) emit_byte(compiler, OP_NEG);
+            break;
+        case NODE_BINARY:
+            if (binary_op(node->op) == OP_COUNT) {
+                compiler->error = true;
+                break;
+            }
+            emit_byte(compiler, binary_op(node->op));
+            stack_effect(compiler, -1);
+            break;
+        case NODE_CALL:
+            emit_byte(compiler, OP_CALL);
+            emit_byte(compiler, node->func);
+            stack_effect(compiler, 1 - math_func_arity(node->func));
+            break;
+        case NODE_LET:
+            emit_u16(compiler, OP_LET, add_name(compiler, node->as.name));
+            break;
+        case NODE_EXPORT:
+            emit_u16(compiler, OP_EXPORT, add_name(compiler, node->as.name));
+            break;
+        case NODE_IMPORT:
+            emit_byte(compiler, OP_IMPORT);
+            stack_effect(compiler, -1);
+            break;
+        case NODE_DROP:
+            emit_u16(compiler, OP_DROP, add_name(compiler, node->as.name));
+            stack_effect(compiler, 1);
+            break;
+        case NODE_EXIT:
+            emit_byte(compiler, OP_EXIT);
+            stack_effect(compiler, 1);
+            break;
+    }
+}
+
+bool chunk_compile(Expr *expr, Chunk *chunk)
+{
+    chunk_destroy(chunk);
+
+    if (expr->root == NO_NODE) return false;
+
+    // Operands are emitted before the node using them, walking the tree in
+    // post-order with an explicit stack so deep trees can't overflow the C
+    // stack.
+    Compiler compiler = {.expr = expr, .chunk = chunk, .depth = 0, .error = false};
+    ExprStack walk = {0};
+    expr_walk_start(expr, &walk, expr->root);
+    for (NodeId id = expr_walk_next(expr, &walk); id != NO_NODE && !compiler.error; id = expr_walk_next(expr, &walk)) {
+        compile_node(&compiler, &expr->nodes.items[id]);
+    }
+    list_free(&walk);
+    map_delete(&compiler.names);
+    emit_byte(&compiler, OP_RETURN);
+
+    if (compiler.error) {
+        chunk_destroy(chunk);
+        return false;
+    }
+
+    return true;
+}
+
+void chunk_disassemble(Chunk *chunk, FILE *out)
+{
+    char buffer[100];
+    size_t offset = 0;
+
+    while (offset < chunk->code.count) {
+        uint8_t op = chunk->code.items[offset];
+        fprintf(out, "%04zu %-10s", offset, op < OP_COUNT ? op_names[op] : "???");
+        offset += 1;
+
+        switch (op) {
+            case OP_CONST: {
+                size_t index = chunk->code.items[offset] | (chunk->code.items[offset + 1] << 8);
+                Value constant = chunk->constants.items[index];
+                if (VALUE_TYPE(constant) == VALUE_STR) {
+                    fprintf(out, " %4zu '%.*s'", index, (int)AS_STR(constant).len, AS_STR(constant).data);
+                }
+                else {
+                    value_to_str(buffer, sizeof(buffer), &constant);
+                    fprintf(out, " %4zu %s", index, buffer);
+                }
+                offset += 2;
+                break;
+            }
+            case OP_LOAD:
+            case OP_LET:
+            case OP_EXPORT:
+            case OP_DROP: {
+                size_t index = chunk->code.items[offset] | (chunk->code.items[offset + 1] << 8);
+                String name = chunk->names.items[index];
+                fprintf(out, " %4zu $%.*s", index, (int)name.len, name.data);
+                offset += 2;
+                break;
+            }
+            case OP_CALL:
+                fprintf(out, " %4d %s", chunk->code.items[offset], math_func_name(chunk->code.items[offset]));
+                offset += 1;
+                break;
+            default:
+                break;
+        }
+
+        fprintf(out, "\n");
+    }
+}
+
+Value vm_run(Parser *parser, Chunk *chunk)
+{
+    enum { local_stack_len = 64 };
+    Value local_stack[local_stack_len];
+    Value *stack = chunk->max_stack <= local_stack_len ? local_stack : malloc(sizeof(Value) * chunk->max_stack);
+    Value *sp = stack;
+    const uint8_t *ip = chunk->code.items;
+    Value result = VAL_NUM(0.0);
+    Value a, b;
+    uint16_t slot;
+    MathFunc func;
+
+    parser->error = false;
+
+    if (ip == NULL) {
+        parser->error = true;
+        goto done;
+    }
+
+    #define PUSH(value) (*sp++ = (value))
+    #define POP()       (*--sp)
+    #define TOP         (sp[-1])
+    #define READ_U16()  (ip += 2, (uint16_t)(ip[-2] | (ip[-1] << 8)))
+    #define CHECK()     do { if (parser->error) goto done; } while (0)
+
+    // Numbers take the inline path, everything else goes through
+    // do_operation for the type checks and error messages.
+    #define BINARY(token, operand_type, value)                          \
+        do {                                                            \
+            b = POP();                                                  \
+            a = TOP;                                                    \
+            if (VALUE_TYPE(a) == operand_type && VALUE_TYPE(b) == operand_type) { \
+                TOP = value;                                            \
+            }                                                           \
+            else {                                                      \
+                TOP = do_operation(parser, a, b, token);                \
+                CHECK();                                                \
+            }                                                           \
+        } while (0)
+
+#ifdef VM_COMPUTED_GOTO
+    static void *const labels[OP_COUNT] = {
+        [OP_CONST]     = &&op_const,
+        [OP_ANS]       = &&op_ans,
+        [OP_LOAD]      = &&op_load,
+        [OP_NEG]       = &&op_neg,
+        [OP_NOT]       = &&op_not,
+        [OP_ADD]       = &&op_add,
+        [OP_SUB]       = &&op_sub,
+        [OP_MUL]       = &&op_mul,
+        [OP_DIV]       = &&op_div,
+        [OP_POW]       = &&op_pow,
+        [OP_EQ]        = &&op_eq,
+        [OP_NEQ]       = &&op_neq,
+        [OP_LESS]      = &&op_less,
+        [OP_LESSEQ]    = &&op_lesseq,
+        [OP_GREATER]   = &&op_greater,
+        [OP_GREATEREQ] = &&op_greatereq,
+        [OP_OR]        = &&op_or,
+        [OP_AND]       = &&op_and,
+        [OP_CALL]      = &&op_call,
+        [OP_LET]       = &&op_let,
+        [OP_EXPORT]    = &&op_export,
+        [OP_IMPORT]    = &&op_import,
+        [OP_DROP]      = &&op_drop,
+        [OP_EXIT]      = &&op_exit,
+        [OP_RETURN]    = &&op_return,
+    };
+    #define DISPATCH()    goto *labels[*ip++]
+    #define TARGET(label) label:
+    DISPATCH();
+#else
+    #define DISPATCH()    continue
+    #define TARGET(label) case label##_op:
+    enum {
+        op_const_op = OP_CONST, op_ans_op = OP_ANS, op_load_op = OP_LOAD, op_neg_op = OP_NEG,
+        op_not_op = OP_NOT, op_add_op = OP_ADD, op_sub_op = OP_SUB, op_mul_op = OP_MUL,
+        op_div_op = OP_DIV, op_pow_op = OP_POW, op_eq_op = OP_EQ, op_neq_op = OP_NEQ,
+        op_less_op = OP_LESS, op_lesseq_op = OP_LESSEQ, op_greater_op = OP_GREATER,
+        op_greatereq_op = OP_GREATEREQ, op_or_op = OP_OR, op_and_op = OP_AND,
+        op_call_op = OP_CALL, op_let_op = OP_LET, op_export_op = OP_EXPORT,
+        op_import_op = OP_IMPORT, op_drop_op = OP_DROP, op_exit_op = OP_EXIT, op_return_op = OP_RETURN,
+    };
+    for (;;) switch (*ip++)
+#endif
+    {
+        TARGET(op_const)
+            PUSH(chunk->constants.items[READ_U16()]);
+            DISPATCH();
+        TARGET(op_ans)
+            PUSH(parser->ans);
+            DISPATCH();
+        TARGET(op_load)
+            slot = READ_U16();
+            PUSH(load_var(parser, chunk->names.items[slot], &chunk->refs.items[slot]));
+            CHECK();
+            DISPATCH();
+        TARGET(op_neg)
+            if (VALUE_TYPE(TOP) == VALUE_NUM) TOP = num_neg(TOP);
+            else {
+                TOP = do_unary(parser, TOP, TOKEN_MINUS);
+                CHECK();
+            }
+            DISPATCH();
+        TARGET(op_not)
+            if (VALUE_TYPE(TOP) == VALUE_BOOL) TOP = VAL_BOOL(!AS_BOOL(TOP));
+            else {
+                TOP = do_unary(parser, TOP, TOKEN_NOT);
+                CHECK();
+            }
+            DISPATCH();
+        TARGET(op_add)
+            BINARY(TOKEN_PLUS, VALUE_NUM, num_add(a, b));
+            DISPATCH();
+        TARGET(op_sub)
+            BINARY(TOKEN_MINUS, VALUE_NUM, num_sub(a, b));
+            DISPATCH();
+        TARGET(op_mul)
+            BINARY(TOKEN_STAR, VALUE_NUM, num_mul(a, b));
+            DISPATCH();
+        TARGET(op_div)
+            BINARY(TOKEN_SLASH, VALUE_NUM, num_div(a, b));
+            DISPATCH();
+        TARGET(op_pow)
+            BINARY(TOKEN_CARET, VALUE_NUM, num_pow(a, b));
+            DISPATCH();
+        TARGET(op_eq)
+            BINARY(TOKEN_EQEQ, VALUE_NUM, VAL_BOOL(NUM_CMP(a, ==, b)));
+            DISPATCH();
+        TARGET(op_neq)
+            BINARY(TOKEN_NOTEQ, VALUE_NUM, VAL_BOOL(NUM_CMP(a, !=, b)));
+            DISPATCH();
+        TARGET(op_less)
+            BINARY(TOKEN_LESS, VALUE_NUM, VAL_BOOL(NUM_CMP(a, <, b)));
+            DISPATCH();
+        TARGET(op_lesseq)
+            BINARY(TOKEN_LESSEQ, VALUE_NUM, VAL_BOOL(NUM_CMP(a, <=, b)));
+            DISPATCH();
+        TARGET(op_greater)
+            BINARY(TOKEN_GREATER, VALUE_NUM, VAL_BOOL(NUM_CMP(a, >, b)));
+            DISPATCH();
+        TARGET(op_greatereq)
+            BINARY(TOKEN_GREATEREQ, VALUE_NUM, VAL_BOOL(NUM_CMP(a, >=, b)));
+            DISPATCH();
+        TARGET(op_or)
+            BINARY(TOKEN_OR, VALUE_BOOL, VAL_BOOL(AS_BOOL(a) || AS_BOOL(b)));
+            DISPATCH();
+        TARGET(op_and)
+            BINARY(TOKEN_AND, VALUE_BOOL, VAL_BOOL(AS_BOOL(a) && AS_BOOL(b)));
+            DISPATCH();
+        TARGET(op_call)
+            func = (MathFunc)*ip++;
+            switch (math_func_arity(func)) {
+                case 0:
+                    PUSH(math_call(func, VAL_NUM(0.0), VAL_NUM(0.0)));
+                    break;
+                case 1:
+                    TOP = math_call(func, TOP, VAL_NUM(0.0));
+                    break;
+                default:
+                    b = POP();
+                    TOP = math_call(func, TOP, b);
+                    break;
+            }
+            DISPATCH();
+        TARGET(op_let)
+            slot = READ_U16();
+            TOP = declare_var(parser, chunk->names.items[slot], &chunk->refs.items[slot], TOP);
+            DISPATCH();
+        TARGET(op_export)
+            slot = READ_U16();
+            TOP = export_var(parser, chunk->names.items[slot], TOP);
+            CHECK();
+            DISPATCH();
+        TARGET(op_import)
+            b = POP();
+            TOP = import_var(parser, TOP, b);
+            CHECK();
+            DISPATCH();
+        TARGET(op_drop)
+            PUSH(drop_var(parser, chunk->names.items[READ_U16()]));
+            DISPATCH();
+        TARGET(op_exit)
+            parser->exit = true;
+            parser->error = true;
+            goto done;
+        TARGET(op_return)
+            result = POP();
+            goto done;
+    }
+
+    #undef PUSH
+    #undef POP
+    #undef TOP
+    #undef READ_U16
+    #undef CHECK
+    #undef BINARY
+    #undef DISPATCH
+    #undef TARGET
+
+done:
+    if (stack != local_stack) free(stack);
+
+    return finish_eval(parser, result);
+}
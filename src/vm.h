@@ -0,0 +1,59 @@
+#pragma once
+
+#include "expr.h"
+#include "list.h"
+#include "parser.h"
+#include "value.h"
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+typedef enum {
+    OP_CONST,    // u16 constant index
+    OP_ANS,
+    OP_LOAD,     // u16 name index
+    OP_NEG,
+    OP_NOT,
+    OP_ADD,
+    OP_SUB,
+    OP_MUL,
+    OP_DIV,
+    OP_POW,
+    OP_EQ,
+    OP_NEQ,
+    OP_LESS,
+    OP_LESSEQ,
+    OP_GREATER,
+    OP_GREATEREQ,
+    OP_OR,
+    OP_AND,
+    OP_CALL,     // u8 MathFunc
+    OP_LET,      // u16 name index
+    OP_EXPORT,   // u16 name index
+    OP_IMPORT,
+    OP_DROP,     // u16 name index
+    OP_EXIT,
+    OP_RETURN,
+    OP_COUNT,
+} OpCode;
+
+LIST_DEF(ByteList, uint8_t);
+LIST_DEF(StringList, String);
+LIST_DEF(VarRefList, VarRef);
+
+// Flat bytecode for a stack machine. Its string constants and interned
+// variable names hold references of their own, so it stays valid after the
+// Expr it was compiled from is destroyed.
+typedef struct {
+    ByteList code;
+    ValueList constants;
+    StringList names;
+    VarRefList refs;    // Where each name was last found, refreshed when stale
+    size_t max_stack;
+} Chunk;
+
+Chunk chunk_new(void);
+void chunk_destroy(Chunk *chunk);
+bool chunk_compile(Expr *expr, Chunk *chunk);
+void chunk_disassemble(Chunk *chunk, FILE *out);
+Value vm_run(Parser *parser, Chunk *chunk);